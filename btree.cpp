@@ -1,13 +1,23 @@
 // btree.cpp
 
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
 #include <iostream>
-#include <math.h>
+#include <new>
+#include <unordered_map>
+#include <vector>
 #include "btree.h"
+#include "btree_cursor.h"
+#include "btree_lookaside.h"
+#include "btree_stats.h"
+#include "btree_trace.h"
 
 using namespace std;
 
 void print_tree(btree* &root);
-void remove_from_node(btree* node, btree*& root, int key);
+btree_position lookup_node(btree* node, btree_key key);
+void fix_underfull_children(btree* node);
 
 void print_node(btree* node, int level) {
   cout << "Level " << level << "(leaf:" << node->is_leaf << ", numkeys:" << node->num_keys << ")" << endl;
@@ -35,17 +45,72 @@ void pt(btree* root) {
   print_tree(root);
 }
 
+// alloc_node returns a new, empty node. All nodes the tree creates come
+// from here and go back through free_node, so the allocation counters
+// stay accurate.
+btree* alloc_node(bool is_leaf) {
+  btree* node = new btree;
+  node->num_keys = 0;
+  node->is_leaf = is_leaf;
+  node->block_slot = 0;
+  for (int i=0; i <= BTREE_ORDER; i++) {
+    node->children[i] = NULL;
+  }
+  // Whatever makes the node a root sets its epoch: a new tree takes a new one, and a
+  // root grown above an old one carries the tree's epoch on.
+  node->epoch = 0;
+  count_event(BTREE_NODES_ALLOCATED);
+  return node;
+}
+
+// node_block is a run of nodes relayout allocates in one piece, about a page's worth. The
+// nodes come first, so the block starts where its first node does, and a node finds it
+// from its own block_slot. Blocks are page aligned, and go back to the heap with the last
+// of their nodes.
+// Nodes of one block can end up in different trees (after a split, say) and be freed on
+// different threads, so the count is atomic, but it is only ever shared by one block.
+#define NODE_BLOCK_NODES ((int) ((4096 - sizeof(atomic<int>)) / sizeof(btree)))
+
+struct node_block {
+  btree nodes[NODE_BLOCK_NODES];
+  atomic<int> live;
+};
+
+// release_node gives a node's memory back, once nothing can point at it.
+void release_node(btree* node) {
+  if (node->block_slot == 0) {
+    delete node;
+    return;
+  }
+  node_block* block = (node_block*) (node - (node->block_slot - 1));
+  if (block->live.fetch_sub(1, memory_order_acq_rel) == 1) {
+    free(block);
+  }
+}
+
+// free_node takes a node out of use. While a lookaside table is attached to the tree the
+// table takes the node, since its entries may still point there, and releases it later.
+void free_node(btree* node) {
+  count_event(BTREE_NODES_FREED);
+  nodes_released();
+  if (btree_thread_lookaside != NULL) {
+    lookaside_forget(btree_thread_lookaside, node);
+    return;
+  }
+  release_node(node);
+}
+
 btree* find_parent(btree* node, btree*& root) {
   // If the root node is equal to the target node, return null, since there is no parent node.
   if (node == root) {
     return NULL;
   }
 
-  int first_key_of_node = node->keys[0];
+  btree_key first_key_of_node = node->keys[0];
 
   // Scan the key values of the root node to see if the first key of the target node is present.
   // If it is, return null since there is no parent node.
-  for (int i = 0; i < root->num_keys + 1; i++) {
+  for (int i = 0; i < root->num_keys; i++) {
     if (root->keys[i] == first_key_of_node) {
       return NULL;
     }
@@ -55,7 +120,7 @@ btree* find_parent(btree* node, btree*& root) {
   // we’re looking at, check if the child node linked from the left of the key we’re looking at is
   // equal to the target node.
   for (int j = 0; j < root->num_keys; j++) {
-    int key = root->keys[j];
+    btree_key key = root->keys[j];
     if (first_key_of_node < key) {
       btree* child = root->children[j];
       if (child == node) {
@@ -81,106 +146,77 @@ btree* find_parent(btree* node, btree*& root) {
   }
 }
 
-void split_node(btree* node, btree*& root) {
-  // Find the median key (the key at index ceil(order / 2)).
-  int median_key_index = ceil(node->num_keys / 2);
-  int median_key = node->keys[median_key_index];
-
-  // Create two new arrays (“lower_keys” and “higher_keys”) containing keys lower than and
-  // greater than the median key respectively.
-  int lower_keys[BTREE_ORDER];
-  int higher_keys[BTREE_ORDER];
-
-  int lower_count = 0;
-  int higher_count = 0;
-  for (int i = 0; i < node->num_keys; i++) {
-    int key = node->keys[i];
-    if (key < median_key) {
-      lower_keys[lower_count] = key;
-      lower_count++;
-    } else if (key > median_key) {
-      higher_keys[higher_count] = key;
-      higher_count++;
+// split_child_at splits the overfull child at 'child_index' of 'parent' after its first
+// 'left_count' keys. The key at index left_count moves up into the parent, and the keys
+// (and, for inner nodes, the children) to its right move to a new sibling just after the
+// child. The parent may be left overfull.
+void split_child_at(btree* parent, int child_index, int left_count) {
+  count_event(BTREE_SPLITS);
+  btree* node = parent->children[child_index];
+
+  // Keys to the left of the split key stay in this node, keys to its right move to a new
+  // sibling, and the split key moves up to the parent.
+  int median_key_index = left_count;
+  btree_key median_key = node->keys[median_key_index];
+  BTREE_TRACE(BTREE_TRACE_EVENTS, TRACE_SPLIT, node, median_key);
+
+  // Create the new sibling and give it the keys (and, for inner nodes, the children) to the
+  // right of the median.
+  btree* new_node = alloc_node(node->is_leaf);
+  new_node->num_keys = node->num_keys - median_key_index - 1;
+  for (int l = 0; l < new_node->num_keys; l++) {
+    new_node->keys[l] = node->keys[median_key_index + 1 + l];
+  }
+  if (!node->is_leaf) {
+    for (int l = 0; l <= new_node->num_keys; l++) {
+      new_node->children[l] = node->children[median_key_index + 1 + l];
     }
   }
 
-  // Set current node’s keys to the lower_keys, and set the current node’s num_keys to the
-  // count of prior key values lower than the median key.
-  node->num_keys = lower_count;
-  for (int j = 0; j < node->num_keys; j++) {
-    node->keys[j] = lower_keys[j];
+  // The current node keeps everything to the left of the median.
+  node->num_keys = median_key_index;
+
+  // The median key goes in at the child's index, and the new sibling goes in just after it.
+  for (int i = parent->num_keys; i > child_index; i--) {
+    parent->keys[i] = parent->keys[i - 1];
+    parent->children[i + 1] = parent->children[i];
   }
+  parent->keys[child_index] = median_key;
+  parent->children[child_index + 1] = new_node;
+  parent->num_keys++;
+}
 
+// split_child splits the overfull child at 'child_index' of 'parent' at its median key
+// (the key at index num_keys / 2).
+void split_child(btree* parent, int child_index) {
+  split_child_at(parent, child_index, parent->children[child_index]->num_keys / 2);
+}
+
+void split_node(btree* node, btree*& root) {
   btree* parent;
   if (node == root) {
     // If the target node is the root node, create a new btree node and update the root node
-    // pointer to point to it. This new node is now our parent node.
-    btree* new_root = new btree;
+    // pointer to point to it. This new node is now our parent node, with the current node as
+    // its only child.
+    count_event(BTREE_ROOT_GROWS);
+    BTREE_TRACE(BTREE_TRACE_EVENTS, TRACE_ROOT_GROW, node, node->keys[node->num_keys / 2]);
+    btree* new_root = alloc_node(false);
+    new_root->epoch = root->epoch;
     root = new_root;
-    root->is_leaf = false;
-    root->num_keys = 0;
-    for (int i=0; i <= BTREE_ORDER; i++) {
-      root->children[i] = NULL;
-    }
+    root->children[0] = node;
     parent = root;
   } else {
-    // Otherwise, find the current node’s parent node using the `find_parent` function.
+    // Otherwise, find the current node’s parent node using the `find_parent` function. This
+    // has to happen before we change the node's keys, since find_parent navigates by them.
     parent = find_parent(node, root);
   }
 
-  // We iterate through the parent node’s keys, adding each key to the new array until we
-  // encounter a value that is larger than the median key. We then add the median key to the
-  // new array. Then add the remainder of the parent node’s keys. Then we increment the value
-  // of the parent node’s num_keys.
-  int key_insertion_index;
-
-  if (parent->num_keys == 0) {
-    parent->keys[0] = median_key;
-    parent->num_keys = 1;
-    key_insertion_index = 0;
-  } else {
-    bool key_inserted = false;
-    for (int i = 0; i < parent->num_keys; i++) {
-      int key = parent->keys[i];
-      if (!key_inserted && median_key < key) {
-        parent->keys[i] = median_key;
-        key_inserted = true;
-        key_insertion_index = i;
-      }
-
-      int insertion_index = key_inserted ? i + 1 : i;
-      parent->keys[insertion_index] = key;
-    }
-  }
-
-  // Now create a new children array in the same fashion, inserting a reference to the current
-  // node at index (key insertion index). Then create a new btree node with keys set to
-  // higher_keys, and insert a reference to it in the children array at index (key insertion index + 1).
-  btree* parent_children[BTREE_ORDER + 1];
-  bool children_inserted = false;
-
-  btree* new_node = new btree;
-  new_node->num_keys = higher_count;
-  new_node->is_leaf = true;
-  for (int i=0; i <= BTREE_ORDER; i++) {
-    new_node->children[i] = NULL;
-  }
-  for (int l = 0; l < higher_count; l++) {
-    new_node->keys[l] = higher_keys[l];
-  }
-
-  for (int k = 0; k < parent->num_keys + 1; k++) {
-    if (!children_inserted && k == key_insertion_index) {
-      parent->children[k] = node;
-      parent->children[k+1] = new_node;
-      children_inserted = true;
-    }
-
-    btree* child = parent->children[k];
-
-    int insertion_index = children_inserted ? k + 2 : k;
-    parent_children[insertion_index] = child;
+  // Find the current node's index in the parent's children array and split it there.
+  int child_index = 0;
+  while (parent->children[child_index] != node) {
+    child_index++;
   }
+  split_child(parent, child_index);
 
   // Check to see if the parent is now overfull (in the manner described previously). If it is,
   // call `split_node` for the parent node.
@@ -189,41 +225,16 @@ void split_node(btree* node, btree*& root) {
   }
 }
 
-void insert_and_fix(int key, btree* insertion_node, btree*& root) {
-  // We’ll start by creating a new, empty array to hold our new key sequence.
-  int new_keys[BTREE_ORDER];
-
-  // We iterate through the existing node’s keys, adding each key to the new array
-  // until we encounter a value that is larger than the key being inserted. We then
-  // add the insertion key to the new array, and then add the remainder of the
-  // existing keys. Then we increment the value of the node’s num_keys.
-  bool key_inserted = false;
-  for (int i = 0; i < insertion_node->num_keys; i++) {
-    int existing_key = insertion_node->keys[i];
-    if (!key_inserted && key < existing_key) {
-      new_keys[i] = key;
-      key_inserted = true;
-    }
-
-    int insertion_index = key_inserted ? i + 1 : i;
-    new_keys[insertion_index] = existing_key;
+void insert_and_fix(btree_key key, btree* insertion_node, int slot, btree*& root) {
+  // 'slot' is where the key belongs: every key before it is smaller and every key from
+  // it on is larger. Shift those larger keys up one place, put the new key in the gap
+  // and increment the node's num_keys.
+  for (int i = insertion_node->num_keys; i > slot; i--) {
+    insertion_node->keys[i] = insertion_node->keys[i - 1];
   }
-
-  // If the key being inserted is the largest key in the node,
-  // or the node has no keys yet, we won't have added it yet.
-  // Add it now to the end.
-  if (!key_inserted) {
-    new_keys[insertion_node->num_keys] = key;
-  }
-
-  // Increment the number of keys in this node.
+  insertion_node->keys[slot] = key;
   insertion_node->num_keys++;
 
-  // Set the new keys.
-  for (int j = 0; j < insertion_node->num_keys; j++) {
-    insertion_node->keys[j] = new_keys[j];
-  }
-
   // There is now a possibility of the node being overfull. We’ll check this by comparing
   // num_keys to the maximum allowed number of keys (BTREE_ORDER - 1). If we are not overfull, return.
   if (insertion_node->num_keys <= BTREE_ORDER - 1) {
@@ -235,469 +246,1114 @@ void insert_and_fix(int key, btree* insertion_node, btree*& root) {
    split_node(insertion_node, root);
 }
 
-void insert(btree*& root, int key) {
+void insert(btree*& root, btree_key key) {
   // The provided pointer could be null, which means there is no existing tree.
   // We can handle this by creating one! Just create a node with the provided value
   // as a key, update the provided pointer to point at the new node, and return.
 
+  count_event(BTREE_INSERTS);
+  BTREE_TRACE(BTREE_TRACE_OPS, TRACE_INSERT, root, key);
+
   if (root == NULL) {
-    root = new btree;
+    root = alloc_node(true);
+    root->epoch = next_epoch();
     root->num_keys = 1;
-    root->is_leaf = true;
-    for (int i=0; i <= BTREE_ORDER; i++) {
-      root->children[i] = NULL;
-    }
     root->keys[0] = key;
     
     return;
   }
 
-  // Otherwise we’ll find the node that we need to insert the key into by calling the
-  // `find` function as defined above. Once we have the insertion node, we’ll check to
-  // see if it already contains the key we want to insert. If it does, just return (since
-  // one of our invariants is that all keys are unique).
-  btree* insertion_node = find(root, key);
-  for (int i = 0; i < insertion_node->num_keys; i++) {
-    if (insertion_node->keys[i] == key) {
-      return;
-    }
+  // Otherwise we’ll find the node and slot that we need to insert the key into by calling
+  // `lookup_node`, which also tells us whether the key is already there. If it is, just
+  // return (since one of our invariants is that all keys are unique).
+  btree_position position = lookup_node(root, key);
+  if (position.found) {
+    return;
   }
 
   // Otherwise we’ll call a helper function `insert_and_fix`, providing a reference to the insertion
   // node. Potential invariant violations will be corrected by the `insert_and_fix` helper method.
-  insert_and_fix(key, insertion_node, root);
+  insert_and_fix(key, position.node, position.slot, root);
 }
 
-btree* prev_sibling(btree* node, btree*& root) {
-  btree* parent = find_parent(node, root);
+// distribute_keys stores a sequence of keys (and, for an inner node, the children
+// around them) into 'node'. If there are more keys than a node can hold, it cuts the
+// sequence into as few nodes as it can, with the keys spread evenly so every piece is
+// at least minimally full. 'node' keeps the first piece; each following piece goes in
+// a new node, which is appended to up_nodes along with the key separating it from the
+// piece before it in up_keys. The caller puts those into the parent.
+void distribute_keys(btree* node, const vector<btree_key>& keys, const vector<btree*>& children,
+                     vector<btree_key>& up_keys, vector<btree*>& up_nodes) {
+  long long total = keys.size();
+
+  // A node holds at most BTREE_ORDER - 1 keys, and every piece after the first one costs a
+  // separator, so p pieces can hold p * BTREE_ORDER - 1 keys.
+  long long pieces = (total + BTREE_ORDER) / BTREE_ORDER;
+  long long piece_keys = (total - (pieces - 1)) / pieces;
+  long long extra_keys = (total - (pieces - 1)) % pieces;
+
+  long long next_key = 0;
+  for (long long p = 0; p < pieces; p++) {
+    btree* piece = node;
+    if (p > 0) {
+      up_keys.push_back(keys[next_key]);
+      next_key++;
+      piece = alloc_node(node->is_leaf);
+      up_nodes.push_back(piece);
+      count_event(BTREE_SPLITS);
+      BTREE_TRACE(BTREE_TRACE_EVENTS, TRACE_SPLIT, node, up_keys.back());
+    }
 
-  if (!parent) {
-    // We must be at a root node, which doesn't have a parent.
-    return NULL;
+    piece->num_keys = piece_keys + (p < extra_keys ? 1 : 0);
+    for (int i = 0; i < piece->num_keys; i++) {
+      piece->keys[i] = keys[next_key + i];
+    }
+    if (!piece->is_leaf) {
+      for (int i = 0; i <= piece->num_keys; i++) {
+        piece->children[i] = children[next_key + i];
+      }
+    }
+    next_key += piece->num_keys;
   }
+}
 
-  // Scan through the children on the parent to find the target node's index.
-  int child_index = -1;
-  int i = 0;
-  while (child_index < 0) {
-    if (parent->children[i] == node) {
-      child_index = i;
+// insert_run merges a sorted run of keys into the subtree rooted at 'node'. Each key is
+// routed to the child it belongs under, so the subtree is descended once for the whole
+// run rather than once per key. Children that overflow come back as extra nodes and
+// separators, which this node absorbs; if it overflows in turn, it hands its own extra
+// nodes and separators up to the caller through up_keys and up_nodes.
+void insert_run(btree* node, const btree_key* keys, long long count, vector<btree_key>& up_keys,
+                vector<btree*>& up_nodes) {
+  if (node->is_leaf) {
+    // Merge the run with the leaf's keys, dropping keys that are already present. Most
+    // runs are short enough to merge on the stack without touching the heap.
+    btree_key small_merge[BTREE_ORDER];
+    vector<btree_key> large_merge;
+    bool fits = node->num_keys + count <= BTREE_ORDER - 1;
+    if (!fits) {
+      large_merge.reserve(node->num_keys + count);
     }
-    i++;
+
+    long long merged_count = 0;
+    int i = 0;
+    long long pos = 0;
+    while (i < node->num_keys || pos < count) {
+      btree_key key;
+      if (pos == count || (i < node->num_keys && node->keys[i] < keys[pos])) {
+        key = node->keys[i];
+        i++;
+      } else {
+        if (i < node->num_keys && node->keys[i] == keys[pos]) {
+          i++;
+        }
+        key = keys[pos];
+        pos++;
+      }
+      if (fits) {
+        small_merge[merged_count] = key;
+      } else {
+        large_merge.push_back(key);
+      }
+      merged_count++;
+    }
+
+    if (fits) {
+      for (int j = 0; j < merged_count; j++) {
+        node->keys[j] = small_merge[j];
+      }
+      node->num_keys = merged_count;
+    } else {
+      distribute_keys(node, large_merge, vector<btree*>(), up_keys, up_nodes);
+    }
+    return;
   }
 
-  // If there is no previous child, there is no previous sibling.
-  if (child_index == 0) {
-    return NULL;
+  // Route the run to the children. Anything they hand back is collected, tagged with
+  // the index of the child it goes after, and only then merged into this node.
+  vector<btree_key> child_up_keys;
+  vector<btree*> child_up_nodes;
+  vector<int> child_up_index;
+  long long pos = 0;
+  for (int i = 0; i <= node->num_keys; i++) {
+    // The keys that belong under child i are the ones smaller than key i.
+    long long start = pos;
+    while (pos < count && (i == node->num_keys || keys[pos] < node->keys[i])) {
+      pos++;
+    }
+
+    if (pos > start) {
+      insert_run(node->children[i], keys + start, pos - start, child_up_keys, child_up_nodes);
+      child_up_index.resize(child_up_keys.size(), i);
+    }
+
+    // A run key equal to this separator is already in the tree.
+    if (i < node->num_keys && pos < count && keys[pos] == node->keys[i]) {
+      pos++;
+    }
+  }
+
+  if (child_up_keys.empty()) {
+    return;
+  }
+
+  vector<btree_key> merged_keys;
+  vector<btree*> merged_children;
+  merged_keys.reserve(node->num_keys + child_up_keys.size());
+  merged_children.reserve(node->num_keys + child_up_keys.size() + 1);
+  size_t next_up = 0;
+  for (int i = 0; i <= node->num_keys; i++) {
+    merged_children.push_back(node->children[i]);
+    while (next_up < child_up_keys.size() && child_up_index[next_up] == i) {
+      merged_keys.push_back(child_up_keys[next_up]);
+      merged_children.push_back(child_up_nodes[next_up]);
+      next_up++;
+    }
+    if (i < node->num_keys) {
+      merged_keys.push_back(node->keys[i]);
+    }
   }
 
-  return parent->children[child_index - 1];
+  distribute_keys(node, merged_keys, merged_children, up_keys, up_nodes);
 }
 
-btree* next_sibling(btree* node, btree*& root) {
-  btree* parent = find_parent(node, root);
+void insert_batch(btree*& root, const btree_key* keys, long long count) {
+  // The batch has to be sorted for insert_run to route it. If it isn't, fall back to
+  // inserting one key at a time.
+  for (long long i = 1; i < count; i++) {
+    if (keys[i] < keys[i - 1]) {
+      for (long long j = 0; j < count; j++) {
+        insert(root, keys[j]);
+      }
+      return;
+    }
+  }
 
-  if (!parent) {
-    // We must be at a root node, which doesn't have a parent.
-    return NULL;
+  if (count == 0) {
+    return;
   }
 
-  // Scan through the children on the parent to find the target node's index.
-  int child_index = -1;
-  int i = 0;
-  while (child_index < 0) {
-    if (parent->children[i] == node) {
-      child_index = i;
+  count_event(BTREE_INSERTS, count);
+
+  if (root == NULL) {
+    root = alloc_node(true);
+    root->epoch = next_epoch();
+  }
+
+  // Drop duplicates inside the batch so insert_run only sees strictly ascending keys.
+  vector<btree_key> run;
+  run.reserve(count);
+  for (long long i = 0; i < count; i++) {
+    if (run.empty() || run.back() != keys[i]) {
+      run.push_back(keys[i]);
     }
-    i++;
   }
 
-  // If there is no next child, there is no next sibling.
-  if (child_index == parent->num_keys) {
+  vector<btree_key> up_keys;
+  vector<btree*> up_nodes;
+  insert_run(root, &run[0], run.size(), up_keys, up_nodes);
+
+  // If the root overflowed, put a new root above it and its new siblings. A large batch
+  // can overflow the new root too, so keep going until everything fits under one node.
+  while (!up_keys.empty()) {
+    count_event(BTREE_ROOT_GROWS);
+    BTREE_TRACE(BTREE_TRACE_EVENTS, TRACE_ROOT_GROW, root, up_keys[0]);
+
+    vector<btree_key> level_keys;
+    vector<btree*> level_children;
+    level_keys.swap(up_keys);
+    level_children.push_back(root);
+    level_children.insert(level_children.end(), up_nodes.begin(), up_nodes.end());
+    up_nodes.clear();
+
+    root = alloc_node(false);
+    root->epoch = level_children[0]->epoch;
+    distribute_keys(root, level_keys, level_children, up_keys, up_nodes);
+  }
+}
+
+btree* build_tree(const btree_key* keys, long long count) {
+  btree* root = NULL;
+  for (long long i = 1; i < count; i++) {
+    if (keys[i] <= keys[i - 1]) {
+      insert_batch(root, keys, count);
+      return root;
+    }
+  }
+  if (count == 0) {
     return NULL;
   }
 
-  return parent->children[child_index + 1];
+  // Chop the keys into full leaves, then chop the separators between them into the level
+  // above, and so on until one node is left. distribute_keys spreads each level evenly, so
+  // every node is as full as it can be while its neighbours stay at least minimally full.
+  vector<btree_key> level_keys(keys, keys + count);
+  vector<btree*> level_children;
+  bool is_leaf = true;
+  while (true) {
+    btree* node = alloc_node(is_leaf);
+    vector<btree_key> up_keys;
+    vector<btree*> up_nodes;
+    distribute_keys(node, level_keys, level_children, up_keys, up_nodes);
+    if (up_nodes.empty()) {
+      node->epoch = next_epoch();
+      return node;
+    }
+
+    level_children.clear();
+    level_children.push_back(node);
+    level_children.insert(level_children.end(), up_nodes.begin(), up_nodes.end());
+    level_keys.swap(up_keys);
+    is_leaf = false;
+  }
 }
 
+// is_minimal returns true if the node holds the fewest keys a non-root node may
+// have (round_up(order / 2) - 1), so it can't give one up without underflowing.
 bool is_minimal(btree* node) {
-  bool min = node->num_keys <= (BTREE_ORDER / 2);
+  bool min = node->num_keys <= (BTREE_ORDER - 1) / 2;
   return min;
 }
 
-void merge(btree* sib_1, btree* sib_2, btree*& root) {
-  btree* parent = find_parent(sib_1, root);
-  bool is_leaf = sib_1->is_leaf;
-
-  // Find the indexes of the two siblings so that we can find the
-  // separating key.
-  int sib_1_index = -1;
-  int sib_2_index = -1;
-  int i = 0;
+// is_underfull returns true if the node holds fewer keys than a non-root node may have.
+bool is_underfull(btree* node) {
+  return node->num_keys < (BTREE_ORDER - 1) / 2;
+}
 
-  while (sib_1_index < 0 || sib_2_index < 0) {
-    if (parent->children[i] == sib_1) {
-      sib_1_index = i;
-    }
+void rotate_right(btree* parent, int separating_key_index) {
+  btree* left = parent->children[separating_key_index];
+  btree* right = parent->children[separating_key_index + 1];
 
-    if (parent->children[i] == sib_2) {
-      sib_2_index = i;
+  // Make room at the front of the right sibling.
+  for (int i = right->num_keys; i > 0; i--) {
+    right->keys[i] = right->keys[i - 1];
+  }
+  if (!right->is_leaf) {
+    for (int i = right->num_keys + 1; i > 0; i--) {
+      right->children[i] = right->children[i - 1];
     }
+  }
 
-    i++;
+  // The separating key drops into the right sibling along with the left sibling's last
+  // child, and the left sibling's largest key takes its place in the parent.
+  right->keys[0] = parent->keys[separating_key_index];
+  if (!right->is_leaf) {
+    right->children[0] = left->children[left->num_keys];
   }
+  right->num_keys++;
 
-  int separating_key_index = sib_1_index < sib_2_index ? sib_1_index : sib_2_index;
-  int separating_key = parent->keys[separating_key_index];
+  parent->keys[separating_key_index] = left->keys[left->num_keys - 1];
+  left->num_keys--;
+  count_event(BTREE_ROTATIONS);
+  BTREE_TRACE(BTREE_TRACE_EVENTS, TRACE_ROTATE_RIGHT, parent, parent->keys[separating_key_index]);
+}
 
-  int new_keys[BTREE_ORDER];
-  btree* new_children[BTREE_ORDER + 1];
-  int num_new_keys = sib_1->num_keys + sib_2->num_keys + 1;
+void rotate_left(btree* parent, int separating_key_index) {
+  btree* left = parent->children[separating_key_index];
+  btree* right = parent->children[separating_key_index + 1];
 
-  if (sib_1_index > sib_2_index) {
-    // Add sib 2 keys, then sep key, then sib 1 keys.
-    for (int i = 0; i < sib_2->num_keys; i++) {
-      new_keys[i] = sib_2->keys[i];
-      if (!is_leaf) {
-        new_children[i] = sib_2->children[i];
-      }
+  // The separating key drops onto the end of the left sibling along with the right
+  // sibling's first child, and the right sibling's smallest key takes its place in the parent.
+  left->keys[left->num_keys] = parent->keys[separating_key_index];
+  if (!left->is_leaf) {
+    left->children[left->num_keys + 1] = right->children[0];
+  }
+  left->num_keys++;
+
+  parent->keys[separating_key_index] = right->keys[0];
+
+  // Close the gap at the front of the right sibling.
+  for (int i = 1; i < right->num_keys; i++) {
+    right->keys[i - 1] = right->keys[i];
+  }
+  if (!right->is_leaf) {
+    for (int i = 1; i <= right->num_keys; i++) {
+      right->children[i - 1] = right->children[i];
     }
-    if (!is_leaf) {
-      new_children[sib_2->num_keys] = sib_2->children[sib_2->num_keys];
+  }
+  right->num_keys--;
+  count_event(BTREE_ROTATIONS);
+  BTREE_TRACE(BTREE_TRACE_EVENTS, TRACE_ROTATE_LEFT, parent, parent->keys[separating_key_index]);
+}
+
+void merge(btree* parent, int separating_key_index) {
+  btree* sib_1 = parent->children[separating_key_index];
+  btree* sib_2 = parent->children[separating_key_index + 1];
+  BTREE_TRACE(BTREE_TRACE_EVENTS, TRACE_MERGE, sib_1, parent->keys[separating_key_index]);
+
+  // Add the separating key after sib_1's keys, then sib_2's keys and children.
+  sib_1->keys[sib_1->num_keys] = parent->keys[separating_key_index];
+  for (int i = 0; i < sib_2->num_keys; i++) {
+    sib_1->keys[sib_1->num_keys + 1 + i] = sib_2->keys[i];
+  }
+  if (!sib_1->is_leaf) {
+    for (int i = 0; i <= sib_2->num_keys; i++) {
+      sib_1->children[sib_1->num_keys + 1 + i] = sib_2->children[i];
     }
+  }
+  sib_1->num_keys += sib_2->num_keys + 1;
 
-    new_keys[sib_2->num_keys] = separating_key;
+  // Move keys and children in parent after separating key down one index.
+  for (int h = separating_key_index + 1; h < parent->num_keys; h++) {
+    parent->keys[h - 1] = parent->keys[h];
+    parent->children[h] = parent->children[h + 1];
+  }
+  parent->num_keys--;
 
-    for (int i = 0; i < sib_1->num_keys; i++) {
-      new_keys[sib_2->num_keys + 1 + i] = sib_1->keys[i];
+  // Delete the useless sibling.
+  free_node(sib_2);
+  count_event(BTREE_MERGES);
+}
 
-      if (!is_leaf) {
-        new_children[sib_2->num_keys + 1 + i] = sib_1->children[i];
-      }
-    }
+void fix_for_removal(btree* parent, int child_index) {
+  // If a removal left this child with too few keys, do some work to put it back
+  // within the invariants.
+  btree* node = parent->children[child_index];
+  if (!is_underfull(node)) {
+    return;
+  }
 
-    if (!is_leaf) {
-      new_children[num_new_keys] = sib_1->children[sib_1->num_keys];
-    }
-  } else {
-    // Add keys and children from sib_1
-    for (int i = 0; i < sib_1->num_keys; i++) {
-      new_keys[i] = sib_1->keys[i];
+  btree* prev_sib = child_index > 0 ? parent->children[child_index - 1] : NULL;
+  btree* next_sib = child_index < parent->num_keys ? parent->children[child_index + 1] : NULL;
 
-      // Add children if we're not on a leaf.
-      if (!is_leaf) {
-        new_children[i] = sib_1->children[i];
-      }
-    }
+  // Case 1: At least one sibling is non-minimal.. rotate!
+  if (prev_sib && !is_minimal(prev_sib)) {
+    rotate_right(parent, child_index - 1);
+    return;
+  }
+  if (next_sib && !is_minimal(next_sib)) {
+    rotate_left(parent, child_index);
+    return;
+  }
 
-    // Add final child from sib1
-    if (!is_leaf) {
-      new_children[sib_1->num_keys] = sib_1->children[sib_1->num_keys];
-    }
+  // Case 2: All siblings are minimal... merge!
+  if (next_sib) {
+    merge(parent, child_index);
+  } else {
+    merge(parent, child_index - 1);
+  }
+}
 
-    // Add the separating key after sib1 keys
-    new_keys[sib_1->num_keys] = separating_key;
+void remove_from_leaf_node(btree* node, int slot) {
+  // 'slot' holds the key being removed. Shift every key after it down one place and
+  // decrement the node's num_keys.
+  for (int i = slot + 1; i < node->num_keys; i++) {
+    node->keys[i - 1] = node->keys[i];
+  }
+  node->num_keys--;
+}
 
-    // Add sib2's keys and children
-    for (int i = 0; i < sib_2->num_keys; i++) {
-      new_keys[sib_1->num_keys + 1 + i] = sib_2->keys[i];
+bool remove_from_node(btree* node, btree_key key) {
+  // Find the first key that is not less than the one we're removing.
+  int i = 0;
+  while (i < node->num_keys && node->keys[i] < key) {
+    i++;
+  }
 
-      // Add children if we're not on a leaf.
-      if (!is_leaf) {
-        new_children[sib_1->num_keys + 1 + i] = sib_2->children[i];
-      }
+  if (i < node->num_keys && node->keys[i] == key) {
+    if (node->is_leaf) {
+      remove_from_leaf_node(node, i);
+      return true;
     }
 
-    // Add final child from sib2
-    if (!is_leaf) {
-      new_children[num_new_keys] = sib_2->children[sib_2->num_keys];
+    // The key is in an inner node. Swap in its predecessor (the largest key in the
+    // subtree to its left), then remove the predecessor from that subtree instead.
+    btree* predecessor_node = node->children[i];
+    while (!predecessor_node->is_leaf) {
+      predecessor_node = predecessor_node->children[predecessor_node->num_keys];
     }
+    btree_key predecessor_key = predecessor_node->keys[predecessor_node->num_keys - 1];
+    node->keys[i] = predecessor_key;
+    remove_from_node(node->children[i], predecessor_key);
+    fix_for_removal(node, i);
+    return true;
   }
 
-  // Reset the number of keys for the node
-  sib_1->num_keys = num_new_keys;
+  // If we're in a leaf, but still haven't found the key, it doesn't exist in the tree.
+  if (node->is_leaf) {
+    return false;
+  }
 
-  // Add the new keys to the node
-  for (int j = 0; j < num_new_keys; j++) {
-    // cout << "Setting Key " << new_keys[j] << endl;
-    sib_1->keys[j] = new_keys[j];
+  // Remove from the child the key would live in, then repair the child on the way back up.
+  if (!remove_from_node(node->children[i], key)) {
+    return false;
   }
+  fix_for_removal(node, i);
+  return true;
+}
 
-  // Add the new children to the node
-  if (!is_leaf) {
-    for (int k = 0; k < num_new_keys; k++) {
-      sib_1->children[k] = new_children[k];
-    }
+void remove(btree*& root, btree_key key) {
+  count_event(BTREE_REMOVES);
+  BTREE_TRACE(BTREE_TRACE_OPS, TRACE_REMOVE, root, key);
 
-    // Add the last child to the node
-    sib_1->children[num_new_keys] = new_children[num_new_keys];
+  if (root == NULL) {
+    return;
   }
 
-  // Shuffle keys and children in parent to remove separating key from parent
-  if (parent == root && parent->num_keys < 2) {
-    // Set root to sib 1.
-    root = sib_1;
-    // Delete parent.
-    delete parent;
-  } else {
-    // Move keys and children in parent after separating key down one index.
-    // for (int h = parent->num_keys - 1; h > separating_key_index; h--) {
+  unsigned int epoch = root->epoch;
+  unsigned long long released = btree_thread_releases;
+  remove_from_node(root, key);
+
+  // If a merge took the root's last key, its only child becomes the new root and the
+  // tree gets one level shorter.
+  if (!root->is_leaf && root->num_keys == 0) {
+    btree* old_root = root;
+    BTREE_TRACE(BTREE_TRACE_EVENTS, TRACE_ROOT_SHRINK, old_root, 0);
+    root = root->children[0];
+    free_node(old_root);
+    count_event(BTREE_ROOT_SHRINKS);
+  }
+  update_epoch(root, epoch, released);
+}
+
+// rebalance_child repairs a child that has fewer keys than a non-root node may hold,
+// however few that is. Unlike fix_for_removal it copes with a child that lost many keys
+// at once, even all of them. The child is pooled with a neighbour and the separator
+// between them; if the pool fits in one node the two are merged, otherwise it is split
+// evenly across both. Returns the index of the node that now holds the child's keys.
+int rebalance_child(btree* parent, int child_index) {
+  // Pair the child with its right neighbour if it has one, otherwise its left.
+  int separating_key_index = child_index < parent->num_keys ? child_index : child_index - 1;
+  btree* left = parent->children[separating_key_index];
+  btree* right = parent->children[separating_key_index + 1];
+
+  btree_key pool_keys[2 * BTREE_ORDER + 1];
+  btree* pool_children[2 * BTREE_ORDER + 2];
+  int total = 0;
+  for (int i = 0; i < left->num_keys; i++) {
+    pool_keys[total] = left->keys[i];
+    pool_children[total] = left->children[i];
+    total++;
+  }
+  pool_keys[total] = parent->keys[separating_key_index];
+  pool_children[total] = left->children[left->num_keys];
+  total++;
+  for (int i = 0; i < right->num_keys; i++) {
+    pool_keys[total] = right->keys[i];
+    pool_children[total] = right->children[i];
+    total++;
+  }
+  pool_children[total] = right->children[right->num_keys];
+
+  if (total <= BTREE_ORDER - 1) {
+    // Everything fits in the left node. Drop the separator and the right node from the parent.
+    BTREE_TRACE(BTREE_TRACE_EVENTS, TRACE_MERGE, left, parent->keys[separating_key_index]);
+    left->num_keys = total;
+    for (int i = 0; i < total; i++) {
+      left->keys[i] = pool_keys[i];
+      left->children[i] = pool_children[i];
+    }
+    left->children[total] = pool_children[total];
+
     for (int h = separating_key_index + 1; h < parent->num_keys; h++) {
       parent->keys[h - 1] = parent->keys[h];
-      parent->children[h - 1] = parent->children[h];
+      parent->children[h] = parent->children[h + 1];
     }
     parent->num_keys--;
-    parent->children[parent->num_keys] = parent->children[parent->num_keys + 1];
+    free_node(right);
+    count_event(BTREE_MERGES);
+
+    if (!left->is_leaf) {
+      fix_underfull_children(left);
+    }
+    return separating_key_index;
   }
 
-  // Delete the useless sibling.
-  delete sib_2;
-}
+  // Otherwise split the pool evenly. Both halves get at least (BTREE_ORDER - 1) / 2 keys,
+  // and the key between them becomes the new separator.
+  int left_count = (total - 1) / 2;
+  left->num_keys = left_count;
+  for (int i = 0; i < left_count; i++) {
+    left->keys[i] = pool_keys[i];
+    left->children[i] = pool_children[i];
+  }
+  left->children[left_count] = pool_children[left_count];
 
-void fix_for_removal(btree* node, btree*& root) {
-  // If we're descending down into a node for a removal, and it's minimal
-  // do some work to make it not minimal.
-  btree* prev_sib = prev_sibling(node, root);
-  btree* next_sib = next_sibling(node, root);
-  bool prev_sib_nonminimal = prev_sib && !is_minimal(prev_sib);
-  bool next_sib_nonminimal = next_sib && !is_minimal(next_sib);
+  parent->keys[separating_key_index] = pool_keys[left_count];
 
-  // Case 1: At least one sibling is non-minimal.. rotate!
-  if (prev_sib_nonminimal || next_sib_nonminimal) {
-    // TODO: Rotate
-    return;
+  right->num_keys = total - left_count - 1;
+  for (int i = 0; i < right->num_keys; i++) {
+    right->keys[i] = pool_keys[left_count + 1 + i];
+    right->children[i] = pool_children[left_count + 1 + i];
+  }
+  right->children[right->num_keys] = pool_children[total];
+  count_event(BTREE_ROTATIONS);
+  BTREE_TRACE(BTREE_TRACE_EVENTS, child_index == separating_key_index ? TRACE_ROTATE_LEFT : TRACE_ROTATE_RIGHT,
+              parent, parent->keys[separating_key_index]);
+
+  // Pooling can bring an underfull grandchild along with it (when the child had no keys
+  // and a single child of its own), so its new parent has to repair it.
+  if (!left->is_leaf) {
+    fix_underfull_children(left);
+    fix_underfull_children(right);
   }
+  return child_index;
+}
 
-  // Case 2: All siblings are minimal... merge!
-  if ((!prev_sib || is_minimal(prev_sib)) && (!next_sib || is_minimal(next_sib))) {
-    if (next_sib) {
-      merge(node, next_sib, root);
+void fix_underfull_children(btree* node) {
+  int i = 0;
+  while (i <= node->num_keys) {
+    // A node with a single child has nothing to pool it with; its own parent will
+    // deal with both of them.
+    if (node->num_keys > 0 && is_underfull(node->children[i])) {
+      int fixed_index = rebalance_child(node, i);
+      // Pooling may have left the neighbour on the left short, so look at it again.
+      i = fixed_index > 0 ? fixed_index - 1 : 0;
     } else {
-      merge(node, prev_sib, root);
+      i++;
     }
   }
 }
 
-btree* find_successor_node(btree* node, btree*& root, int key) {
+// subtree_empty returns true if there are no keys anywhere below 'node'. After a batch
+// removal a subtree can be a chain of keyless nodes with one child each, ending in an
+// empty leaf.
+bool subtree_empty(btree* node) {
+  while (!node->is_leaf && node->num_keys == 0) {
+    node = node->children[0];
+  }
+  return node->num_keys == 0;
+}
+
+// remove_max takes the largest key out of a non-empty subtree and returns it, repairing
+// the right edge of the subtree on the way back up.
+btree_key remove_max(btree* node) {
   if (node->is_leaf) {
-    return NULL;
+    node->num_keys--;
+    return node->keys[node->num_keys];
   }
 
-  int child_index = -1;
-  int i = 0;
-  while (child_index < 0) {
-    if (node->keys[i] == key) {
-      child_index = i + 1;
+  int last = node->num_keys;
+  btree_key key = remove_max(node->children[last]);
+  if (last > 0 && is_underfull(node->children[last])) {
+    rebalance_child(node, last);
+  }
+  return key;
+}
+
+// remove_min takes the smallest key out of a non-empty subtree and returns it, repairing
+// the left edge of the subtree on the way back up.
+btree_key remove_min(btree* node) {
+  if (node->is_leaf) {
+    btree_key key = node->keys[0];
+    for (int i = 1; i < node->num_keys; i++) {
+      node->keys[i - 1] = node->keys[i];
     }
-    i++;
+    node->num_keys--;
+    return key;
   }
 
-  // TODO: fix first child node if minimal
-  btree* successor_node = node->children[child_index];
+  btree_key key = remove_min(node->children[0]);
+  if (node->num_keys > 0 && is_underfull(node->children[0])) {
+    rebalance_child(node, 0);
+  }
+  return key;
+}
 
-  while (!successor_node->is_leaf) {
-    successor_node = successor_node->children[0];
-    if (is_minimal(successor_node)) {
-      fix_for_removal(successor_node, root);
+// remove_separator deletes key 'index' from an inner node whose children have already
+// been dealt with. The key is replaced by the largest key on its left or, if that
+// subtree is empty, the smallest on its right. If both are empty, the right one is
+// freed along with the separator.
+void remove_separator(btree* node, int index) {
+  if (!subtree_empty(node->children[index])) {
+    node->keys[index] = remove_max(node->children[index]);
+  } else if (!subtree_empty(node->children[index + 1])) {
+    node->keys[index] = remove_min(node->children[index + 1]);
+  } else {
+    destroy(node->children[index + 1]);
+    for (int h = index + 1; h < node->num_keys; h++) {
+      node->keys[h - 1] = node->keys[h];
+      node->children[h] = node->children[h + 1];
     }
+    node->num_keys--;
   }
+}
 
-  if (is_minimal(successor_node)) {
-    fix_for_removal(successor_node, root);
+// collapse_root removes keyless roots after a bulk removal, which can leave the root
+// with no keys and a single child, possibly several levels deep.
+// Returns the number of levels removed.
+int collapse_root(btree*& root) {
+  int levels = 0;
+  while (!root->is_leaf && root->num_keys == 0) {
+    btree* old_root = root;
+    BTREE_TRACE(BTREE_TRACE_EVENTS, TRACE_ROOT_SHRINK, old_root, 0);
+    root = root->children[0];
+    free_node(old_root);
+    count_event(BTREE_ROOT_SHRINKS);
+    levels++;
   }
-
-  return successor_node;
+  return levels;
 }
 
-btree* find_predecessor_node(btree* node, btree*& root, int key) {
+// remove_run removes a sorted run of keys from the subtree rooted at 'node'. Nodes are
+// allowed to underflow while the run is being removed; each node repairs its children
+// once, after all of them are done, so a node that loses many keys is rebalanced once
+// rather than once per key. The subtree's own root may be left underfull (even keyless
+// with a single child) for its parent to repair.
+void remove_run(btree* node, const btree_key* keys, long long count) {
   if (node->is_leaf) {
-    return NULL;
+    // Keep the keys that aren't in the run.
+    int kept = 0;
+    long long pos = 0;
+    for (int i = 0; i < node->num_keys; i++) {
+      while (pos < count && keys[pos] < node->keys[i]) {
+        pos++;
+      }
+      if (pos == count || keys[pos] != node->keys[i]) {
+        node->keys[kept] = node->keys[i];
+        kept++;
+      }
+    }
+    node->num_keys = kept;
+    return;
   }
 
-  int child_index = -1;
-  int i = 0;
-  while (child_index < 0) {
-    if (node->keys[i] == key) {
-      child_index = i;
+  bool remove_key[BTREE_ORDER];
+  long long pos = 0;
+  for (int i = 0; i <= node->num_keys; i++) {
+    // The keys that belong under child i are the ones smaller than key i.
+    long long start = pos;
+    while (pos < count && (i == node->num_keys || keys[pos] < node->keys[i])) {
+      pos++;
+    }
+    if (pos > start) {
+      remove_run(node->children[i], keys + start, pos - start);
+    }
+
+    if (i < node->num_keys) {
+      remove_key[i] = pos < count && keys[pos] == node->keys[i];
+      if (remove_key[i]) {
+        pos++;
+      }
     }
-    i++;
   }
 
-  // TODO: fix first child node if minimal
-  btree* first_child = node->children[child_index];
-  if (is_minimal(first_child)) {
-    fix_for_removal(first_child, root);
+  // Go right to left so removing a separator doesn't move the ones still to do.
+  for (int i = node->num_keys - 1; i >= 0; i--) {
+    if (remove_key[i]) {
+      remove_separator(node, i);
+    }
   }
 
-  btree* predecessor_node = first_child;
+  fix_underfull_children(node);
+}
 
-  while (!predecessor_node->is_leaf) {
-    predecessor_node = predecessor_node->children[predecessor_node->num_keys];
-    if (is_minimal(predecessor_node)) {
-      fix_for_removal(predecessor_node, root);
+void remove_batch(btree*& root, const btree_key* keys, long long count) {
+  // The batch has to be sorted for remove_run to route it. If it isn't, fall back to
+  // removing one key at a time.
+  for (long long i = 1; i < count; i++) {
+    if (keys[i] < keys[i - 1]) {
+      for (long long j = 0; j < count; j++) {
+        remove(root, keys[j]);
+      }
+      return;
     }
   }
 
-  if (is_minimal(predecessor_node)) {
-    fix_for_removal(predecessor_node, root);
+  count_event(BTREE_REMOVES, count);
+  if (root == NULL || count == 0) {
+    return;
   }
 
-  return predecessor_node;
+  unsigned int epoch = root->epoch;
+  unsigned long long released = btree_thread_releases;
+  remove_run(root, keys, count);
+  collapse_root(root);
+  update_epoch(root, epoch, released);
 }
 
-bool node_has_key(btree* node, int key) {
-  for (int i = 0; i < node->num_keys; i++) {
-    if (node->keys[i] == key) {
-      return true;
+// erase_range_node removes the keys in [lo, hi) from the subtree rooted at 'node'. Only
+// the two paths leading to lo and hi are walked; every subtree that lies strictly
+// between them is freed whole without looking at its keys. Like remove_run, the
+// subtree's own root may be left underfull for its parent to repair.
+void erase_range_node(btree* node, btree_key lo, btree_key hi) {
+  if (node->is_leaf) {
+    int kept = 0;
+    for (int i = 0; i < node->num_keys; i++) {
+      if (node->keys[i] < lo || node->keys[i] >= hi) {
+        node->keys[kept] = node->keys[i];
+        kept++;
+      }
     }
+    node->num_keys = kept;
+    return;
+  }
+
+  // Keys [first, last) are in the range. Child 'first' holds the keys just below
+  // key 'first' and child 'last' the keys just above key 'last - 1', so those are the
+  // two boundary children; every child between them is entirely inside the range.
+  int first = 0;
+  while (first < node->num_keys && node->keys[first] < lo) {
+    first++;
+  }
+  int last = first;
+  while (last < node->num_keys && node->keys[last] < hi) {
+    last++;
+  }
+
+  if (first == last) {
+    // The whole range falls inside one child.
+    erase_range_node(node->children[first], lo, hi);
+    fix_underfull_children(node);
+    return;
+  }
+
+  erase_range_node(node->children[first], lo, hi);
+  erase_range_node(node->children[last], lo, hi);
+  for (int i = first + 1; i < last; i++) {
+    destroy(node->children[i]);
+  }
+
+  // Close the gap, keeping key 'first' as a placeholder separator between the two
+  // boundary children, then let remove_separator replace or drop it.
+  int gap = last - first - 1;
+  node->children[first + 1] = node->children[last];
+  for (int i = last; i < node->num_keys; i++) {
+    node->keys[i - gap] = node->keys[i];
+    node->children[i + 1 - gap] = node->children[i + 1];
   }
+  node->num_keys -= gap;
+  remove_separator(node, first);
 
-  return false;
+  fix_underfull_children(node);
 }
 
-void swap_keys(btree* node, int key_to_remove, int key_to_add) {
-  for (int i = 0; i < node->num_keys; i++) {
-    if (node->keys[i] == key_to_remove) {
-      node->keys[i] = key_to_add;
-      return;
-    }
+void erase_range(btree*& root, btree_key lo, btree_key hi) {
+  if (root == NULL || lo >= hi) {
+    return;
   }
+
+  unsigned int epoch = root->epoch;
+  unsigned long long released = btree_thread_releases;
+  erase_range_node(root, lo, hi);
+  collapse_root(root);
+  update_epoch(root, epoch, released);
 }
 
-void remove_from_leaf_node(btree* node, int key) {
-  bool key_found = false;
-  for (int i = 0; i < node->num_keys; i++) {
-    if (node->keys[i] == key) {
-      key_found = true;
-    } else if (key_found) {
-      node->keys[i - 1] = node->keys[i];
-    }
+// tree_height returns the number of levels in a tree, or zero for a NULL tree.
+int tree_height(btree* root) {
+  int height = 0;
+  for (btree* node = root; node != NULL; node = node->is_leaf ? NULL : node->children[0]) {
+    height++;
   }
-  node->num_keys--;
+  return height;
 }
 
-void remove_from_inner_node(btree* node, btree*& root, int key) {
-  // Swap the inner node key with successor/predecessor, then remove the
-  // desired key from its new location.
+// join_trees joins 'left', the key 'key' and 'right' into one tree, where every key in
+// 'left' is smaller than 'key' and every key in 'right' is larger. Either tree may be
+// NULL but neither may be an empty leaf. The heights are passed in so a join costs
+// O(|left_height - right_height| + 1); the height of the result is returned in 'height'.
+btree* join_trees(btree* left, int left_height, btree_key key, btree* right, int right_height, int& height) {
+  if (left == NULL && right == NULL) {
+    btree* leaf = alloc_node(true);
+    leaf->num_keys = 1;
+    leaf->keys[0] = key;
+    height = 1;
+    return leaf;
+  }
 
-  btree* successor = find_successor_node(node, root, key);
-  if (successor) {
-    
-    if (!node_has_key(node, key)) {
-      btree* new_containing_node = find(root, key);
-      return remove_from_node(new_containing_node, root, key);
+  if (left == NULL || right == NULL) {
+    // The key goes at one edge of the other tree, which is an ordinary leaf insert.
+    btree* root = left == NULL ? right : left;
+    btree* leaf = root;
+    while (!leaf->is_leaf) {
+      leaf = leaf->children[left == NULL ? 0 : leaf->num_keys];
+    }
+    height = left == NULL ? right_height : left_height;
+    insert_and_fix(key, leaf, left == NULL ? 0 : leaf->num_keys, root);
+    if (tree_height(root) > height) {
+      height++;
     }
+    return root;
+  }
 
-    int successor_key = successor->keys[0];
-    swap_keys(node, key, successor_key);
-    remove_from_leaf_node(successor, successor_key);
-    return;
+  if (left_height == right_height) {
+    // Both trees become children of a new root. Either may have fewer keys than a
+    // non-root node needs, so let the new root rebalance them.
+    count_event(BTREE_ROOT_GROWS);
+    BTREE_TRACE(BTREE_TRACE_EVENTS, TRACE_ROOT_GROW, left, key);
+    btree* root = alloc_node(false);
+    root->num_keys = 1;
+    root->keys[0] = key;
+    root->children[0] = left;
+    root->children[1] = right;
+    fix_underfull_children(root);
+    height = left_height + 1 - collapse_root(root);
+    return root;
   }
 
-  btree* predecessor = find_predecessor_node(node, root, key);
-  if (predecessor) {
-    // Finding a success or pred can change the position of the target key in the tree.
-    if (!node_has_key(node, key)) {
-      btree* new_containing_node = find(root, key);
-      return remove_from_node(new_containing_node, root, key);
+  // Otherwise walk down the edge of the taller tree that faces the shorter one until we
+  // reach the level whose children are as tall as the shorter tree, and hang the shorter
+  // tree there.
+  bool attach_right = left_height > right_height;
+  btree* root = attach_right ? left : right;
+  btree* shorter = attach_right ? right : left;
+  int levels = attach_right ? left_height - right_height : right_height - left_height;
+
+  vector<btree*> path;
+  btree* node = root;
+  path.push_back(node);
+  for (int i = 1; i < levels; i++) {
+    node = node->children[attach_right ? node->num_keys : 0];
+    path.push_back(node);
+  }
+
+  if (attach_right) {
+    node->keys[node->num_keys] = key;
+    node->children[node->num_keys + 1] = shorter;
+    node->num_keys++;
+    if (is_underfull(shorter)) {
+      rebalance_child(node, node->num_keys);
     }
+  } else {
+    for (int i = node->num_keys; i > 0; i--) {
+      node->keys[i] = node->keys[i - 1];
+      node->children[i + 1] = node->children[i];
+    }
+    node->children[1] = node->children[0];
+    node->keys[0] = key;
+    node->children[0] = shorter;
+    node->num_keys++;
+    if (is_underfull(shorter)) {
+      rebalance_child(node, 0);
+    }
+  }
 
-    int predecessor_key = predecessor->keys[predecessor->num_keys - 1];
-    swap_keys(node, key, predecessor_key);
-    remove_from_leaf_node(predecessor, predecessor_key);
+  // Split overfull nodes on the way back up. Each one is the edge child of its parent.
+  height = attach_right ? left_height : right_height;
+  for (int d = path.size() - 1; d >= 0 && path[d]->num_keys > BTREE_ORDER - 1; d--) {
+    if (d == 0) {
+      count_event(BTREE_ROOT_GROWS);
+      BTREE_TRACE(BTREE_TRACE_EVENTS, TRACE_ROOT_GROW, root, root->keys[root->num_keys / 2]);
+      btree* new_root = alloc_node(false);
+      new_root->children[0] = root;
+      split_child(new_root, 0);
+      root = new_root;
+      height++;
+    } else {
+      split_child(path[d - 1], attach_right ? path[d - 1]->num_keys : 0);
+    }
   }
+  return root;
 }
 
-void remove_from_node(btree* node, btree*& root, int key) {
+// split_subtree cuts the tree rooted at 'node', which is 'height' levels tall, into a tree
+// of the keys smaller than 'key' and a tree of the rest. The nodes of the original tree
+// are reused or freed. At each level the keys and children on either side of the path
+// to 'key' are joined onto the pieces coming back up from below, which is O(log n)
+// overall because the heights being joined only ever grow.
+void split_subtree(btree* node, int height, btree_key key, btree*& left, int& left_height,
+                   btree*& right, int& right_height) {
+  int i = 0;
+  while (i < node->num_keys && node->keys[i] < key) {
+    i++;
+  }
+  int n = node->num_keys;
+
   if (node->is_leaf) {
-    remove_from_leaf_node(node, key);
-  } else {
-    remove_from_inner_node(node, root, key);
+    left = NULL;
+    right = NULL;
+    if (i < n) {
+      right = alloc_node(true);
+      right->num_keys = n - i;
+      for (int j = i; j < n; j++) {
+        right->keys[j - i] = node->keys[j];
+      }
+    }
+    node->num_keys = i;
+    if (i > 0) {
+      left = node;
+    } else {
+      free_node(node);
+    }
+    left_height = left == NULL ? 0 : 1;
+    right_height = right == NULL ? 0 : 1;
+    return;
   }
-}
 
-void remove(btree*& root, int key) {
-  cout << endl << "Removing " << key << endl << endl;
+  btree* child_left;
+  btree* child_right;
+  int child_left_height;
+  int child_right_height;
+  split_subtree(node->children[i], height - 1, key, child_left, child_left_height,
+                child_right, child_right_height);
+
+  // The keys and children right of the path. A single child needs no node of its own.
+  btree* right_part = NULL;
+  int right_part_height = 0;
+  if (i < n - 1) {
+    right_part = alloc_node(false);
+    right_part->num_keys = n - i - 1;
+    for (int j = i + 1; j < n; j++) {
+      right_part->keys[j - i - 1] = node->keys[j];
+      right_part->children[j - i - 1] = node->children[j];
+    }
+    right_part->children[n - i - 1] = node->children[n];
+    right_part_height = height;
+  } else if (i == n - 1) {
+    right_part = node->children[n];
+    right_part_height = height - 1;
+  }
+
+  if (i < n) {
+    right = join_trees(child_right, child_right_height, node->keys[i], right_part, right_part_height,
+                       right_height);
+  } else {
+    right = child_right;
+    right_height = child_right_height;
+  }
 
-  // If the root has the key, just remove from the root.
-  // We don't need to fix root minimalism.
-  if (node_has_key(root, key)) {
-    remove_from_node(root, root, key);
+  // The keys and children left of the path reuse this node.
+  if (i == 0) {
+    free_node(node);
+    left = child_left;
+    left_height = child_left_height;
     return;
   }
 
-  // Gradually step to the node from which we should remove the value.
-  btree* traversal_node = root;
-  while (!node_has_key(traversal_node, key)) {
-    // If we're in a leaf, but still haven't found the key,
-    // it doesn't exist in the tree.
-    if (traversal_node->is_leaf) {
-      return;
-    }
+  btree* left_part = node;
+  int left_part_height = height;
+  btree_key separator = node->keys[i - 1];
+  if (i == 1) {
+    left_part = node->children[0];
+    left_part_height = height - 1;
+    free_node(node);
+  } else {
+    node->num_keys = i - 1;
+  }
+  left = join_trees(left_part, left_part_height, separator, child_left, child_left_height, left_height);
+}
 
-    // Find the index of the next child we should traverse to.
-    int next_child_index = -1;
-    bool next_child_found = false;
-    
-    for (int i = 0; i < traversal_node->num_keys; i++) {
-      if (!next_child_found && traversal_node->keys[i] > key) {
-        next_child_index = i;
-        next_child_found = true;
-      }
-    }
+void split(btree*& root, btree_key key, btree*& right) {
+  right = NULL;
+  if (root == NULL || root->num_keys == 0) {
+    return;
+  }
 
-    // If the key is bigger than all keys, traverse to the last child.
-    if (!next_child_found) {
-      next_child_index = traversal_node->num_keys;
-    }
+  btree* left;
+  int left_height;
+  int right_height;
+  split_subtree(root, tree_height(root), key, left, left_height, right, right_height);
+  root = left;
 
-    // Repeat traversal for the next child
-    traversal_node = traversal_node->children[next_child_index];
-    if (is_minimal(traversal_node)) {
-      fix_for_removal(traversal_node, root);
-    }
+  // Both trees hold nodes the other used to, so both start a new epoch.
+  if (left != NULL) {
+    left->epoch = next_epoch();
+  }
+  if (right != NULL) {
+    right->epoch = next_epoch();
   }
+}
 
-  // If we made it here, we know that traversal_node contains the key.
-  remove_from_node(traversal_node, root, key);
+// collect_keys appends the keys of a subtree to 'keys' in ascending order.
+void collect_keys(btree* node, vector<btree_key>& keys) {
+  for (int i = 0; i < node->num_keys; i++) {
+    if (!node->is_leaf) {
+      collect_keys(node->children[i], keys);
+    }
+    keys.push_back(node->keys[i]);
+  }
+  if (!node->is_leaf) {
+    collect_keys(node->children[node->num_keys], keys);
+  }
 }
 
-btree* find(btree*& root, int key) {
-  if (root == NULL) {
-    return NULL;
+void join(btree*& left, btree*& right) {
+  if (right == NULL || right->num_keys == 0) {
+    destroy(right);
+    return;
+  }
+  if (left == NULL || left->num_keys == 0) {
+    // 'left' takes over the nodes of 'right', so it moves on from both trees' epochs.
+    destroy(left);
+    left = right;
+    right = NULL;
+    left->epoch = next_epoch();
+    return;
   }
 
-  if (root->is_leaf) {
-    return root;
+  // The smallest key of 'right' becomes the key between the two trees.
+  btree* node = right;
+  while (!node->is_leaf) {
+    node = node->children[0];
+  }
+  btree_key key = node->keys[0];
+  btree* last = left;
+  while (!last->is_leaf) {
+    last = last->children[last->num_keys];
   }
 
-  // scan the key values of the input node to see if the input key is present.
-  // If it is, return this node.
-  for (int i = 0; i < root->num_keys; i++) {
-    if (root->keys[i] == key) {
-      return root;
-    }
+  if (last->keys[last->num_keys - 1] >= key) {
+    // The ranges overlap, so the trees can't be joined side by side. Merge the keys
+    // of 'right' in instead.
+    vector<btree_key> keys;
+    collect_keys(right, keys);
+    insert_batch(left, &keys[0], keys.size());
+    destroy(right);
+    return;
   }
 
-  // Otherwise, for each key in the input node, if the input key is less than the
-  // key we’re looking at, call `find` again passing in the child node linked from
-  // the left of the key we’re looking at. 
-  for (int j = 0; j < root->num_keys; j++) {
-    if (key < root->keys[j]) {
-      return find(root->children[j], key);
-    }
+  int left_height = tree_height(left);
+  int right_height = tree_height(right);
+  remove_from_node(right, key);
+  right_height -= collapse_root(right);
+  if (right->num_keys == 0) {
+    destroy(right);
+    right_height = 0;
   }
 
-  // If we get to the end and still haven’t called `find` again, call `find` passing in the last child.
-  return find(root->children[root->num_keys], key);
+  // The joined tree moves on from both trees' epochs, so no cursor on either matches it.
+  int height;
+  left = join_trees(left, left_height, key, right, right_height, height);
+  left->epoch = next_epoch();
+  right = NULL;
 }
 
-int count_nodes(btree*& root) {
+btree* find(btree*& root, btree_key key) {
+  count_event(BTREE_FINDS);
+  BTREE_TRACE(BTREE_TRACE_OPS, TRACE_FIND, root, key);
+  return lookup_node(root, key).node;
+}
+
+btree_position lookup(btree*& root, btree_key key) {
+  count_event(BTREE_FINDS);
+  BTREE_TRACE(BTREE_TRACE_OPS, TRACE_FIND, root, key);
+  return lookup_node(root, key);
+}
+
+btree_position lookup_node(btree* root, btree_key key) {
+  btree_position position;
+  position.node = root;
+  position.slot = 0;
+  position.found = false;
+
+  btree* node = root;
+  while (node != NULL) {
+    // Scan the node's keys once for the first one that is not less than the key. If it
+    // is the key, this node holds it.
+    int i = 0;
+    while (i < node->num_keys && node->keys[i] < key) {
+      i++;
+    }
+    position.node = node;
+    position.slot = i;
+    position.found = i < node->num_keys && node->keys[i] == key;
+
+    // Otherwise the key is in, or would go in, the child to the left of that key (or the
+    // last child if every key is smaller). A leaf is as far as we can go.
+    if (position.found || node->is_leaf) {
+      break;
+    }
+    node = node->children[i];
+  }
+  return position;
+}
+
+long long count_nodes(btree*& root) {
   if (root == NULL) {
     return 0;
   }
 
-  int count = 1;
+  long long count = 1;
 
   if (!root->is_leaf) {
     for (int i = 0; i <= root->num_keys; i++) {
@@ -708,12 +1364,12 @@ int count_nodes(btree*& root) {
   return count;
 }
 
-int count_keys(btree*& root) {
+long long count_keys(btree*& root) {
   if (root == NULL) {
     return 0;
   }
 
-  int count = root->num_keys;
+  long long count = root->num_keys;
 
   if (!root->is_leaf) {
     for (int i = 0; i <= root->num_keys; i++) {
@@ -724,3 +1380,93 @@ int count_keys(btree*& root) {
   return count;
 }
 
+void destroy(btree*& root) {
+  if (root == NULL) {
+    return;
+  }
+
+  if (!root->is_leaf) {
+    for (int i = 0; i <= root->num_keys; i++) {
+      destroy(root->children[i]);
+    }
+  }
+
+  free_node(root);
+  root = NULL;
+}
+
+// nodes_at_depth appends the nodes 'depth' levels below 'node', left to right.
+void nodes_at_depth(btree* node, int depth, vector<btree*>& nodes) {
+  if (depth == 0) {
+    nodes.push_back(node);
+    return;
+  }
+  for (int i = 0; i <= node->num_keys; i++) {
+    nodes_at_depth(node->children[i], depth - 1, nodes);
+  }
+}
+
+// veb_order appends the top 'height' levels of the subtree under 'node' in van Emde Boas
+// order: the top half of the levels, laid out the same way, then each subtree hanging
+// below them in turn. Every subtree of 2^k levels ends up contiguous, whatever k is, so
+// a descent crosses O(log_B n) blocks for any block size B without knowing B.
+void veb_order(btree* node, int height, vector<btree*>& order) {
+  if (height == 1) {
+    order.push_back(node);
+    return;
+  }
+  int top = height / 2;
+  veb_order(node, top, order);
+  vector<btree*> bottoms;
+  nodes_at_depth(node, top, bottoms);
+  for (size_t i = 0; i < bottoms.size(); i++) {
+    veb_order(bottoms[i], height - top, order);
+  }
+}
+
+void relayout(btree*& root) {
+  if (root == NULL) {
+    return;
+  }
+
+  unsigned int epoch = root->epoch;
+  unsigned long long released = btree_thread_releases;
+  vector<btree*> order;
+  veb_order(root, tree_height(root), order);
+
+  // Copy the nodes into consecutive blocks in the new order, then point the copies'
+  // children at the copies.
+  vector<btree*> copies(order.size());
+  unordered_map<btree*, btree*> moved;
+  node_block* block = NULL;
+  for (size_t i = 0; i < order.size(); i++) {
+    int slot = i % NODE_BLOCK_NODES;
+    if (slot == 0) {
+      // Start each block on a page boundary, so it spans one page rather than two.
+      void* memory;
+      if (posix_memalign(&memory, 4096, sizeof(node_block)) != 0) {
+        throw bad_alloc();
+      }
+      block = new (memory) node_block;
+      block->live = (int) min((size_t) NODE_BLOCK_NODES, order.size() - i);
+    }
+    copies[i] = &block->nodes[slot];
+    *copies[i] = *order[i];
+    copies[i]->block_slot = slot + 1;
+    moved[order[i]] = copies[i];
+    count_event(BTREE_NODES_ALLOCATED);
+  }
+  for (size_t i = 0; i < order.size(); i++) {
+    if (!copies[i]->is_leaf) {
+      for (int c = 0; c <= copies[i]->num_keys; c++) {
+        copies[i]->children[c] = moved[copies[i]->children[c]];
+      }
+    }
+  }
+
+  for (size_t i = 0; i < order.size(); i++) {
+    free_node(order[i]);
+  }
+  root = copies[0];
+  update_epoch(root, epoch, released);
+}
@@ -24,6 +24,20 @@
 
 using namespace std;
 
+// btree_key is the type of the keys. It is int unless BTREE_KEY64 is
+// defined, in which case it is a 64-bit integer, for key spaces (such
+// as 64-bit IDs) that don't fit in an int. Build everything that
+// includes this header with the same setting, for example
+//
+//   make CPPFLAGS=-DBTREE_KEY64
+//
+// Counts of keys and nodes are 64-bit either way.
+#ifdef BTREE_KEY64
+typedef long long btree_key;
+#else
+typedef int btree_key;
+#endif
+
 // Note that the keys and children arrays are OVERSIZED to allow for
 // some approaches to work, where nodes are allowed to temporarily
 // have too many keys or children. You do not have to use the extra
@@ -38,11 +52,24 @@ struct btree {
   int num_keys;
 
   // keys is an array of values. valid indexes are in [0..num_keys)
-  int keys[BTREE_ORDER];
+  btree_key keys[BTREE_ORDER];
 
   // is_leaf is true if this is a leaf, false otherwise
   bool is_leaf;
 
+  // block_slot is zero for a node allocated on its own. relayout
+  // carves nodes out of larger blocks, and numbers each node's place in
+  // its block from one, so free_node can find the block from the node.
+  unsigned short block_slot;
+
+  // epoch is only meaningful in a root, where it is the tree's epoch.
+  // It changes whenever a node of the tree is freed or handed to
+  // another tree, so anything holding on to nodes of the tree (a
+  // cursor or a lookaside table) can tell they may be gone. It and
+  // block_slot fit in the padding after is_leaf, so they don't make
+  // nodes any bigger.
+  unsigned int epoch;
+
   // children is an array of pointers to b-tree subtrees. valid
   // indexes are in [0..num_keys].
   btree* children[BTREE_ORDER + 1];
@@ -56,7 +83,26 @@ struct btree {
 // -- the 'root' pointer should refer to the root of the
 //    tree. (the root may change when we insert or remove)
 // -- the btree pointed to by 'root' is valid.
-void insert(btree*& root, int key);
+void insert(btree*& root, btree_key key);
+
+// insert_batch adds 'count' keys, which should be sorted in ascending
+// order, to the b-tree rooted at 'root'. Keys already in the tree and
+// repeated keys in the batch are ignored. The batch is routed down the
+// tree once and merged into each leaf it touches, and all the splits
+// that causes are done in one pass back up, so it is much cheaper than
+// calling insert for each key. An unsorted batch is still inserted
+// correctly, just one key at a time.
+//
+// On exit 'root' refers to the root of the tree, which is valid.
+void insert_batch(btree*& root, const btree_key* keys, long long count);
+
+// build_tree creates a new b-tree holding 'count' keys, which should be
+// strictly ascending. The tree is built bottom-up with every node as
+// full as the key count allows, which takes O(count) and gives a
+// shorter, denser tree than inserting the keys one by one. Keys that
+// aren't strictly ascending are batch inserted instead. Returns NULL
+// when 'count' is zero.
+btree* build_tree(const btree_key* keys, long long count);
 
 // remove deletes the given key from a b-tree rooted at 'root'. If the
 // key is not in the btree this should do nothing.
@@ -65,23 +111,97 @@ void insert(btree*& root, int key);
 // -- the 'root' pointer should refer to the root of the
 //    tree. (the root may change when we insert or delete)
 // -- the btree pointed to by 'root' is valid.
-void remove(btree*& root, int key);
+void remove(btree*& root, btree_key key);
+
+// remove_batch deletes 'count' keys, which should be sorted in
+// ascending order, from the b-tree rooted at 'root'. Keys that aren't
+// in the tree are ignored. The whole batch is removed in one traversal
+// and each node that lost keys is rebalanced once afterwards, so the
+// cost grows with the number of leaves touched rather than the number
+// of keys. An unsorted batch is still removed correctly, just one key
+// at a time.
+//
+// On exit 'root' refers to the root of the tree, which is valid.
+void remove_batch(btree*& root, const btree_key* keys, long long count);
+
+// erase_range deletes every key k with lo <= k < hi from the b-tree
+// rooted at 'root'. Subtrees that lie entirely inside the range are
+// freed whole, and only the two paths down to lo and hi are trimmed
+// and rebalanced, so the cost is O(log n) plus the number of nodes
+// freed, however many keys the range holds. Nothing happens if
+// lo >= hi.
+//
+// On exit 'root' refers to the root of the tree, which is valid.
+void erase_range(btree*& root, btree_key lo, btree_key hi);
+
+// split cuts the b-tree rooted at 'root' in two at 'key'. Keys smaller
+// than 'key' stay in 'root' and the rest move to a new tree in 'right'.
+// Nodes are moved rather than copied, and only the path down to 'key'
+// is cut and rebalanced, so this takes O(log n). Whatever 'right'
+// pointed to before is overwritten, not freed. Either tree may come out
+// NULL if it gets no keys.
+void split(btree*& root, btree_key key, btree*& right);
+
+// join appends the b-tree 'right' to the b-tree 'left'. Every key in
+// 'left' should be smaller than every key in 'right'; the shorter tree
+// is then hung off the edge of the taller one, which takes O(log n). If
+// the key ranges overlap, the keys of 'right' are batch inserted into
+// 'left' instead, which is correct but takes time linear in the size of
+// 'right'.
+//
+// On exit 'left' refers to the joined tree, which is valid, and 'right'
+// is NULL.
+void join(btree*& left, btree*& right);
 
 // find locates the node that either: (a) currently contains this key,
 // or (b) the node that would contain it if we were to try to insert
 // it.  Note that this always returns a non-null node.
-btree* find(btree*& root, int key);
+btree* find(btree*& root, btree_key key);
+
+// btree_position says where a key is in a tree, or where it would go.
+struct btree_position {
+  // node is the node find would return: the node holding the key, or
+  // the leaf it would be inserted into. It is NULL for a NULL tree.
+  btree* node;
+
+  // slot is the index of the first key in 'node' that is not less than
+  // the key, so it is node->num_keys if every key there is smaller.
+  int slot;
+
+  // found is true if node->keys[slot] is the key.
+  bool found;
+};
+
+// lookup finds the same node as find, and also reports the slot the
+// key is at (or would be inserted at) and whether it is present, all
+// in one pass over each node on the way down.
+btree_position lookup(btree*& root, btree_key key);
 
 // count_nodes returns the number of nodes referenced by this
 // btree. If this node is NULL, count_nodes returns zero; if it is a
 // root, it returns 1; otherwise it returns 1 plus however many nodes
 // are accessable via any valid child links.
-int count_nodes(btree*& root);
+long long count_nodes(btree*& root);
 
 // count_keys returns the total number of keys stored in this
 // btree. If the root node is null it returns zero; otherwise it
 // returns the number of keys in the root plus however many keys are
 // contained in valid child links.
-int count_keys(btree*& root);
+long long count_keys(btree*& root);
+
+// destroy frees every node in the btree rooted at 'root' and sets
+// 'root' to NULL. It is safe to call on a NULL root.
+void destroy(btree*& root);
+
+// relayout copies every node of the tree, in van Emde Boas order, into
+// blocks of about a page each, and points 'root' at the new root. The
+// keys and shape are unchanged, but a descent that used to touch nodes
+// scattered across the heap now stays within a few pages, most of them
+// next to each other. It takes O(n log log n) and is meant to be run
+// now and then on a tree that has seen a long history of inserts and
+// removes. Later inserts allocate nodes as usual. A block is freed
+// along with the last of its nodes, so a node that outlives the rest
+// of its block holds on to a page at most.
+void relayout(btree*& root);
 
 #endif
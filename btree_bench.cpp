@@ -0,0 +1,877 @@
+//
+// btree_bench.cpp
+//
+// Microbenchmarks for insert, find and remove. Build with `make bench`
+// (which compiles with -O3) and run:
+//
+//   ./btree_bench [--max-size N] [--vector-limit N] [--seed S] [--no-perf]
+//
+// Workloads are ascending, appended, random and sorted-batch inserts;
+// uniform, missing and Zipfian finds; lower bounds and 100-key range
+// scans; a mixed find/insert/remove workload; and random and
+// sorted-batch removes. Every workload is run at tree sizes 1e3, 1e4,
+// ... up to --max-size (default 1e6, at most 1e8) against the btree,
+// the btree behind a Bloom filter, the btree behind a lookaside table,
+// a frozen snapshot of the btree, std::set and a sorted std::vector.
+// For each one we report throughput in ops/sec, the p50/p99/p999
+// latency of a single operation in nanoseconds and, where the kernel
+// allows it, hardware counters per operation (see btree_perf.h), along
+// with the memory each structure uses per key. Finds on a btree
+// scattered by inserts and removes are also timed before and after
+// relayout. Pass --no-perf to leave the counters off.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+#include "btree.h"
+#include "btree_cursor.h"
+#include "btree_filter.h"
+#include "btree_frozen.h"
+#include "btree_lookaside.h"
+#include "btree_perf.h"
+
+using namespace std;
+
+typedef chrono::steady_clock bench_clock;
+
+// Keys are produced by scrambling an index with an odd multiplier mod
+// 2^31, which is a bijection, so the first n indexes always give n
+// distinct, randomly spread keys.
+int scramble(long index) {
+  return (int) (((unsigned long) index * 2654435761UL) & 0x7fffffffUL);
+}
+
+// xorshift64* is used to generate operations ahead of time. It is
+// never called inside a timed loop.
+struct bench_rng {
+  unsigned long long state;
+
+  explicit bench_rng(unsigned long long seed) : state(seed ? seed : 88172645463325252ULL) { }
+
+  unsigned long long next() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+  }
+
+  double uniform() {
+    return (next() >> 11) * (1.0 / 9007199254740992.0);
+  }
+};
+
+// zipf_generator draws ranks in [0, n) with the skew used by YCSB
+// (Gray et al., "Quickly Generating Billion-Record Synthetic
+// Databases"). Rank 0 is the most popular.
+struct zipf_generator {
+  long n;
+  double theta;
+  double alpha;
+  double zetan;
+  double eta;
+
+  zipf_generator(long items, double skew) : n(items), theta(skew) {
+    double zeta2 = 1.0 + pow(0.5, theta);
+    zetan = 0;
+    for (long i = 1; i <= n; i++) {
+      zetan += 1.0 / pow((double) i, theta);
+    }
+    alpha = 1.0 / (1.0 - theta);
+    eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+  }
+
+  long next(bench_rng& rng) {
+    double u = rng.uniform();
+    double uz = u * zetan;
+    if (uz < 1.0) {
+      return 0;
+    }
+    if (uz < 1.0 + pow(0.5, theta)) {
+      return 1;
+    }
+    long rank = (long) (n * pow(eta * u - eta + 1.0, alpha));
+    return rank < n ? rank : n - 1;
+  }
+};
+
+// btree.h has no lower bound or range scan of its own, so the btree
+// adapters walk the nodes directly.
+
+// btree_lower_bound sets 'result' to the first key not less than 'key'.
+// Returns false if there is none.
+bool btree_lower_bound(btree* node, btree_key key, btree_key& result) {
+  bool found = false;
+  while (node != NULL) {
+    int i = lower_bound(node->keys, node->keys + node->num_keys, key) - node->keys;
+    if (i < node->num_keys) {
+      result = node->keys[i];
+      found = true;
+      if (node->keys[i] == key) {
+        break;
+      }
+    }
+    node = node->is_leaf ? NULL : node->children[i];
+  }
+  return found;
+}
+
+// btree_scan appends the keys k with lo <= k <= hi to 'keys', in
+// ascending order.
+void btree_scan(btree* node, btree_key lo, btree_key hi, vector<btree_key>& keys) {
+  if (node == NULL) {
+    return;
+  }
+  for (int i = lower_bound(node->keys, node->keys + node->num_keys, lo) - node->keys; ; i++) {
+    if (!node->is_leaf) {
+      btree_scan(node->children[i], lo, hi, keys);
+    }
+    if (i == node->num_keys || node->keys[i] > hi) {
+      return;
+    }
+    keys.push_back(node->keys[i]);
+  }
+}
+
+// Each structure under test is wrapped in an adapter with the same
+// insert/find/remove interface so the workloads can be templated.
+// Structures that can't be updated in place say so with read_only(),
+// and are only loaded and read.
+struct btree_adapter {
+  btree* root;
+  btree_cursor cursor;
+
+  btree_adapter() : root(NULL) { cursor_reset(&cursor); }
+  ~btree_adapter() { destroy(root); }
+
+  static const char* name() { return "btree"; }
+  static bool slow_updates() { return false; }
+  static bool read_only() { return false; }
+
+  void load_sorted(vector<btree_key>& sorted) {
+    for (size_t i = 0; i < sorted.size(); i++) {
+      insert(root, sorted[i]);
+    }
+  }
+  void insert_sorted(const btree_key* keys, int count) { insert_batch(root, keys, count); }
+  void remove_sorted(const btree_key* keys, int count) { remove_batch(root, keys, count); }
+  void insert_key(btree_key key) { insert(root, key); }
+  void append_key(btree_key key) { append(root, key, &cursor); }
+  void remove_key(btree_key key) { remove(root, key); }
+  bool find_key(btree_key key) { return lookup(root, key).found; }
+  bool lower_bound_key(btree_key key, btree_key& result) { return btree_lower_bound(root, key, result); }
+  void scan_keys(btree_key lo, btree_key hi, vector<btree_key>& keys) { btree_scan(root, lo, hi, keys); }
+  long long size() { return count_keys(root); }
+  size_t bytes() { return count_nodes(root) * sizeof(btree); }
+};
+
+// filtered_adapter puts a Bloom filter (btree_filter.h) in front of the
+// btree. There is no filtered append or batch path, so those go through
+// filtered_insert and filtered_remove a key at a time.
+struct filtered_adapter {
+  btree* root;
+  btree_filter filter;
+
+  filtered_adapter() : root(NULL) { filter_build(root, &filter); }
+  ~filtered_adapter() { destroy(root); }
+
+  static const char* name() { return "btree+filter"; }
+  static bool slow_updates() { return false; }
+  static bool read_only() { return false; }
+
+  void load_sorted(vector<btree_key>& sorted) {
+    for (size_t i = 0; i < sorted.size(); i++) {
+      insert(root, sorted[i]);
+    }
+    filter_build(root, &filter);
+  }
+  void insert_sorted(const btree_key* keys, int count) {
+    for (int i = 0; i < count; i++) {
+      filtered_insert(root, &filter, keys[i]);
+    }
+  }
+  void remove_sorted(const btree_key* keys, int count) {
+    for (int i = 0; i < count; i++) {
+      filtered_remove(root, &filter, keys[i]);
+    }
+  }
+  void insert_key(btree_key key) { filtered_insert(root, &filter, key); }
+  void append_key(btree_key key) { filtered_insert(root, &filter, key); }
+  void remove_key(btree_key key) { filtered_remove(root, &filter, key); }
+  bool find_key(btree_key key) { return filtered_contains(root, filter, key); }
+  bool lower_bound_key(btree_key key, btree_key& result) { return btree_lower_bound(root, key, result); }
+  void scan_keys(btree_key lo, btree_key hi, vector<btree_key>& keys) { btree_scan(root, lo, hi, keys); }
+  long long size() { return count_keys(root); }
+  size_t bytes() { return count_nodes(root) * sizeof(btree) + filter.blocks.size() * sizeof(filter_block); }
+};
+
+// lookaside_adapter answers finds through a 4096-entry lookaside table
+// (btree_lookaside.h), which pays off on the Zipfian finds. Removes go
+// through the table so their merges cost it only the entries they
+// touch; other updates go straight to the tree.
+struct lookaside_adapter {
+  btree* root;
+  btree_cursor cursor;
+  btree_lookaside cache;
+
+  lookaside_adapter() : root(NULL) {
+    cursor_reset(&cursor);
+    lookaside_init(&cache, 4096);
+  }
+  ~lookaside_adapter() {
+    lookaside_free(&cache);
+    destroy(root);
+  }
+
+  static const char* name() { return "btree+lookaside"; }
+  static bool slow_updates() { return false; }
+  static bool read_only() { return false; }
+
+  void load_sorted(vector<btree_key>& sorted) {
+    for (size_t i = 0; i < sorted.size(); i++) {
+      insert(root, sorted[i]);
+    }
+  }
+  void insert_sorted(const btree_key* keys, int count) { insert_batch(root, keys, count); }
+  void remove_sorted(const btree_key* keys, int count) { remove_batch(root, keys, count); }
+  void insert_key(btree_key key) { insert(root, key); }
+  void append_key(btree_key key) { append(root, key, &cursor); }
+  void remove_key(btree_key key) { cached_remove(root, &cache, key); }
+  bool find_key(btree_key key) { return cached_lookup(root, &cache, key).found; }
+  bool lower_bound_key(btree_key key, btree_key& result) { return btree_lower_bound(root, key, result); }
+  void scan_keys(btree_key lo, btree_key hi, vector<btree_key>& keys) { btree_scan(root, lo, hi, keys); }
+  long long size() { return count_keys(root); }
+  size_t bytes() { return count_nodes(root) * sizeof(btree) + cache.num_buckets * sizeof(lookaside_bucket); }
+};
+
+// frozen_adapter reads from a frozen snapshot (btree_frozen.h) of a
+// tree built from the keys. The tree is let go once it is frozen, as a
+// read-only index would. A snapshot can't be changed, so an update
+// rebuilds it from scratch; that is only there to fill out the
+// interface, since the workloads that update are skipped.
+struct frozen_adapter {
+  btree_frozen frozen;
+
+  frozen_adapter() { freeze(NULL, &frozen); }
+  ~frozen_adapter() { frozen_free(&frozen); }
+
+  static const char* name() { return "frozen"; }
+  static bool slow_updates() { return true; }
+  static bool read_only() { return true; }
+
+  // rebuild replaces the snapshot with one of 'sorted', which must be
+  // strictly ascending.
+  void rebuild(const vector<btree_key>& sorted) {
+    btree* root = sorted.empty() ? NULL : build_tree(&sorted[0], sorted.size());
+    frozen_free(&frozen);
+    freeze(root, &frozen);
+    destroy(root);
+  }
+  vector<btree_key> keys() { return vector<btree_key>(frozen.keys, frozen.keys + frozen.num_keys); }
+
+  void load_sorted(vector<btree_key>& sorted) { rebuild(sorted); }
+  void insert_sorted(const btree_key* sorted, int count) {
+    vector<btree_key> old_keys = keys();
+    vector<btree_key> merged;
+    set_union(old_keys.begin(), old_keys.end(), sorted, sorted + count, back_inserter(merged));
+    rebuild(merged);
+  }
+  void remove_sorted(const btree_key* sorted, int count) {
+    vector<btree_key> old_keys = keys();
+    vector<btree_key> kept;
+    set_difference(old_keys.begin(), old_keys.end(), sorted, sorted + count, back_inserter(kept));
+    rebuild(kept);
+  }
+  void insert_key(btree_key key) { insert_sorted(&key, 1); }
+  void append_key(btree_key key) { insert_sorted(&key, 1); }
+  void remove_key(btree_key key) { remove_sorted(&key, 1); }
+  bool find_key(btree_key key) { return frozen_contains(frozen, key); }
+  bool lower_bound_key(btree_key key, btree_key& result) {
+    long long position = frozen_lower_bound(frozen, key);
+    if (position == frozen.num_keys) {
+      return false;
+    }
+    result = frozen.keys[position];
+    return true;
+  }
+  void scan_keys(btree_key lo, btree_key hi, vector<btree_key>& keys) { frozen_scan(frozen, lo, hi, keys); }
+  long long size() { return frozen.num_keys; }
+  size_t bytes() { return frozen_bytes(frozen); }
+};
+
+struct set_adapter {
+  set<btree_key> keys;
+
+  static const char* name() { return "std::set"; }
+  static bool slow_updates() { return false; }
+  static bool read_only() { return false; }
+
+  void load_sorted(vector<btree_key>& sorted) { keys.insert(sorted.begin(), sorted.end()); }
+  void insert_sorted(const btree_key* sorted, int count) { keys.insert(sorted, sorted + count); }
+  void remove_sorted(const btree_key* sorted, int count) {
+    for (int i = 0; i < count; i++) {
+      keys.erase(sorted[i]);
+    }
+  }
+  void insert_key(btree_key key) { keys.insert(key); }
+  void append_key(btree_key key) { keys.insert(keys.end(), key); }
+  void remove_key(btree_key key) { keys.erase(key); }
+  bool find_key(btree_key key) { return keys.find(key) != keys.end(); }
+  bool lower_bound_key(btree_key key, btree_key& result) {
+    set<btree_key>::iterator it = keys.lower_bound(key);
+    if (it == keys.end()) {
+      return false;
+    }
+    result = *it;
+    return true;
+  }
+  void scan_keys(btree_key lo, btree_key hi, vector<btree_key>& scanned) {
+    for (set<btree_key>::iterator it = keys.lower_bound(lo); it != keys.end() && *it <= hi; ++it) {
+      scanned.push_back(*it);
+    }
+  }
+  long long size() { return keys.size(); }
+
+  // A red-black tree node holds a color and three pointers besides the
+  // key, padded to pointer alignment. Allocator overhead isn't counted.
+  size_t bytes() {
+    size_t node = sizeof(void*) * 4 + sizeof(btree_key);
+    return keys.size() * ((node + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*));
+  }
+};
+
+struct sorted_vector_adapter {
+  vector<btree_key> keys;
+
+  static const char* name() { return "sorted vector"; }
+  static bool slow_updates() { return true; }
+  static bool read_only() { return false; }
+
+  void load_sorted(vector<btree_key>& sorted) { keys.swap(sorted); }
+  void insert_sorted(const btree_key* sorted, int count) {
+    size_t old_size = keys.size();
+    keys.insert(keys.end(), sorted, sorted + count);
+    inplace_merge(keys.begin(), keys.begin() + old_size, keys.end());
+    keys.erase(unique(keys.begin(), keys.end()), keys.end());
+  }
+  void remove_sorted(const btree_key* sorted, int count) {
+    vector<btree_key> kept;
+    kept.reserve(keys.size());
+    set_difference(keys.begin(), keys.end(), sorted, sorted + count, back_inserter(kept));
+    keys.swap(kept);
+  }
+  void insert_key(btree_key key) {
+    vector<btree_key>::iterator it = lower_bound(keys.begin(), keys.end(), key);
+    if (it == keys.end() || *it != key) {
+      keys.insert(it, key);
+    }
+  }
+  void append_key(btree_key key) {
+    if (keys.empty() || keys.back() < key) {
+      keys.push_back(key);
+    } else {
+      insert_key(key);
+    }
+  }
+  void remove_key(btree_key key) {
+    vector<btree_key>::iterator it = lower_bound(keys.begin(), keys.end(), key);
+    if (it != keys.end() && *it == key) {
+      keys.erase(it);
+    }
+  }
+  bool find_key(btree_key key) { return binary_search(keys.begin(), keys.end(), key); }
+  bool lower_bound_key(btree_key key, btree_key& result) {
+    vector<btree_key>::iterator it = lower_bound(keys.begin(), keys.end(), key);
+    if (it == keys.end()) {
+      return false;
+    }
+    result = *it;
+    return true;
+  }
+  void scan_keys(btree_key lo, btree_key hi, vector<btree_key>& scanned) {
+    vector<btree_key>::iterator it = lower_bound(keys.begin(), keys.end(), lo);
+    for (; it != keys.end() && *it <= hi; ++it) {
+      scanned.push_back(*it);
+    }
+  }
+  long long size() { return keys.size(); }
+  size_t bytes() { return keys.capacity() * sizeof(btree_key); }
+};
+
+enum op_type { OP_FIND, OP_INSERT, OP_APPEND, OP_REMOVE, OP_LOWER_BOUND, OP_SCAN };
+
+struct bench_op {
+  op_type type;
+  btree_key key;
+
+  // The end of the range for OP_SCAN.
+  btree_key last;
+};
+
+struct bench_result {
+  double seconds;
+  long ops;
+  double p50;
+  double p99;
+  double p999;
+  perf_sample counters;
+};
+
+struct bench_options {
+  long max_size;
+  long vector_limit;
+  unsigned long long seed;
+  bool use_perf;
+};
+
+// clock_overhead is the cost of the two clock reads that bracket each
+// sampled operation. It is subtracted from every latency sample.
+double clock_overhead = 0;
+
+void calibrate_clock() {
+  const int rounds = 100000;
+  bench_clock::time_point start = bench_clock::now();
+  for (int i = 0; i < rounds; i++) {
+    bench_clock::now();
+  }
+  bench_clock::time_point end = bench_clock::now();
+  clock_overhead = chrono::duration<double, nano>(end - start).count() / rounds;
+}
+
+double percentile(vector<double>& samples, double p) {
+  if (samples.empty()) {
+    return 0;
+  }
+  size_t index = (size_t) (p * (samples.size() - 1));
+  nth_element(samples.begin(), samples.begin() + index, samples.end());
+  return samples[index];
+}
+
+// bench_perf holds the hardware counters read around every timed run.
+perf_counters bench_perf;
+
+// checksum keeps the compiler from discarding find results.
+long checksum = 0;
+
+// scanned is reused by every scan, so scans don't time its growth.
+vector<btree_key> scanned;
+
+template <typename Adapter>
+void apply(Adapter& target, const bench_op& op) {
+  switch (op.type) {
+  case OP_FIND:
+    checksum += target.find_key(op.key);
+    break;
+  case OP_INSERT:
+    target.insert_key(op.key);
+    break;
+  case OP_APPEND:
+    target.append_key(op.key);
+    break;
+  case OP_REMOVE:
+    target.remove_key(op.key);
+    break;
+  case OP_LOWER_BOUND: {
+    btree_key result;
+    if (target.lower_bound_key(op.key, result)) {
+      checksum += result;
+    }
+    break;
+  }
+  case OP_SCAN:
+    scanned.clear();
+    target.scan_keys(op.key, op.last, scanned);
+    checksum += scanned.size();
+    break;
+  }
+}
+
+// run_ops applies every operation and times the whole run. Roughly
+// 200k operations are also timed individually to get the latency
+// distribution; the sampling stride keeps the clock reads from
+// dominating the throughput figure. Hardware counters cover the same
+// span as the throughput timer.
+template <typename Adapter>
+bench_result run_ops(Adapter& target, const vector<bench_op>& ops) {
+  bench_result result;
+  vector<double> samples;
+  size_t stride = max((size_t) 1, ops.size() / 200000);
+  samples.reserve(ops.size() / stride + 1);
+
+  perf_start(&bench_perf);
+  bench_clock::time_point start = bench_clock::now();
+  for (size_t i = 0; i < ops.size(); i++) {
+    if (i % stride == 0) {
+      bench_clock::time_point op_start = bench_clock::now();
+      apply(target, ops[i]);
+      bench_clock::time_point op_end = bench_clock::now();
+      double ns = chrono::duration<double, nano>(op_end - op_start).count() - clock_overhead;
+      samples.push_back(ns > 0 ? ns : 0);
+    } else {
+      apply(target, ops[i]);
+    }
+  }
+  bench_clock::time_point end = bench_clock::now();
+  perf_stop(&bench_perf, &result.counters);
+
+  result.seconds = chrono::duration<double>(end - start).count();
+  result.ops = ops.size();
+  result.p50 = percentile(samples, 0.50);
+  result.p99 = percentile(samples, 0.99);
+  result.p999 = percentile(samples, 0.999);
+  return result;
+}
+
+// run_batches inserts (or removes) 'keys' in consecutive sorted
+// batches of 'batch_size' keys each. Every batch is timed; its latency
+// is reported per key so the columns compare with the single-key
+// workloads.
+template <typename Adapter>
+bench_result run_batches(Adapter& target, const vector<btree_key>& keys, size_t batch_size, bool remove) {
+  bench_result result;
+  vector<double> samples;
+
+  perf_start(&bench_perf);
+  bench_clock::time_point start = bench_clock::now();
+  for (size_t i = 0; i < keys.size(); i += batch_size) {
+    size_t count = min(batch_size, keys.size() - i);
+    bench_clock::time_point batch_start = bench_clock::now();
+    if (remove) {
+      target.remove_sorted(&keys[i], count);
+    } else {
+      target.insert_sorted(&keys[i], count);
+    }
+    bench_clock::time_point batch_end = bench_clock::now();
+    double ns = chrono::duration<double, nano>(batch_end - batch_start).count() - clock_overhead;
+    samples.push_back(ns > 0 ? ns / count : 0);
+  }
+  bench_clock::time_point end = bench_clock::now();
+  perf_stop(&bench_perf, &result.counters);
+
+  result.seconds = chrono::duration<double>(end - start).count();
+  result.ops = keys.size();
+  result.p50 = percentile(samples, 0.50);
+  result.p99 = percentile(samples, 0.99);
+  result.p999 = percentile(samples, 0.999);
+  return result;
+}
+
+void print_header() {
+  cout << left << setw(17) << "structure" << setw(16) << "workload" << right
+       << setw(11) << "size" << setw(15) << "ops/sec"
+       << setw(11) << "p50(ns)" << setw(11) << "p99(ns)" << setw(11) << "p999(ns)";
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    cout << setw(10) << perf_counter_name(i);
+  }
+  cout << endl;
+}
+
+void print_result(const char* structure, const char* workload, long size, const bench_result& result) {
+  cout << left << setw(17) << structure << setw(16) << workload << right
+       << setw(11) << size << setw(15) << fixed << setprecision(0) << result.ops / result.seconds
+       << setw(11) << setprecision(0) << result.p50
+       << setw(11) << setprecision(0) << result.p99
+       << setw(11) << setprecision(0) << result.p999;
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    if (result.counters.available[i]) {
+      cout << setw(10) << setprecision(2) << result.counters.values[i] / result.ops;
+    } else {
+      cout << setw(10) << "-";
+    }
+  }
+  cout << endl;
+}
+
+// print_memory reports the bytes a structure uses per key where the
+// other rows report throughput.
+void print_memory(const char* structure, long size, size_t bytes) {
+  cout << left << setw(17) << structure << setw(16) << "memory" << right
+       << setw(11) << size << setw(15) << fixed << setprecision(1) << (double) bytes / size
+       << " bytes/key" << endl;
+}
+
+void print_skipped(const char* structure, const char* workload, long size) {
+  cout << left << setw(17) << structure << setw(16) << workload << right
+       << setw(11) << size << setw(15) << "skipped" << endl;
+}
+
+// check_size makes sure the structure holds what the workload says it
+// should, so a broken insert or remove can't masquerade as a fast one.
+template <typename Adapter>
+void check_size(Adapter& target, long long expected, const char* workload) {
+  if (target.size() != expected) {
+    cerr << target.name() << " " << workload << ": expected " << expected
+         << " keys, found " << target.size() << endl;
+    exit(1);
+  }
+}
+
+template <typename Adapter>
+void run_workloads(long size, const bench_options& options) {
+  const char* name = Adapter::name();
+  bool too_slow = Adapter::read_only() || (Adapter::slow_updates() && size > options.vector_limit);
+  bench_rng rng(options.seed + size);
+  vector<bench_op> ops(size);
+
+  // insert_seq: ascending keys into an empty structure.
+  if (too_slow) {
+    print_skipped(name, "insert_seq", size);
+  } else {
+    Adapter target;
+    for (long i = 0; i < size; i++) {
+      ops[i].type = OP_INSERT;
+      ops[i].key = (btree_key) i;
+    }
+    print_result(name, "insert_seq", size, run_ops(target, ops));
+    check_size(target, size, "insert_seq");
+  }
+
+  // append_seq: the same ascending keys, through the append path.
+  if (too_slow) {
+    print_skipped(name, "append_seq", size);
+  } else {
+    Adapter target;
+    for (long i = 0; i < size; i++) {
+      ops[i].type = OP_APPEND;
+      ops[i].key = (btree_key) i;
+    }
+    print_result(name, "append_seq", size, run_ops(target, ops));
+    check_size(target, size, "append_seq");
+  }
+
+  // insert_batch: scrambled keys, sorted in batches of 1000, into an
+  // empty structure.
+  if (too_slow) {
+    print_skipped(name, "insert_batch", size);
+    print_skipped(name, "remove_batch", size);
+  } else {
+    Adapter target;
+    vector<btree_key> batched(size);
+    for (long i = 0; i < size; i++) {
+      batched[i] = scramble(i);
+    }
+    for (long i = 0; i < size; i += 1000) {
+      sort(batched.begin() + i, batched.begin() + min(size, i + 1000));
+    }
+    print_result(name, "insert_batch", size, run_batches(target, batched, 1000, false));
+    check_size(target, size, "insert_batch");
+
+    // remove_batch: the same keys and batches, in reverse batch order,
+    // until the structure is empty.
+    vector<btree_key> reversed;
+    reversed.reserve(size);
+    for (long i = ((size - 1) / 1000) * 1000; i >= 0; i -= 1000) {
+      reversed.insert(reversed.end(), batched.begin() + i, batched.begin() + min(size, i + 1000));
+    }
+    print_result(name, "remove_batch", size, run_batches(target, reversed, 1000, true));
+    check_size(target, 0, "remove_batch");
+  }
+
+  // insert_rand: scrambled keys into an empty structure.
+  Adapter loaded;
+  if (too_slow) {
+    print_skipped(name, "insert_rand", size);
+    vector<btree_key> sorted_keys(size);
+    for (long i = 0; i < size; i++) {
+      sorted_keys[i] = scramble(i);
+    }
+    sort(sorted_keys.begin(), sorted_keys.end());
+    loaded.load_sorted(sorted_keys);
+  } else {
+    for (long i = 0; i < size; i++) {
+      ops[i].type = OP_INSERT;
+      ops[i].key = scramble(i);
+    }
+    print_result(name, "insert_rand", size, run_ops(loaded, ops));
+  }
+  check_size(loaded, size, "insert_rand");
+  print_memory(name, size, loaded.bytes());
+
+  // find_rand: uniformly chosen keys, all present.
+  for (long i = 0; i < size; i++) {
+    ops[i].type = OP_FIND;
+    ops[i].key = scramble(rng.next() % size);
+  }
+  print_result(name, "find_rand", size, run_ops(loaded, ops));
+
+  // find_miss: uniformly chosen keys, none present.
+  for (long i = 0; i < size; i++) {
+    ops[i].type = OP_FIND;
+    ops[i].key = scramble(size + rng.next() % size);
+  }
+  print_result(name, "find_miss", size, run_ops(loaded, ops));
+
+  // find_zipf: Zipfian (theta 0.99) over the present keys.
+  zipf_generator zipf(size, 0.99);
+  for (long i = 0; i < size; i++) {
+    ops[i].type = OP_FIND;
+    ops[i].key = scramble(zipf.next(rng));
+  }
+  print_result(name, "find_zipf", size, run_ops(loaded, ops));
+
+  // lower_bound: uniformly chosen keys, half of them present, and the
+  // first key at or after each.
+  for (long i = 0; i < size; i++) {
+    ops[i].type = OP_LOWER_BOUND;
+    ops[i].key = scramble(rng.next() % (2 * size));
+  }
+  print_result(name, "lower_bound", size, run_ops(loaded, ops));
+
+  // scan: ranges starting at uniformly chosen present keys and wide
+  // enough to hold about 100 keys, since the keys are spread evenly
+  // over [0, 2^31). A scan counts as one operation.
+  long scans = max(size / 100, 1000L);
+  long long width = (1LL << 31) / size * 100;
+  vector<bench_op> scan_ops(scans);
+  for (long i = 0; i < scans; i++) {
+    scan_ops[i].type = OP_SCAN;
+    scan_ops[i].key = scramble(rng.next() % size);
+    scan_ops[i].last = (btree_key) min(scan_ops[i].key + width, (long long) 0x7fffffff);
+  }
+  print_result(name, "scan", size, run_ops(loaded, scan_ops));
+
+  if (too_slow) {
+    print_skipped(name, "mixed", size);
+    print_skipped(name, "remove_rand", size);
+    return;
+  }
+
+  // mixed: 80% Zipfian finds, 10% inserts of new keys and 10% removes
+  // of uniformly chosen keys.
+  long inserted = 0;
+  for (long i = 0; i < size; i++) {
+    unsigned long long pick = rng.next() % 10;
+    if (pick < 8) {
+      ops[i].type = OP_FIND;
+      ops[i].key = scramble(zipf.next(rng));
+    } else if (pick == 8) {
+      ops[i].type = OP_INSERT;
+      ops[i].key = scramble(size + inserted);
+      inserted++;
+    } else {
+      ops[i].type = OP_REMOVE;
+      ops[i].key = scramble(rng.next() % (size + inserted));
+    }
+  }
+  print_result(name, "mixed", size, run_ops(loaded, ops));
+
+  // remove_rand: every present key, in shuffled order, until empty.
+  vector<btree_key> present;
+  present.reserve(loaded.size());
+  for (long i = 0; i < size + inserted; i++) {
+    btree_key key = scramble(i);
+    if (loaded.find_key(key)) {
+      present.push_back(key);
+    }
+  }
+  for (size_t i = present.size(); i > 1; i--) {
+    swap(present[i - 1], present[rng.next() % i]);
+  }
+  ops.resize(present.size());
+  for (size_t i = 0; i < present.size(); i++) {
+    ops[i].type = OP_REMOVE;
+    ops[i].key = present[i];
+  }
+  print_result(name, "remove_rand", size, run_ops(loaded, ops));
+  check_size(loaded, 0, "remove_rand");
+}
+
+// run_relayout times uniform finds on a tree whose nodes were left
+// scattered across the heap by a long run of random inserts and
+// removes, then again after relayout has moved them into van Emde Boas
+// order. Both use the same keys and the same finds.
+void run_relayout(long size, const bench_options& options) {
+  bench_rng rng(options.seed + size);
+  btree_adapter churned;
+
+  // Insert twice the keys, then remove every other one in shuffled
+  // order, so the nodes that are left came from all over the heap.
+  for (long i = 0; i < 2 * size; i++) {
+    churned.insert_key(scramble(i));
+  }
+  vector<btree_key> removed(size);
+  for (long i = 0; i < size; i++) {
+    removed[i] = scramble(2 * i + 1);
+  }
+  for (long i = size; i > 1; i--) {
+    swap(removed[i - 1], removed[rng.next() % i]);
+  }
+  for (long i = 0; i < size; i++) {
+    churned.remove_key(removed[i]);
+  }
+  check_size(churned, size, "find_churned");
+
+  vector<bench_op> ops(size);
+  for (long i = 0; i < size; i++) {
+    ops[i].type = OP_FIND;
+    ops[i].key = scramble(2 * (rng.next() % size));
+  }
+  print_result(btree_adapter::name(), "find_churned", size, run_ops(churned, ops));
+  relayout(churned.root);
+  print_result(btree_adapter::name(), "find_relayout", size, run_ops(churned, ops));
+  check_size(churned, size, "find_relayout");
+}
+
+void usage() {
+  cout << "btree_bench [--max-size N] [--vector-limit N] [--seed S] [--no-perf]" << endl;
+  cout << endl;
+  cout << "    --max-size N     : largest tree size to run, 1000 to 100000000 (default 1000000)" << endl;
+  cout << "    --vector-limit N : largest size for sorted vector inserts/removes (default 100000)" << endl;
+  cout << "    --seed S         : seed for the operation generator (default 1)" << endl;
+  cout << "    --no-perf        : don't read hardware performance counters" << endl;
+}
+
+int main(int argc, char** argv) {
+  bench_options options;
+  options.max_size = 1000000;
+  options.vector_limit = 100000;
+  options.seed = 1;
+  options.use_perf = true;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc) {
+      options.max_size = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--vector-limit") == 0 && i + 1 < argc) {
+      options.vector_limit = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      options.seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--no-perf") == 0) {
+      options.use_perf = false;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (options.max_size > 100000000) {
+    options.max_size = 100000000;
+  }
+
+  if (options.use_perf) {
+    perf_open(&bench_perf);
+  } else {
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+      bench_perf.fds[i] = -1;
+    }
+  }
+
+  calibrate_clock();
+  print_header();
+  for (long size = 1000; size <= options.max_size; size *= 10) {
+    run_workloads<btree_adapter>(size, options);
+    run_workloads<filtered_adapter>(size, options);
+    run_workloads<lookaside_adapter>(size, options);
+    run_workloads<frozen_adapter>(size, options);
+    run_workloads<set_adapter>(size, options);
+    run_workloads<sorted_vector_adapter>(size, options);
+    run_relayout(size, options);
+  }
+  perf_close(&bench_perf);
+  cerr << "checksum " << checksum << endl;
+  return 0;
+}
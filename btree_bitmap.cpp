@@ -0,0 +1,480 @@
+//
+// btree_bitmap.cpp
+//
+
+#include <algorithm>
+#include "btree_bitmap.h"
+
+using namespace std;
+
+// From btree.cpp.
+void collect_keys(btree* node, vector<btree_key>& keys);
+
+#define BITMAP_WORDS (BITMAP_WINDOW_KEYS / 64)
+
+int count_bits(unsigned long long word) {
+#if defined(__GNUC__)
+  return __builtin_popcountll(word);
+#else
+  int count = 0;
+  while (word != 0) {
+    word &= word - 1;
+    count++;
+  }
+  return count;
+#endif
+}
+
+// lowest_bit returns the index of the lowest set bit of a non-zero word.
+int lowest_bit(unsigned long long word) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(word);
+#else
+  return count_bits((word & (0 - word)) - 1);
+#endif
+}
+
+// window_start returns the first key of the window 'key' falls in. Clearing the low bits
+// of a two's complement key rounds it down, so negative keys get windows too, in order.
+btree_key window_start(btree_key key) {
+  return (btree_key) ((unsigned long long) key & ~(unsigned long long) (BITMAP_WINDOW_KEYS - 1));
+}
+
+unsigned short window_offset(btree_key key) {
+  return (unsigned short) ((unsigned long long) key & (BITMAP_WINDOW_KEYS - 1));
+}
+
+bool window_contains(const bitmap_window& window, unsigned short offset) {
+  if (window.words.empty()) {
+    return binary_search(window.offsets.begin(), window.offsets.end(), offset);
+  }
+  return (window.words[offset / 64] >> (offset % 64)) & 1;
+}
+
+// to_bitmap and to_array switch a window between its two layouts.
+void to_bitmap(bitmap_window& window) {
+  window.words.assign(BITMAP_WORDS, 0);
+  for (size_t i = 0; i < window.offsets.size(); i++) {
+    window.words[window.offsets[i] / 64] |= 1ULL << (window.offsets[i] % 64);
+  }
+  vector<unsigned short>().swap(window.offsets);
+}
+
+void to_array(bitmap_window& window) {
+  window.offsets.reserve(window.count);
+  for (int w = 0; w < BITMAP_WORDS; w++) {
+    for (unsigned long long word = window.words[w]; word != 0; word &= word - 1) {
+      window.offsets.push_back(w * 64 + lowest_bit(word));
+    }
+  }
+  vector<unsigned long long>().swap(window.words);
+}
+
+// window_insert and window_remove add and take out one offset, switching the window's
+// layout as its count crosses the limits. They return false if there was nothing to do.
+bool window_insert(bitmap_window& window, unsigned short offset) {
+  if (window.words.empty()) {
+    vector<unsigned short>::iterator pos =
+        lower_bound(window.offsets.begin(), window.offsets.end(), offset);
+    if (pos != window.offsets.end() && *pos == offset) {
+      return false;
+    }
+    window.offsets.insert(pos, offset);
+    if (window.offsets.size() > BITMAP_ARRAY_MAX) {
+      to_bitmap(window);
+    }
+  } else {
+    unsigned long long& word = window.words[offset / 64];
+    unsigned long long bit = 1ULL << (offset % 64);
+    if (word & bit) {
+      return false;
+    }
+    word |= bit;
+  }
+  window.count++;
+  return true;
+}
+
+bool window_remove(bitmap_window& window, unsigned short offset) {
+  if (window.words.empty()) {
+    vector<unsigned short>::iterator pos =
+        lower_bound(window.offsets.begin(), window.offsets.end(), offset);
+    if (pos == window.offsets.end() || *pos != offset) {
+      return false;
+    }
+    window.offsets.erase(pos);
+  } else {
+    unsigned long long& word = window.words[offset / 64];
+    unsigned long long bit = 1ULL << (offset % 64);
+    if ((word & bit) == 0) {
+      return false;
+    }
+    word &= ~bit;
+  }
+  window.count--;
+
+  // Go back to an array only well below the switch point, so a window hovering around
+  // it doesn't convert back and forth on every change.
+  if (!window.words.empty() && window.count <= BITMAP_ARRAY_MAX / 2) {
+    to_array(window);
+  }
+  return true;
+}
+
+// window_rank returns the number of keys in the window below 'offset'.
+long long window_rank(const bitmap_window& window, unsigned short offset) {
+  if (window.words.empty()) {
+    return lower_bound(window.offsets.begin(), window.offsets.end(), offset) - window.offsets.begin();
+  }
+  long long rank = 0;
+  for (int w = 0; w < offset / 64; w++) {
+    rank += count_bits(window.words[w]);
+  }
+  return rank + count_bits(window.words[offset / 64] & ((1ULL << (offset % 64)) - 1));
+}
+
+bitmap_node* bitmap_node_alloc(bool is_leaf) {
+  bitmap_node* node = new bitmap_node;
+  node->is_leaf = is_leaf;
+  node->num_keys = 0;
+  return node;
+}
+
+// window_child_slot returns the child of an inner node that the window starting at
+// 'start' is under.
+int window_child_slot(bitmap_node* node, btree_key start) {
+  return upper_bound(node->starts, node->starts + node->num_keys, start) - node->starts;
+}
+
+// window_slot returns where the window starting at 'start' is, or would go, in a leaf.
+int window_slot(bitmap_node* leaf, btree_key start) {
+  return lower_bound(leaf->starts, leaf->starts + leaf->num_keys, start) - leaf->starts;
+}
+
+// node_keys returns the number of keys under a node.
+long long node_keys(bitmap_node* node) {
+  long long keys = 0;
+  if (node->is_leaf) {
+    for (int i = 0; i < node->num_keys; i++) {
+      keys += node->windows[i]->count;
+    }
+  } else {
+    for (int i = 0; i <= node->num_keys; i++) {
+      keys += node->counts[i];
+    }
+  }
+  return keys;
+}
+
+// bitmap_split_child splits the full child at 'child_index' of 'parent', which must have
+// room for one more separator, as multiset_split_child does, and shares the child's key
+// count out between the two halves.
+void bitmap_split_child(bitmap_node* parent, int child_index) {
+  bitmap_node* child = parent->children[child_index];
+  bitmap_node* sibling = bitmap_node_alloc(child->is_leaf);
+  int left_count = BITMAP_NODE_KEYS / 2;
+  btree_key separator = child->starts[left_count];
+
+  if (child->is_leaf) {
+    sibling->num_keys = child->num_keys - left_count;
+    copy(child->starts + left_count, child->starts + child->num_keys, sibling->starts);
+    copy(child->windows + left_count, child->windows + child->num_keys, sibling->windows);
+  } else {
+    sibling->num_keys = child->num_keys - left_count - 1;
+    copy(child->starts + left_count + 1, child->starts + child->num_keys, sibling->starts);
+    copy(child->children + left_count + 1, child->children + child->num_keys + 1, sibling->children);
+    copy(child->counts + left_count + 1, child->counts + child->num_keys + 1, sibling->counts);
+  }
+  child->num_keys = left_count;
+
+  for (int i = parent->num_keys; i > child_index; i--) {
+    parent->starts[i] = parent->starts[i - 1];
+    parent->children[i + 1] = parent->children[i];
+    parent->counts[i + 1] = parent->counts[i];
+  }
+  parent->starts[child_index] = separator;
+  parent->children[child_index + 1] = sibling;
+  parent->counts[child_index + 1] = node_keys(sibling);
+  parent->counts[child_index] -= parent->counts[child_index + 1];
+  parent->num_keys++;
+}
+
+// insert_below adds 'key' to the subtree rooted at 'node', which isn't full, splitting
+// full nodes on the way down so there is always room for whatever a split below pushes
+// up. If 'whole' isn't NULL, it is a window of keys starting at 'key' that isn't in the
+// set yet, and goes in as it is. Returns the number of keys added, which the inner nodes
+// on the way back up add to their counts.
+long long insert_below(bitmap_node* node, btree_key key, bitmap_window* whole) {
+  btree_key start = window_start(key);
+  if (node->is_leaf) {
+    int slot = window_slot(node, start);
+    if (slot == node->num_keys || node->starts[slot] != start) {
+      for (int i = node->num_keys; i > slot; i--) {
+        node->starts[i] = node->starts[i - 1];
+        node->windows[i] = node->windows[i - 1];
+      }
+      node->starts[slot] = start;
+      if (whole != NULL) {
+        node->windows[slot] = whole;
+        node->num_keys++;
+        return whole->count;
+      }
+      node->windows[slot] = new bitmap_window();
+      node->windows[slot]->count = 0;
+      node->num_keys++;
+    }
+    return window_insert(*node->windows[slot], window_offset(key)) ? 1 : 0;
+  }
+
+  int i = window_child_slot(node, start);
+  bitmap_node* child = node->children[i];
+  if (child->num_keys == BITMAP_NODE_KEYS) {
+    // A leaf holding the window is only full if the window has to be added.
+    bool has_window = child->is_leaf && binary_search(child->starts, child->starts + child->num_keys, start);
+    if (!has_window) {
+      bitmap_split_child(node, i);
+      i = window_child_slot(node, start);
+    }
+  }
+  long long added = insert_below(node->children[i], key, whole);
+  node->counts[i] += added;
+  return added;
+}
+
+// add_to_set adds one key, or a whole window, to the set.
+long long add_to_set(btree_bitmap* set, btree_key key, bitmap_window* whole) {
+  if (set->root == NULL) {
+    set->root = bitmap_node_alloc(true);
+  }
+  if (set->root->num_keys == BITMAP_NODE_KEYS) {
+    bitmap_node* old_root = set->root;
+    set->root = bitmap_node_alloc(false);
+    set->root->children[0] = old_root;
+    set->root->counts[0] = set->keys;
+    bitmap_split_child(set->root, 0);
+  }
+  long long added = insert_below(set->root, key, whole);
+  set->keys += added;
+  return added;
+}
+
+// remove_below takes 'key' out of the subtree rooted at 'node', dropping its window if
+// that empties it. 'leaf_emptied' is set if that leaves the leaf with no windows. Returns
+// false if the key wasn't there.
+bool remove_below(bitmap_node* node, btree_key key, bool& leaf_emptied) {
+  btree_key start = window_start(key);
+  if (node->is_leaf) {
+    int slot = window_slot(node, start);
+    if (slot == node->num_keys || node->starts[slot] != start ||
+        !window_remove(*node->windows[slot], window_offset(key))) {
+      return false;
+    }
+    if (node->windows[slot]->count == 0) {
+      delete node->windows[slot];
+      for (int i = slot + 1; i < node->num_keys; i++) {
+        node->starts[i - 1] = node->starts[i];
+        node->windows[i - 1] = node->windows[i];
+      }
+      node->num_keys--;
+      leaf_emptied = node->num_keys == 0;
+    }
+    return true;
+  }
+
+  int i = window_child_slot(node, start);
+  if (!remove_below(node->children[i], key, leaf_emptied)) {
+    return false;
+  }
+  node->counts[i]--;
+  return true;
+}
+
+// bitmap_prune goes down to the leaf that the window starting at 'start' belongs in and
+// frees it if it is empty, unlinking it and collapsing single-child inner nodes on the
+// way back up, as multiset_prune does.
+void bitmap_prune(bitmap_node*& node, btree_key start) {
+  if (node->is_leaf) {
+    if (node->num_keys == 0) {
+      delete node;
+      node = NULL;
+    }
+    return;
+  }
+
+  int slot = window_child_slot(node, start);
+  bitmap_prune(node->children[slot], start);
+  if (node->children[slot] != NULL) {
+    return;
+  }
+  for (int i = max(slot - 1, 0); i + 1 < node->num_keys; i++) {
+    node->starts[i] = node->starts[i + 1];
+  }
+  for (int i = slot; i < node->num_keys; i++) {
+    node->children[i] = node->children[i + 1];
+    node->counts[i] = node->counts[i + 1];
+  }
+  node->num_keys--;
+  if (node->num_keys == 0) {
+    bitmap_node* only_child = node->children[0];
+    delete node;
+    node = only_child;
+  }
+}
+
+// find_window returns the window starting at 'start', or NULL.
+bitmap_window* find_window(const btree_bitmap& set, btree_key start) {
+  bitmap_node* node = set.root;
+  if (node == NULL) {
+    return NULL;
+  }
+  while (!node->is_leaf) {
+    node = node->children[window_child_slot(node, start)];
+  }
+  int slot = window_slot(node, start);
+  return slot < node->num_keys && node->starts[slot] == start ? node->windows[slot] : NULL;
+}
+
+void bitmap_init(btree_bitmap* set) {
+  set->root = NULL;
+  set->keys = 0;
+}
+
+bool bitmap_insert(btree_bitmap* set, btree_key key) {
+  return add_to_set(set, key, NULL) == 1;
+}
+
+bool bitmap_remove(btree_bitmap* set, btree_key key) {
+  if (set->root == NULL) {
+    return false;
+  }
+  bool leaf_emptied = false;
+  if (!remove_below(set->root, key, leaf_emptied)) {
+    return false;
+  }
+  set->keys--;
+  if (leaf_emptied) {
+    bitmap_prune(set->root, window_start(key));
+  }
+  return true;
+}
+
+bool bitmap_contains(const btree_bitmap& set, btree_key key) {
+  bitmap_window* window = find_window(set, window_start(key));
+  return window != NULL && window_contains(*window, window_offset(key));
+}
+
+long long bitmap_rank(const btree_bitmap& set, btree_key key) {
+  bitmap_node* node = set.root;
+  if (node == NULL) {
+    return 0;
+  }
+
+  // Every key under the children left of the path down is smaller.
+  btree_key start = window_start(key);
+  long long rank = 0;
+  while (!node->is_leaf) {
+    int i = window_child_slot(node, start);
+    for (int j = 0; j < i; j++) {
+      rank += node->counts[j];
+    }
+    node = node->children[i];
+  }
+  int slot = window_slot(node, start);
+  for (int j = 0; j < slot; j++) {
+    rank += node->windows[j]->count;
+  }
+  if (slot == node->num_keys || node->starts[slot] != start) {
+    return rank;
+  }
+  return rank + window_rank(*node->windows[slot], window_offset(key));
+}
+
+void bitmap_from_tree(btree* root, btree_bitmap* set) {
+  bitmap_init(set);
+  vector<btree_key> keys;
+  if (root != NULL) {
+    collect_keys(root, keys);
+  }
+
+  // The keys come out sorted, so each window is filled in one go and then added whole.
+  size_t i = 0;
+  while (i < keys.size()) {
+    btree_key start = window_start(keys[i]);
+    bitmap_window* window = new bitmap_window();
+    size_t end = i;
+    while (end < keys.size() && window_start(keys[end]) == start) {
+      end++;
+    }
+    window->count = end - i;
+    if (window->count > BITMAP_ARRAY_MAX) {
+      window->words.assign(BITMAP_WORDS, 0);
+      for (; i < end; i++) {
+        unsigned short offset = window_offset(keys[i]);
+        window->words[offset / 64] |= 1ULL << (offset % 64);
+      }
+    } else {
+      for (; i < end; i++) {
+        window->offsets.push_back(window_offset(keys[i]));
+      }
+    }
+    add_to_set(set, start, window);
+  }
+}
+
+void collect_windows(bitmap_node* node, vector<btree_key>& starts, vector<bool>& dense) {
+  if (node->is_leaf) {
+    for (int i = 0; i < node->num_keys; i++) {
+      starts.push_back(node->starts[i]);
+      dense.push_back(!node->windows[i]->words.empty());
+    }
+    return;
+  }
+  for (int i = 0; i <= node->num_keys; i++) {
+    collect_windows(node->children[i], starts, dense);
+  }
+}
+
+void bitmap_windows(const btree_bitmap& set, vector<btree_key>& starts, vector<bool>& dense) {
+  if (set.root != NULL) {
+    collect_windows(set.root, starts, dense);
+  }
+}
+
+size_t node_bytes(bitmap_node* node) {
+  size_t bytes = sizeof(bitmap_node);
+  if (node->is_leaf) {
+    for (int i = 0; i < node->num_keys; i++) {
+      bytes += sizeof(bitmap_window) + node->windows[i]->offsets.capacity() * sizeof(unsigned short) +
+               node->windows[i]->words.capacity() * sizeof(unsigned long long);
+    }
+  } else {
+    for (int i = 0; i <= node->num_keys; i++) {
+      bytes += node_bytes(node->children[i]);
+    }
+  }
+  return bytes;
+}
+
+size_t bitmap_bytes(const btree_bitmap& set) {
+  return sizeof(set) + (set.root != NULL ? node_bytes(set.root) : 0);
+}
+
+void free_windows(bitmap_node* node) {
+  if (node->is_leaf) {
+    for (int i = 0; i < node->num_keys; i++) {
+      delete node->windows[i];
+    }
+  } else {
+    for (int i = 0; i <= node->num_keys; i++) {
+      free_windows(node->children[i]);
+    }
+  }
+  delete node;
+}
+
+void bitmap_destroy(btree_bitmap* set) {
+  if (set->root != NULL) {
+    free_windows(set->root);
+  }
+  bitmap_init(set);
+}
@@ -0,0 +1,116 @@
+//
+// btree_bitmap.h
+//
+// A set of keys for key spaces with long runs of consecutive keys.
+//
+// A dense run of keys costs a btree a whole node (and its share of the
+// nodes above) for every few keys. This set cuts the key space into
+// windows of BITMAP_WINDOW_KEYS keys, as Roaring bitmaps do, and picks
+// a layout for each window by how full it is:
+//
+// -- A sparse window holds its keys as a sorted array of 16-bit
+//    offsets from the window's start.
+// -- Once a window has more than BITMAP_ARRAY_MAX keys, the array would
+//    be bigger than a bitmap, so it switches to a bitmap with one bit
+//    per key in the window. It switches back once it is down to half
+//    that many keys, so a window near the limit doesn't flip back and
+//    forth.
+//
+// The windows holding keys are kept in a B+-tree keyed by window
+// start, so a sparse key space, with a key or two per window, costs
+// about what a btree would: a descent to find the window and no
+// shifting of other windows to add or drop one. Each inner node also
+// keeps the number of keys under each child, so rank (the number of
+// smaller keys) adds up the counts left of the path down, taking
+// O(log windows) rather than a pass over every window.
+//
+// Looking a key up in a bitmap window is one bit test, and rank inside
+// it is a popcount over the words before the key's.
+
+#ifndef btree_bitmap_h
+#define btree_bitmap_h
+
+#include <vector>
+#include "btree.h"
+
+// The number of keys a window covers. Offsets inside a window fit in 16
+// bits.
+#define BITMAP_WINDOW_BITS 16
+#define BITMAP_WINDOW_KEYS (1 << BITMAP_WINDOW_BITS)
+
+// The most keys a window keeps as an array. At two bytes a key, that is
+// the size of the window's bitmap.
+#define BITMAP_ARRAY_MAX 4096
+
+// bitmap_window holds the keys of one window, in one of two layouts.
+struct bitmap_window {
+  // count is the number of keys in the window.
+  int count;
+
+  // While 'words' is empty, the keys are the offsets in 'offsets', in
+  // ascending order. Otherwise 'words' holds BITMAP_WINDOW_KEYS bits,
+  // one per key, and 'offsets' is empty.
+  vector<unsigned short> offsets;
+  vector<unsigned long long> words;
+};
+
+// The most windows (or, in inner nodes, separators) a node of the
+// window tree holds.
+#define BITMAP_NODE_KEYS 16
+
+// bitmap_node is a node of the window tree. Only windows holding keys
+// are kept.
+struct bitmap_node {
+  bool is_leaf;
+  int num_keys;
+
+  // In a leaf, starts[i] is the first key that windows[i] covers. In an
+  // inner node child i holds the windows starting below starts[i] (and
+  // at or above starts[i - 1]), and counts[i] is the number of keys in
+  // them.
+  btree_key starts[BITMAP_NODE_KEYS];
+  long long counts[BITMAP_NODE_KEYS + 1];
+  union {
+    bitmap_window* windows[BITMAP_NODE_KEYS];
+    bitmap_node* children[BITMAP_NODE_KEYS + 1];
+  };
+};
+
+struct btree_bitmap {
+  bitmap_node* root;
+  long long keys;
+};
+
+// bitmap_init sets 'set' up as an empty set.
+void bitmap_init(btree_bitmap* set);
+
+// bitmap_insert adds 'key' to the set. Returns false if it was already
+// there.
+bool bitmap_insert(btree_bitmap* set, btree_key key);
+
+// bitmap_remove takes 'key' out of the set. Returns false if it wasn't
+// there.
+bool bitmap_remove(btree_bitmap* set, btree_key key);
+
+// bitmap_contains returns true if 'key' is in the set.
+bool bitmap_contains(const btree_bitmap& set, btree_key key);
+
+// bitmap_rank returns the number of keys in the set smaller than 'key'.
+long long bitmap_rank(const btree_bitmap& set, btree_key key);
+
+// bitmap_from_tree sets 'set' up holding the keys of the tree rooted at
+// 'root', as bitmap_init and then inserting them would.
+void bitmap_from_tree(btree* root, btree_bitmap* set);
+
+// bitmap_windows appends the start of each window holding keys to
+// 'starts', in ascending order, and whether it is a bitmap to 'dense'.
+void bitmap_windows(const btree_bitmap& set, vector<btree_key>& starts, vector<bool>& dense);
+
+// bitmap_bytes returns the memory the set uses, not counting allocator
+// overhead.
+size_t bitmap_bytes(const btree_bitmap& set);
+
+// bitmap_destroy frees the set's windows and leaves it empty.
+void bitmap_destroy(btree_bitmap* set);
+
+#endif
@@ -0,0 +1,257 @@
+//
+// btree_cursor.cpp
+//
+
+#include "btree_cursor.h"
+#include "btree_stats.h"
+#include "btree_trace.h"
+
+using namespace std;
+
+// From btree.cpp.
+btree* alloc_node(bool is_leaf);
+void insert_and_fix(btree_key key, btree* insertion_node, int slot, btree*& root);
+bool is_minimal(btree* node);
+void rotate_left(btree* parent, int separating_key_index);
+void split_child_at(btree* parent, int child_index, int left_count);
+
+atomic<unsigned int> btree_epoch_clock(0);
+thread_local unsigned long long btree_thread_releases = 0;
+
+void cursor_reset(btree_cursor* cursor) {
+  cursor->root = NULL;
+  cursor->epoch = 0;
+  cursor->depth = 0;
+}
+
+// climb_to returns the depth of the deepest node on the cursor's path whose key range
+// contains 'key'. A node's range is bounded by the nearest separators around it in the
+// nodes above, which are read live, so separators that changed value since the path was
+// taken are still honoured. Splits and rotations can move a node on the path to another
+// parent, so each link climbed is checked; if one no longer holds, the path is useless
+// and climb_to returns -1.
+int climb_to(btree_cursor* cursor, btree_key key) {
+  int top = cursor->depth - 1;
+  bool has_low = false;
+  bool has_high = false;
+  for (int d = top - 1; d >= 0 && !(has_low && has_high); d--) {
+    btree* parent = cursor->path[d];
+    int slot = cursor->slots[d];
+    if (slot > parent->num_keys || parent->children[slot] != cursor->path[d + 1]) {
+      return -1;
+    }
+
+    // The separators either side of the child we took bound the node below. Only the
+    // nearest bound on each side matters, so once one is found, higher ones are skipped.
+    bool outside = false;
+    if (!has_low && slot > 0) {
+      if (key <= parent->keys[slot - 1]) {
+        outside = true;
+      } else {
+        has_low = true;
+      }
+    }
+    if (!has_high && slot < parent->num_keys) {
+      if (key >= parent->keys[slot]) {
+        outside = true;
+      } else {
+        has_high = true;
+      }
+    }
+
+    // The key isn't under path[d + 1], so the best we can hope for is path[d]. Its
+    // bounds come from further up.
+    if (outside) {
+      top = d;
+      has_low = false;
+      has_high = false;
+    }
+  }
+  return top;
+}
+
+// cursor_seek moves the cursor to the node find would return for 'key' and returns the
+// key's position there. The tree must not be empty.
+btree_position cursor_seek(btree* root, btree_key key, btree_cursor* cursor) {
+  int top = -1;
+  if (cursor->depth > 0 && cursor->root == root && cursor->epoch == root->epoch) {
+    top = climb_to(cursor, key);
+  }
+  if (top < 0) {
+    cursor->root = root;
+    cursor->epoch = root->epoch;
+    cursor->path[0] = root;
+    top = 0;
+  }
+
+  // Descend from there the way lookup_node does, recording the path.
+  btree_position position;
+  btree* node = cursor->path[top];
+  int depth = top + 1;
+  while (true) {
+    int i = 0;
+    while (i < node->num_keys && node->keys[i] < key) {
+      i++;
+    }
+    position.node = node;
+    position.slot = i;
+    position.found = i < node->num_keys && node->keys[i] == key;
+    if (position.found || node->is_leaf) {
+      break;
+    }
+    cursor->slots[depth - 1] = i;
+    node = node->children[i];
+    cursor->path[depth] = node;
+    depth++;
+  }
+  cursor->depth = depth;
+  return position;
+}
+
+btree* find_hinted(btree*& root, btree_key key, btree_cursor* cursor) {
+  count_event(BTREE_FINDS);
+  BTREE_TRACE(BTREE_TRACE_OPS, TRACE_FIND, root, key);
+  if (root == NULL) {
+    return NULL;
+  }
+  return cursor_seek(root, key, cursor).node;
+}
+
+void insert_hinted(btree*& root, btree_key key, btree_cursor* cursor) {
+  if (root == NULL) {
+    insert(root, key);
+    return;
+  }
+
+  count_event(BTREE_INSERTS);
+  BTREE_TRACE(BTREE_TRACE_OPS, TRACE_INSERT, root, key);
+
+  btree_position position = cursor_seek(root, key, cursor);
+  if (position.found) {
+    return;
+  }
+
+  // A split may move nodes on the path to new parents, which the next climb will notice;
+  // otherwise the key went into the leaf the cursor points at and the path is still good.
+  insert_and_fix(key, position.node, position.slot, root);
+}
+
+void remove_hinted(btree*& root, btree_key key, btree_cursor* cursor) {
+  if (root == NULL) {
+    remove(root, key);
+    return;
+  }
+
+  // Keys in inner nodes, and leaves that would underflow, need remove's rebalancing.
+  btree_position position = cursor_seek(root, key, cursor);
+  btree* node = position.node;
+  if (position.found && (!node->is_leaf || (node != root && is_minimal(node)))) {
+    remove(root, key);
+    return;
+  }
+
+  count_event(BTREE_REMOVES);
+  BTREE_TRACE(BTREE_TRACE_OPS, TRACE_REMOVE, root, key);
+  if (!position.found) {
+    return;
+  }
+
+  for (int i = position.slot + 1; i < node->num_keys; i++) {
+    node->keys[i - 1] = node->keys[i];
+  }
+  node->num_keys--;
+}
+
+// on_right_edge returns true if the cursor holds a current path down the right edge of
+// the tree rooted at 'root'.
+bool on_right_edge(btree* root, btree_cursor* cursor) {
+  if (cursor->depth == 0 || cursor->root != root || cursor->epoch != root->epoch ||
+      !cursor->path[cursor->depth - 1]->is_leaf) {
+    return false;
+  }
+  for (int d = 0; d < cursor->depth - 1; d++) {
+    btree* node = cursor->path[d];
+    if (cursor->slots[d] != node->num_keys || node->children[node->num_keys] != cursor->path[d + 1]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void fill_right_edge(btree* root, btree_cursor* cursor) {
+  cursor->root = root;
+  cursor->epoch = root->epoch;
+  btree* node = root;
+  int depth = 1;
+  cursor->path[0] = node;
+  while (!node->is_leaf) {
+    cursor->slots[depth - 1] = node->num_keys;
+    node = node->children[node->num_keys];
+    cursor->path[depth] = node;
+    depth++;
+  }
+  cursor->depth = depth;
+}
+
+void append(btree*& root, btree_key key, btree_cursor* cursor) {
+  if (root == NULL) {
+    insert(root, key);
+    return;
+  }
+
+  if (!on_right_edge(root, cursor)) {
+    fill_right_edge(root, cursor);
+  }
+  btree* leaf = cursor->path[cursor->depth - 1];
+  if (leaf->num_keys > 0 && key <= leaf->keys[leaf->num_keys - 1]) {
+    insert_hinted(root, key, cursor);
+    return;
+  }
+
+  count_event(BTREE_INSERTS);
+  BTREE_TRACE(BTREE_TRACE_OPS, TRACE_INSERT, root, key);
+  leaf->keys[leaf->num_keys] = key;
+  leaf->num_keys++;
+
+  // Fix overflow up the right edge. Nothing will ever be inserted to the left of an
+  // overfull node again, so rather than split it in half, first top up its left
+  // sibling; only when that is full, split so the new right node gets as few keys as it
+  // may. Left of the edge, nodes end up full instead of half full.
+  int d = cursor->depth - 1;
+  while (cursor->path[d]->num_keys > BTREE_ORDER - 1) {
+    btree* node = cursor->path[d];
+    if (d == 0) {
+      // The root is full. Put a new one above it and shift the path down a level.
+      count_event(BTREE_ROOT_GROWS);
+      BTREE_TRACE(BTREE_TRACE_EVENTS, TRACE_ROOT_GROW, node, key);
+      root = alloc_node(false);
+      root->epoch = node->epoch;
+      root->children[0] = node;
+      for (int e = cursor->depth; e > 0; e--) {
+        cursor->path[e] = cursor->path[e - 1];
+        cursor->slots[e] = cursor->slots[e - 1];
+      }
+      cursor->path[0] = root;
+      cursor->root = root;
+      cursor->depth++;
+      d = 1;
+    }
+
+    btree* parent = cursor->path[d - 1];
+    int slot = parent->num_keys;
+    if (slot > 0 && parent->children[slot - 1]->num_keys < BTREE_ORDER - 1) {
+      rotate_left(parent, slot - 1);
+    } else {
+      split_child_at(parent, slot, node->num_keys - 1 - (BTREE_ORDER - 1) / 2);
+      cursor->path[d] = parent->children[parent->num_keys];
+    }
+    cursor->slots[d - 1] = parent->num_keys;
+    if (!cursor->path[d]->is_leaf) {
+      cursor->slots[d] = cursor->path[d]->num_keys;
+    }
+    d--;
+  }
+
+  // The path was kept up to date through every change above, none of which freed a node.
+  cursor->epoch = root->epoch;
+}
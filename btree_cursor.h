@@ -0,0 +1,117 @@
+//
+// btree_cursor.h
+//
+// Finger search: find, insert and remove that start from where the
+// previous operation ended instead of from the root.
+//
+// A cursor remembers the path from the root to the node the last
+// operation touched. The next operation climbs that path only until it
+// reaches a node whose key range (bounded by the separators above it)
+// contains the new key, then descends from there. When consecutive keys
+// land in the same or a neighbouring leaf, only a level or two is
+// visited, so a run of nearby operations costs O(log distance) each
+// rather than O(log n).
+//
+// A cursor remembers the tree's epoch (see btree.h) along with its
+// path, and is silently refilled from the root once the epoch moves on,
+// since a node on the path may have been freed. Other changes, such as
+// splits and rotations, leave every node alive: a cursor checks each
+// link on the path as it climbs and starts again from the root if one
+// no longer holds. Either way a stale cursor costs one ordinary descent
+// and is never wrong. Nothing is shared between trees, so changes to
+// one tree never invalidate cursors on another.
+//
+// Epochs come from one process-wide counter, taken once per operation
+// that frees nodes and once per new tree, so no two trees or versions
+// of a tree share one, whichever threads made them. A tree destroyed
+// and rebuilt at the same address, on any thread, starts at a new
+// epoch, and a cursor left over from the old one is ignored. The
+// counter is 32 bits, so a cursor could in principle be fooled after
+// exactly 2^32 such operations.
+
+#ifndef btree_cursor_h
+#define btree_cursor_h
+
+#include <atomic>
+#include "btree.h"
+
+// Deeper than any tree can get, even with 64-bit keys.
+#define BTREE_CURSOR_MAX_DEPTH 64
+
+// btree_epoch_clock hands out epochs. It is only written when a tree
+// frees nodes or starts, never per node.
+extern std::atomic<unsigned int> btree_epoch_clock;
+
+// next_epoch returns an epoch no tree has had before.
+inline unsigned int next_epoch() {
+  return btree_epoch_clock.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+// btree_thread_releases counts the nodes the calling thread has freed.
+// Operations compare it before and after to tell whether to move the
+// tree to a new epoch. It is per thread, so counting costs no shared
+// writes.
+extern thread_local unsigned long long btree_thread_releases;
+
+// nodes_released must be called by anything that frees a node.
+inline void nodes_released(unsigned long long count = 1) {
+  btree_thread_releases += count;
+}
+
+// tree_epoch returns the epoch of the tree rooted at 'root', or zero
+// for an empty tree.
+inline unsigned int tree_epoch(btree* root) {
+  return root == NULL ? 0 : root->epoch;
+}
+
+// update_epoch finishes an operation on the tree now rooted at 'root'
+// that started with the tree at epoch 'epoch' and btree_thread_releases
+// at 'released'. The (possibly new) root keeps the old epoch unless the
+// operation released any nodes.
+inline void update_epoch(btree* root, unsigned int epoch, unsigned long long released) {
+  if (root != NULL) {
+    root->epoch = btree_thread_releases != released ? next_epoch() : epoch;
+  }
+}
+
+// btree_cursor is the saved path. Declare one per tree (or per stream
+// of nearby operations), reset it with cursor_reset, and pass it to the
+// hinted operations below.
+struct btree_cursor {
+  // The root and tree epoch the path was taken at.
+  btree* root;
+  unsigned int epoch;
+
+  // path[0] is the root and path[depth - 1] is the node the last
+  // operation ended at. slots[d] is the index of the child of path[d]
+  // that path[d + 1] is. depth is zero for an empty cursor.
+  int depth;
+  btree* path[BTREE_CURSOR_MAX_DEPTH];
+  int slots[BTREE_CURSOR_MAX_DEPTH];
+};
+
+// cursor_reset empties 'cursor', so its next use starts at the root.
+void cursor_reset(btree_cursor* cursor);
+
+// find_hinted returns the same node as find, starting from 'cursor'.
+btree* find_hinted(btree*& root, btree_key key, btree_cursor* cursor);
+
+// insert_hinted behaves like insert, starting from 'cursor'.
+void insert_hinted(btree*& root, btree_key key, btree_cursor* cursor);
+
+// remove_hinted behaves like remove. When the key sits in a leaf that
+// can spare it, the removal happens right there; otherwise it falls
+// back to remove, which rebalances from the root.
+void remove_hinted(btree*& root, btree_key key, btree_cursor* cursor);
+
+// append inserts a key the way insert does, but is built for keys
+// that arrive in increasing order, such as timestamps or sequence
+// numbers. It keeps the cursor on the right edge of the tree, so a key
+// larger than every key already in it goes straight into the rightmost
+// leaf with no descent. When a node on the right edge overflows, its
+// left sibling is topped up first and only a full sibling forces a
+// split, so the nodes left behind are full rather than half full. Any
+// other key is inserted with insert_hinted.
+void append(btree*& root, btree_key key, btree_cursor* cursor);
+
+#endif
@@ -0,0 +1,116 @@
+//
+// btree_filter.cpp
+//
+
+#include "btree_filter.h"
+
+using namespace std;
+
+// From btree.cpp.
+void collect_keys(btree* node, vector<btree_key>& keys);
+
+// Odd constants that pick a different bit of each word from the same 32-bit hash.
+static const unsigned int FILTER_SALTS[8] = {
+  0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+  0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+// filter_hash mixes the bits of a key (the splitmix64 finalizer), so nearby keys land in
+// unrelated blocks.
+unsigned long long filter_hash(btree_key key) {
+  unsigned long long hash = (unsigned long long) key;
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9ULL;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111ebULL;
+  hash ^= hash >> 31;
+  return hash;
+}
+
+// filter_block_for picks a block from the high half of the hash, scaled to the number of
+// blocks without a division.
+size_t filter_block_for(const btree_filter& filter, unsigned long long hash) {
+  return (size_t) (((hash >> 32) * filter.blocks.size()) >> 32);
+}
+
+// filter_bit returns the bit the low half of the hash picks in word 'i' of a block.
+unsigned long long filter_bit(unsigned long long hash, int i) {
+  return 1ULL << (((unsigned int) hash * FILTER_SALTS[i]) >> 26);
+}
+
+void filter_build(btree* root, btree_filter* filter) {
+  vector<btree_key> keys;
+  if (root != NULL) {
+    collect_keys(root, keys);
+  }
+
+  // Leave room for the tree to double before the filter counts as stale, and always have
+  // at least one block.
+  filter->capacity = keys.size() < 64 ? 64 : keys.size() * 2;
+  size_t bits = filter->capacity * FILTER_BITS_PER_KEY;
+  filter_block empty = {{0}};
+  filter->blocks.assign((bits + 511) / 512, empty);
+  filter->added = 0;
+  filter->removed = 0;
+
+  for (size_t i = 0; i < keys.size(); i++) {
+    filter_add(filter, keys[i]);
+  }
+}
+
+void filter_add(btree_filter* filter, btree_key key) {
+  unsigned long long hash = filter_hash(key);
+  filter_block& block = filter->blocks[filter_block_for(*filter, hash)];
+  for (int i = 0; i < 8; i++) {
+    block.words[i] |= filter_bit(hash, i);
+  }
+  filter->added++;
+}
+
+bool filter_may_contain(const btree_filter& filter, btree_key key) {
+  unsigned long long hash = filter_hash(key);
+  const filter_block& block = filter.blocks[filter_block_for(filter, hash)];
+  unsigned long long missing = 0;
+  for (int i = 0; i < 8; i++) {
+    missing |= filter_bit(hash, i) & ~block.words[i];
+  }
+  return missing == 0;
+}
+
+bool filter_is_stale(const btree_filter& filter) {
+  // Keys removed still count towards how full the filter is, so a quarter of the keys
+  // being stale is about as bad as being a quarter over capacity.
+  return filter.added > filter.capacity || filter.removed > filter.added / 4 + 64;
+}
+
+// The counts only go up for keys that really go in or come out, or re-adding present keys
+// and removing missing ones would trigger rebuilds the filter doesn't need. A key the
+// filter rules out is certainly new, so only a maybe costs a lookup.
+void filtered_insert(btree*& root, btree_filter* filter, btree_key key) {
+  if (filtered_contains(root, *filter, key)) {
+    return;
+  }
+  insert(root, key);
+  filter_add(filter, key);
+  if (filter_is_stale(*filter)) {
+    filter_build(root, filter);
+  }
+}
+
+void filtered_remove(btree*& root, btree_filter* filter, btree_key key) {
+  if (!filtered_contains(root, *filter, key)) {
+    return;
+  }
+  remove(root, key);
+  filter->removed++;
+  if (filter_is_stale(*filter)) {
+    filter_build(root, filter);
+  }
+}
+
+bool filtered_contains(btree*& root, const btree_filter& filter, btree_key key) {
+  if (!filter_may_contain(filter, key)) {
+    return false;
+  }
+  return root != NULL && lookup(root, key).found;
+}
@@ -0,0 +1,72 @@
+//
+// btree_filter.h
+//
+// A blocked Bloom filter kept beside a tree, so looking up a key that
+// isn't there usually costs one cache line instead of a descent.
+//
+// The filter is an array of 64-byte blocks. A key hashes to one block
+// and sets one bit in each of its eight words, so checking a key reads
+// a single cache line. It can say a key is missing for certain, or
+// that it may be present, in which case the tree is searched as usual.
+//
+// Bloom filters can't forget a key, so removals leave stale bits that
+// only cost false positives. The filter counts them, along with keys
+// added beyond what it was sized for, and the filtered_ functions
+// rebuild it from the tree once either gets out of hand, which keeps
+// the false positive rate bounded at an amortized O(1) cost per
+// update.
+
+#ifndef btree_filter_h
+#define btree_filter_h
+
+#include <vector>
+#include "btree.h"
+
+// The filter's size, in bits per key it is sized for. Ten bits per key
+// gives about a 1% false positive rate.
+#define FILTER_BITS_PER_KEY 10
+
+// filter_block is one cache line of the filter.
+struct filter_block {
+  unsigned long long words[8];
+};
+
+struct btree_filter {
+  vector<filter_block> blocks;
+
+  // capacity is the number of keys the filter was sized for. added
+  // counts keys added since then and removed counts keys removed, each
+  // of which leaves stale bits behind.
+  long long capacity;
+  long long added;
+  long long removed;
+};
+
+// filter_build sizes 'filter' for the keys of the tree rooted at
+// 'root', with room for as many again to be added, and adds them all.
+void filter_build(btree* root, btree_filter* filter);
+
+// filter_add records that 'key' is in the tree.
+void filter_add(btree_filter* filter, btree_key key);
+
+// filter_may_contain returns false if 'key' is certainly not in the
+// tree, and true if it may be.
+bool filter_may_contain(const btree_filter& filter, btree_key key);
+
+// filter_is_stale returns true once the filter has taken in more keys
+// than it was sized for, or seen enough removals that stale bits are
+// inflating its false positive rate.
+bool filter_is_stale(const btree_filter& filter);
+
+// filtered_insert and filtered_remove behave like insert and remove,
+// and keep 'filter' up to date, rebuilding it when it goes stale.
+// Inserting a key that is already there, or removing one that isn't,
+// changes nothing, not even the filter's counts.
+void filtered_insert(btree*& root, btree_filter* filter, btree_key key);
+void filtered_remove(btree*& root, btree_filter* filter, btree_key key);
+
+// filtered_contains returns true if 'key' is in the tree, without
+// touching the tree when the filter rules the key out.
+bool filtered_contains(btree*& root, const btree_filter& filter, btree_key key);
+
+#endif
@@ -0,0 +1,127 @@
+//
+// btree_frozen.cpp
+//
+
+#include <algorithm>
+#include <limits>
+#include "btree_frozen.h"
+
+#if defined(__SSE2__) && !defined(BTREE_KEY64)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+// From btree.cpp.
+void collect_keys(btree* node, vector<btree_key>& keys);
+
+// block_rank returns the number of keys in a block smaller than 'key'. Keys are sorted
+// within a block, so that is also the index of the child to descend to.
+int block_rank(const btree_key* block, btree_key key) {
+#if defined(__SSE2__) && !defined(BTREE_KEY64)
+  // Compare all sixteen keys, narrow the four masks to one byte per key, and count.
+  __m128i target = _mm_set1_epi32(key);
+  __m128i less0 = _mm_cmpgt_epi32(target, _mm_load_si128((const __m128i*) block));
+  __m128i less1 = _mm_cmpgt_epi32(target, _mm_load_si128((const __m128i*) (block + 4)));
+  __m128i less2 = _mm_cmpgt_epi32(target, _mm_load_si128((const __m128i*) (block + 8)));
+  __m128i less3 = _mm_cmpgt_epi32(target, _mm_load_si128((const __m128i*) (block + 12)));
+  __m128i less = _mm_packs_epi16(_mm_packs_epi32(less0, less1), _mm_packs_epi32(less2, less3));
+  return __builtin_popcount(_mm_movemask_epi8(less));
+#else
+  int count = 0;
+  for (int i = 0; i < FROZEN_BLOCK_KEYS; i++) {
+    count += block[i] < key;
+  }
+  return count;
+#endif
+}
+
+void freeze(btree* root, btree_frozen* frozen) {
+  const int fanout = FROZEN_BLOCK_KEYS + 1;
+  vector<btree_key> sorted;
+  if (root != NULL) {
+    collect_keys(root, sorted);
+  }
+  long long n = sorted.size();
+
+  // Work out how many blocks each level needs, from the leaves up, then lay the inner
+  // levels out from the root down. Even an empty snapshot has one (padding) leaf block.
+  long long leaf_blocks = n == 0 ? 1 : (n + FROZEN_BLOCK_KEYS - 1) / FROZEN_BLOCK_KEYS;
+  vector<long long> level_blocks;
+  for (long long blocks = leaf_blocks; blocks > 1; ) {
+    blocks = (blocks + fanout - 1) / fanout;
+    level_blocks.push_back(blocks);
+  }
+  reverse(level_blocks.begin(), level_blocks.end());
+  frozen->num_levels = level_blocks.size();
+  long long index_blocks = 0;
+  for (int l = 0; l < frozen->num_levels; l++) {
+    frozen->level_start[l] = index_blocks;
+    index_blocks += level_blocks[l];
+  }
+
+  // new only promises alignment for the fundamental types, so take a line's worth extra
+  // and start at the first line boundary in it.
+  frozen->bytes = (index_blocks + leaf_blocks) * 64;
+  frozen->memory = new char[frozen->bytes + 64];
+  size_t misalignment = (size_t) frozen->memory % 64;
+  frozen->index = (btree_key*) (frozen->memory + (misalignment == 0 ? 0 : 64 - misalignment));
+  frozen->keys = frozen->index + index_blocks * FROZEN_BLOCK_KEYS;
+  frozen->num_keys = n;
+
+  const btree_key padding = numeric_limits<btree_key>::max();
+  copy(sorted.begin(), sorted.end(), frozen->keys);
+  fill(frozen->keys + n, frozen->keys + leaf_blocks * FROZEN_BLOCK_KEYS, padding);
+
+  // Key i of an inner block separates child i from child i + 1, and is the smallest key
+  // under child i + 1: the first key of the first leaf block below it. Children past the
+  // end of the keys get the padding, which no search descends past.
+  long long span = FROZEN_BLOCK_KEYS;
+  for (int l = frozen->num_levels - 1; l >= 0; l--) {
+    btree_key* level = frozen->index + frozen->level_start[l] * FROZEN_BLOCK_KEYS;
+    for (long long block = 0; block < level_blocks[l]; block++) {
+      for (int i = 0; i < FROZEN_BLOCK_KEYS; i++) {
+        long long first = (block * fanout + i + 1) * span;
+        level[block * FROZEN_BLOCK_KEYS + i] = first < n ? sorted[first] : padding;
+      }
+    }
+    span *= fanout;
+  }
+}
+
+void frozen_free(btree_frozen* frozen) {
+  delete[] frozen->memory;
+  frozen->memory = NULL;
+  frozen->index = NULL;
+  frozen->keys = NULL;
+  frozen->num_keys = 0;
+  frozen->num_levels = 0;
+  frozen->bytes = 0;
+}
+
+long long frozen_lower_bound(const btree_frozen& frozen, btree_key key) {
+  long long block = 0;
+  for (int l = 0; l < frozen.num_levels; l++) {
+    const btree_key* node = frozen.index + (frozen.level_start[l] + block) * FROZEN_BLOCK_KEYS;
+    block = block * (FROZEN_BLOCK_KEYS + 1) + block_rank(node, key);
+  }
+
+  // If every key in the leaf block is smaller, the answer is the first key of the next
+  // block, which is where the count lands anyway.
+  return block * FROZEN_BLOCK_KEYS + block_rank(frozen.keys + block * FROZEN_BLOCK_KEYS, key);
+}
+
+bool frozen_contains(const btree_frozen& frozen, btree_key key) {
+  long long position = frozen_lower_bound(frozen, key);
+  return position < frozen.num_keys && frozen.keys[position] == key;
+}
+
+void frozen_scan(const btree_frozen& frozen, btree_key lo, btree_key hi, vector<btree_key>& keys) {
+  for (long long i = frozen_lower_bound(frozen, lo); i < frozen.num_keys && frozen.keys[i] <= hi; i++) {
+    keys.push_back(frozen.keys[i]);
+  }
+}
+
+size_t frozen_bytes(const btree_frozen& frozen) {
+  return frozen.bytes;
+}
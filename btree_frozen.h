@@ -0,0 +1,77 @@
+//
+// btree_frozen.h
+//
+// An immutable, pointer-free snapshot of a tree for indexes that are
+// built once and then only read.
+//
+// freeze copies the keys into one sorted array, cut into blocks of one
+// cache line each (FROZEN_BLOCK_KEYS keys), and builds a static search
+// tree over the blocks in the blocked implicit layout of FAST and
+// S-trees: every inner node is also one cache line of keys, node k of a
+// level has children k * (FROZEN_BLOCK_KEYS + 1) + i on the level
+// below, and the levels are stored one after another from the root
+// down. There are no child pointers, so a node's whole cache line goes
+// to keys, the fanout is 17 with int keys (9 with 64-bit keys) rather
+// than 5, and the tree costs a small fraction of the keys' own space.
+//
+// A search reads one line per level and compares the key against the
+// whole line at once (with SSE2 for int keys) instead of branching per
+// key. It ends at a position in the sorted array, so a range scan is a
+// search followed by a sequential read.
+//
+// The snapshot doesn't follow later changes to the tree; freeze it
+// again after updating.
+
+#ifndef btree_frozen_h
+#define btree_frozen_h
+
+#include <vector>
+#include "btree.h"
+
+// The number of keys in one cache-line-sized block.
+#define FROZEN_BLOCK_KEYS ((int) (64 / sizeof(btree_key)))
+
+// Deeper than a snapshot of any tree that fits in memory can get.
+#define FROZEN_MAX_LEVELS 32
+
+struct btree_frozen {
+  // keys holds the tree's keys in ascending order, padded to a whole
+  // number of blocks with the largest key.
+  btree_key* keys;
+  long long num_keys;
+
+  // index holds the inner levels, the root's first. Level l starts at
+  // block level_start[l].
+  btree_key* index;
+  long long level_start[FROZEN_MAX_LEVELS];
+  int num_levels;
+
+  // The memory 'index' and 'keys' were carved from, which may start
+  // before them.
+  char* memory;
+  size_t bytes;
+};
+
+// freeze fills in 'frozen' with a snapshot of the tree rooted at
+// 'root'. Free an earlier snapshot with frozen_free before reusing it.
+void freeze(btree* root, btree_frozen* frozen);
+
+// frozen_free releases the snapshot's memory.
+void frozen_free(btree_frozen* frozen);
+
+// frozen_lower_bound returns the position in frozen.keys of the first
+// key not less than 'key', or frozen.num_keys if there is none.
+long long frozen_lower_bound(const btree_frozen& frozen, btree_key key);
+
+// frozen_contains returns true if 'key' is in the snapshot.
+bool frozen_contains(const btree_frozen& frozen, btree_key key);
+
+// frozen_scan appends the keys k with lo <= k <= hi to 'keys', in
+// ascending order.
+void frozen_scan(const btree_frozen& frozen, btree_key lo, btree_key hi, vector<btree_key>& keys);
+
+// frozen_bytes returns the memory the snapshot uses, not counting
+// allocator overhead.
+size_t frozen_bytes(const btree_frozen& frozen);
+
+#endif
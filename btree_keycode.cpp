@@ -0,0 +1,122 @@
+//
+// btree_keycode.cpp
+//
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include "btree_keycode.h"
+
+using namespace std;
+
+#define SIGN_BIT_64 0x8000000000000000ULL
+
+void append_big_endian(string& key, unsigned long long bits, int bytes) {
+  for (int i = bytes - 1; i >= 0; i--) {
+    key.push_back((char) (bits >> (8 * i)));
+  }
+}
+
+bool read_big_endian(key_reader* reader, unsigned long long& bits, int bytes) {
+  if (reader->key->size() - reader->position < (size_t) bytes) {
+    return false;
+  }
+  bits = 0;
+  for (int i = 0; i < bytes; i++) {
+    bits = (bits << 8) | (unsigned char) (*reader->key)[reader->position + i];
+  }
+  reader->position += bytes;
+  return true;
+}
+
+void key_append_int32(string& key, int value) {
+  append_big_endian(key, (unsigned int) value ^ 0x80000000U, 4);
+}
+
+void key_append_int64(string& key, long long value) {
+  append_big_endian(key, (unsigned long long) value ^ SIGN_BIT_64, 8);
+}
+
+void key_append_uint64(string& key, unsigned long long value) {
+  append_big_endian(key, value, 8);
+}
+
+void key_append_double(string& key, double value) {
+  if (value == 0) {
+    value = 0.0;
+  } else if (std::isnan(value)) {
+    value = numeric_limits<double>::quiet_NaN();
+  }
+  unsigned long long bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  // Positive doubles already order like their bits; setting the sign bit puts them above
+  // the negatives. Negative doubles order backwards, so flipping every bit both reverses
+  // them and clears the sign bit. The canonical NaN is positive, with bits above
+  // infinity's.
+  bits = (bits & SIGN_BIT_64) ? ~bits : bits | SIGN_BIT_64;
+  append_big_endian(key, bits, 8);
+}
+
+void key_append_string(string& key, const string& value) {
+  for (size_t i = 0; i < value.size(); i++) {
+    key.push_back(value[i]);
+    if (value[i] == '\0') {
+      key.push_back((char) 0xff);
+    }
+  }
+  key.push_back('\0');
+  key.push_back('\0');
+}
+
+bool key_read_int32(key_reader* reader, int& value) {
+  unsigned long long bits;
+  if (!read_big_endian(reader, bits, 4)) {
+    return false;
+  }
+  value = (int) ((unsigned int) bits ^ 0x80000000U);
+  return true;
+}
+
+bool key_read_int64(key_reader* reader, long long& value) {
+  unsigned long long bits;
+  if (!read_big_endian(reader, bits, 8)) {
+    return false;
+  }
+  value = (long long) (bits ^ SIGN_BIT_64);
+  return true;
+}
+
+bool key_read_uint64(key_reader* reader, unsigned long long& value) {
+  return read_big_endian(reader, value, 8);
+}
+
+bool key_read_double(key_reader* reader, double& value) {
+  unsigned long long bits;
+  if (!read_big_endian(reader, bits, 8)) {
+    return false;
+  }
+  bits = (bits & SIGN_BIT_64) ? bits & ~SIGN_BIT_64 : ~bits;
+  memcpy(&value, &bits, sizeof(value));
+  return true;
+}
+
+bool key_read_string(key_reader* reader, string& value) {
+  const string& key = *reader->key;
+  string decoded;
+  for (size_t i = reader->position; i + 1 < key.size(); i++) {
+    if (key[i] != '\0') {
+      decoded.push_back(key[i]);
+    } else if (key[i + 1] == '\0') {
+      reader->position = i + 2;
+      value.swap(decoded);
+      return true;
+    } else if (key[i + 1] == (char) 0xff) {
+      decoded.push_back('\0');
+      i++;
+    } else {
+      return false;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,56 @@
+//
+// btree_keycode.h
+//
+// Normalized keys: encodings of composite and typed keys as byte strings
+// whose memcmp order is the keys' logical order.
+//
+// A key such as (tenant, timestamp, id) is encoded one field at a time,
+// most significant first, by appending each field to the same string.
+// The result can be stored in the string tree (btree_string.h), which
+// then orders and searches it with plain byte comparisons and never
+// needs to know the fields' types.
+//
+// -- Integers are stored big-endian with the sign bit flipped, so
+//    negative numbers sort below positive ones.
+// -- Doubles are stored as their IEEE bits, with the sign bit flipped
+//    for positive numbers and every bit flipped for negative ones. -0.0
+//    is stored as 0.0, and every NaN as one NaN that sorts above
+//    infinity.
+// -- Strings have each 0x00 byte escaped as 0x00 0xff and end with
+//    0x00 0x00, so a string sorts below any longer string it is a
+//    prefix of, whatever fields follow either one.
+//
+// Each field is read back with the key_read functions, in the order the
+// fields were appended.
+
+#ifndef btree_keycode_h
+#define btree_keycode_h
+
+#include <string>
+
+using namespace std;
+
+// The key_append functions add one field to the end of 'key'.
+void key_append_int32(string& key, int value);
+void key_append_int64(string& key, long long value);
+void key_append_uint64(string& key, unsigned long long value);
+void key_append_double(string& key, double value);
+void key_append_string(string& key, const string& value);
+
+// key_reader walks the fields of an encoded key. Point 'key' at the
+// encoding and set 'position' to zero.
+struct key_reader {
+  const string* key;
+  size_t position;
+};
+
+// The key_read functions decode the next field into 'value' and move
+// past it. They return false, leaving 'value' alone, if the bytes left
+// can't be a field of that type.
+bool key_read_int32(key_reader* reader, int& value);
+bool key_read_int64(key_reader* reader, long long& value);
+bool key_read_uint64(key_reader* reader, unsigned long long& value);
+bool key_read_double(key_reader* reader, double& value);
+bool key_read_string(key_reader* reader, string& value);
+
+#endif
@@ -0,0 +1,209 @@
+//
+// btree_lookaside.cpp
+//
+
+#include <algorithm>
+#include "btree_cursor.h"
+#include "btree_lookaside.h"
+#include "btree_stats.h"
+#include "btree_trace.h"
+
+using namespace std;
+
+void release_node(btree* node);
+
+thread_local btree_lookaside* btree_thread_lookaside = NULL;
+
+// lookaside_hash mixes the bits of a key with a multiply, keeping the high bits, so
+// consecutive keys spread across buckets.
+size_t lookaside_hash(const btree_lookaside& cache, btree_key key) {
+  unsigned long long hash = (unsigned long long) key * 0x9e3779b97f4a7c15ULL;
+  return (size_t) (hash >> 32) & (cache.num_buckets - 1);
+}
+
+void lookaside_init(btree_lookaside* cache, size_t entries) {
+  size_t wanted = (entries + LOOKASIDE_WAYS - 1) / LOOKASIDE_WAYS;
+  size_t num_buckets = 1;
+  while (num_buckets < wanted) {
+    num_buckets *= 2;
+  }
+
+  // new only promises alignment for the fundamental types, so take a line's worth extra
+  // and start the buckets at the first line boundary in it.
+  cache->num_buckets = num_buckets;
+  cache->memory = new char[num_buckets * sizeof(lookaside_bucket) + 64];
+  size_t misalignment = (size_t) cache->memory % 64;
+  cache->buckets = (lookaside_bucket*) (cache->memory + (misalignment == 0 ? 0 : 64 - misalignment));
+  cache->generation = 0;
+  cache->tree_epoch = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+  lookaside_clear(cache);
+}
+
+// release_freed returns the nodes the table was holding to the heap. Only call it once no
+// entry of the current generation can point at them.
+void release_freed(btree_lookaside* cache) {
+  for (size_t i = 0; i < cache->freed.size(); i++) {
+    release_node(cache->freed[i]);
+  }
+  cache->freed.clear();
+}
+
+void lookaside_free(btree_lookaside* cache) {
+  release_freed(cache);
+  delete[] cache->memory;
+  cache->memory = NULL;
+  cache->buckets = NULL;
+  cache->num_buckets = 0;
+}
+
+void lookaside_clear(btree_lookaside* cache) {
+  for (size_t i = 0; i < cache->num_buckets; i++) {
+    for (size_t way = 0; way < LOOKASIDE_WAYS; way++) {
+      cache->buckets[i].nodes[way] = NULL;
+    }
+  }
+  release_freed(cache);
+}
+
+// lookaside_restart starts a new generation for the tree at 'epoch', which leaves every
+// entry from the last one for dead.
+void lookaside_restart(btree_lookaside* cache, unsigned int epoch) {
+  cache->generation++;
+  cache->tree_epoch = epoch;
+  release_freed(cache);
+}
+
+// lookaside_drop empties a way, moving the ways after it forward so the empty ones stay
+// at the back.
+void lookaside_drop(lookaside_bucket& bucket, size_t dropped) {
+  for (size_t way = dropped + 1; way < LOOKASIDE_WAYS; way++) {
+    bucket.nodes[way - 1] = bucket.nodes[way];
+    bucket.keys[way - 1] = bucket.keys[way];
+    bucket.generations[way - 1] = bucket.generations[way];
+    bucket.slots[way - 1] = bucket.slots[way];
+  }
+  bucket.nodes[LOOKASIDE_WAYS - 1] = NULL;
+}
+
+// lookaside_sweep drops every current entry that points at a node the table is holding,
+// then releases the nodes.
+void lookaside_sweep(btree_lookaside* cache) {
+  sort(cache->freed.begin(), cache->freed.end());
+  for (size_t i = 0; i < cache->num_buckets; i++) {
+    lookaside_bucket& bucket = cache->buckets[i];
+    size_t way = 0;
+    while (way < LOOKASIDE_WAYS && bucket.nodes[way] != NULL) {
+      if (bucket.generations[way] == cache->generation &&
+          binary_search(cache->freed.begin(), cache->freed.end(), bucket.nodes[way])) {
+        lookaside_drop(bucket, way);
+      } else {
+        way++;
+      }
+    }
+  }
+  release_freed(cache);
+}
+
+void lookaside_forget(btree_lookaside* cache, btree* node) {
+  for (int i = 0; i < node->num_keys; i++) {
+    lookaside_bucket& bucket = cache->buckets[lookaside_hash(*cache, node->keys[i])];
+    for (size_t way = 0; way < LOOKASIDE_WAYS && bucket.nodes[way] != NULL; way++) {
+      if (bucket.nodes[way] == node) {
+        lookaside_drop(bucket, way);
+        break;
+      }
+    }
+  }
+
+  // Entries for keys that left the node before it was freed are still about, so keep the
+  // node, with no keys for a hit to match, until a sweep has found them.
+  node->num_keys = 0;
+  cache->freed.push_back(node);
+  if (cache->freed.size() > cache->num_buckets / 4) {
+    lookaside_sweep(cache);
+  }
+}
+
+// lookaside_record puts an entry at the front of its bucket, moving the ways before
+// 'replaced' back by one over it.
+void lookaside_record(lookaside_bucket& bucket, size_t replaced, btree_key key, btree* node, int slot,
+                      unsigned int generation) {
+  for (size_t way = replaced; way > 0; way--) {
+    bucket.nodes[way] = bucket.nodes[way - 1];
+    bucket.keys[way] = bucket.keys[way - 1];
+    bucket.generations[way] = bucket.generations[way - 1];
+    bucket.slots[way] = bucket.slots[way - 1];
+  }
+  bucket.nodes[0] = node;
+  bucket.keys[0] = key;
+  bucket.generations[0] = generation;
+  bucket.slots[0] = (unsigned char) slot;
+}
+
+btree_position cached_lookup(btree*& root, btree_lookaside* cache, btree_key key) {
+  if (root == NULL) {
+    cache->misses++;
+    return lookup(root, key);
+  }
+  if (root->epoch != cache->tree_epoch) {
+    lookaside_restart(cache, root->epoch);
+  }
+
+  // A miss replaces the key's own entry if the key moved, or else the first entry from an
+  // older generation, or else an empty way, or else the least recently used one.
+  lookaside_bucket& bucket = cache->buckets[lookaside_hash(*cache, key)];
+  size_t replaced = LOOKASIDE_WAYS;
+  size_t way = 0;
+  for (; way < LOOKASIDE_WAYS && bucket.nodes[way] != NULL; way++) {
+    if (bucket.generations[way] != cache->generation) {
+      if (replaced == LOOKASIDE_WAYS) {
+        replaced = way;
+      }
+      continue;
+    }
+    if (bucket.keys[way] != key) {
+      continue;
+    }
+
+    // The node is live, or emptied and held by the table, but the key may have moved out of
+    // the slot or out of the node.
+    btree* node = bucket.nodes[way];
+    int slot = bucket.slots[way];
+    if (slot < node->num_keys && node->keys[slot] == key) {
+      count_event(BTREE_FINDS);
+      BTREE_TRACE(BTREE_TRACE_OPS, TRACE_FIND, root, key);
+      cache->hits++;
+      lookaside_record(bucket, way, key, node, slot, cache->generation);
+      btree_position position = {node, slot, true};
+      return position;
+    }
+    replaced = way;
+    break;
+  }
+  if (replaced == LOOKASIDE_WAYS) {
+    replaced = way < LOOKASIDE_WAYS ? way : LOOKASIDE_WAYS - 1;
+  }
+
+  cache->misses++;
+  btree_position position = lookup(root, key);
+  if (position.found) {
+    lookaside_record(bucket, replaced, key, position.node, position.slot, cache->generation);
+  }
+  return position;
+}
+
+void cached_remove(btree*& root, btree_lookaside* cache, btree_key key) {
+  // If the table is behind the tree its entries are dead anyway, and there is nothing to
+  // keep.
+  if (root == NULL || root->epoch != cache->tree_epoch) {
+    remove(root, key);
+    return;
+  }
+
+  btree_thread_lookaside = cache;
+  remove(root, key);
+  btree_thread_lookaside = NULL;
+  cache->tree_epoch = tree_epoch(root);
+}
@@ -0,0 +1,109 @@
+//
+// btree_lookaside.h
+//
+// A small table of recently found keys kept in front of a tree, so
+// finding a hot key skips the descent.
+//
+// Each entry remembers a key and the node and slot lookup found it at.
+// The table is hashed by key into 64-byte buckets that each fit in one
+// cache line, so a hit costs a hash, one cache line of the table and
+// one of the node the entry points at. Within a bucket the entries are
+// kept most recently used first, and a miss that finds its key evicts
+// the last one.
+//
+// An entry can go stale in two ways, and each is caught:
+//
+// -- The key moves within the tree (an insert shifts it along, a split
+//    or rotation carries it to a sibling, a remove takes it out). The
+//    node is still a live node of the same tree, so a hit checks that
+//    the slot still holds the key, and falls back to a lookup if not.
+// -- The node is freed, as a merge or destroy does, or handed to
+//    another tree, as split and join do. The table remembers the tree's
+//    epoch (see btree.h), which moves on whenever the tree lets go of a
+//    node. When a lookup finds the tree at another epoch, the table
+//    starts a new generation, and the entries from older generations
+//    count as empty without being looked at.
+//
+// cached_remove attaches the table to the tree for the length of a
+// remove, so the nodes its merges and root collapse free are handed to
+// the table instead of the heap. The table drops the entries in the
+// buckets of each freed node's keys and keeps the node, emptied, until
+// no entry can point at it, and then follows the tree to its new epoch
+// with every other entry intact. An entry whose key had already left
+// the node still points at it, but a hit on an emptied node only
+// misses. Once the table holds one freed node per four buckets it
+// sweeps out their remaining entries and releases them all.
+//
+// A table belongs to one tree. Using it with a different tree returns
+// nonsense. Like the trees themselves, a table is not safe to use from
+// several threads while its tree is being changed.
+
+#ifndef btree_lookaside_h
+#define btree_lookaside_h
+
+#include <vector>
+#include "btree.h"
+
+// As many entries as fit in a cache line: three with either size of
+// key.
+#define LOOKASIDE_WAYS (64 / (sizeof(btree*) + sizeof(btree_key) + sizeof(unsigned int) + 1))
+
+// lookaside_bucket is one cache line of the table. Way 0 is the most
+// recently used; a NULL node marks an empty way, and so does one from
+// an older generation.
+struct alignas(64) lookaside_bucket {
+  btree* nodes[LOOKASIDE_WAYS];
+  btree_key keys[LOOKASIDE_WAYS];
+  unsigned int generations[LOOKASIDE_WAYS];
+  unsigned char slots[LOOKASIDE_WAYS];
+};
+
+struct btree_lookaside {
+  lookaside_bucket* buckets;
+  size_t num_buckets;
+
+  // The memory 'buckets' was carved from, which may start before it.
+  char* memory;
+
+  // generation is the one entries are made in now, while the tree is
+  // at 'tree_epoch'.
+  unsigned int generation;
+  unsigned int tree_epoch;
+
+  // freed holds the nodes cached_remove took from the tree that some
+  // entry may still point at.
+  vector<btree*> freed;
+
+  long long hits;
+  long long misses;
+};
+
+// lookaside_init gives 'cache' room for at least 'entries' keys,
+// rounded up to a power of two number of buckets, and empties it.
+void lookaside_init(btree_lookaside* cache, size_t entries);
+
+// lookaside_free releases the table's memory, and the nodes it holds.
+void lookaside_free(btree_lookaside* cache);
+
+// lookaside_clear empties the table without resizing it.
+void lookaside_clear(btree_lookaside* cache);
+
+// cached_lookup returns the same position as lookup whenever the key is
+// in the tree, answering from the table if it can and recording the
+// key's position there if not. A missing key is always looked up, and
+// its position (where it would be inserted) is returned as usual.
+btree_position cached_lookup(btree*& root, btree_lookaside* cache, btree_key key);
+
+// cached_remove behaves like remove, with the table attached to the
+// tree so it keeps its entries for the keys the remove didn't move.
+void cached_remove(btree*& root, btree_lookaside* cache, btree_key key);
+
+// btree_thread_lookaside is the table attached to the tree the calling
+// thread is removing from, or NULL. free_node hands nodes to it.
+extern thread_local btree_lookaside* btree_thread_lookaside;
+
+// lookaside_forget takes 'node', just freed from the table's tree, and
+// drops the entries for its keys that point at it.
+void lookaside_forget(btree_lookaside* cache, btree* node);
+
+#endif
@@ -0,0 +1,341 @@
+//
+// btree_multiset.cpp
+//
+
+#include <algorithm>
+#include "btree_multiset.h"
+
+using namespace std;
+
+void append_delta(vector<unsigned char>& deltas, unsigned long long delta) {
+  while (delta >= 0x80) {
+    deltas.push_back((unsigned char) (delta | 0x80));
+    delta >>= 7;
+  }
+  deltas.push_back((unsigned char) delta);
+}
+
+// posting_decode appends every row of a list to 'rows'.
+void posting_decode(const posting_list& list, vector<long long>& rows) {
+  if (list.count <= POSTING_INLINE) {
+    rows.insert(rows.end(), list.rows, list.rows + list.count);
+    return;
+  }
+
+  const posting_block* block = list.block;
+  long long row = block->first;
+  rows.push_back(row);
+  unsigned long long delta = 0;
+  int shift = 0;
+  for (size_t i = 0; i < block->deltas.size(); i++) {
+    delta |= (unsigned long long) (block->deltas[i] & 0x7f) << shift;
+    shift += 7;
+    if ((block->deltas[i] & 0x80) == 0) {
+      row = (long long) ((unsigned long long) row + delta);
+      rows.push_back(row);
+      delta = 0;
+      shift = 0;
+    }
+  }
+}
+
+// posting_encode replaces the contents of a list with 'rows', which must be sorted and
+// distinct, inline or in a block depending on how many there are.
+void posting_encode(posting_list& list, const vector<long long>& rows) {
+  if (list.count > POSTING_INLINE) {
+    delete list.block;
+  }
+  list.count = rows.size();
+  if (list.count <= POSTING_INLINE) {
+    copy(rows.begin(), rows.end(), list.rows);
+    return;
+  }
+
+  posting_block* block = new posting_block;
+  block->first = rows[0];
+  block->last = rows.back();
+  for (size_t i = 1; i < rows.size(); i++) {
+    append_delta(block->deltas, (unsigned long long) rows[i] - (unsigned long long) rows[i - 1]);
+  }
+  list.block = block;
+}
+
+bool posting_add(posting_list& list, long long row) {
+  // Rows arriving in increasing order just extend the block.
+  if (list.count > POSTING_INLINE && row > list.block->last) {
+    append_delta(list.block->deltas, (unsigned long long) row - (unsigned long long) list.block->last);
+    list.block->last = row;
+    list.count++;
+    return true;
+  }
+
+  vector<long long> rows;
+  posting_decode(list, rows);
+  vector<long long>::iterator it = lower_bound(rows.begin(), rows.end(), row);
+  if (it != rows.end() && *it == row) {
+    return false;
+  }
+  rows.insert(it, row);
+  posting_encode(list, rows);
+  return true;
+}
+
+bool posting_remove(posting_list& list, long long row) {
+  vector<long long> rows;
+  posting_decode(list, rows);
+  vector<long long>::iterator it = lower_bound(rows.begin(), rows.end(), row);
+  if (it == rows.end() || *it != row) {
+    return false;
+  }
+  rows.erase(it);
+  posting_encode(list, rows);
+  return true;
+}
+
+void posting_free(posting_list& list) {
+  if (list.count > POSTING_INLINE) {
+    delete list.block;
+  }
+  list.count = 0;
+}
+
+multiset_node* multiset_alloc(bool is_leaf) {
+  multiset_node* node = new multiset_node;
+  node->is_leaf = is_leaf;
+  node->num_keys = 0;
+  return node;
+}
+
+// child_slot returns the child of an inner node that 'key' is under.
+int child_slot(multiset_node* node, btree_key key) {
+  return upper_bound(node->keys, node->keys + node->num_keys, key) - node->keys;
+}
+
+// multiset_split_child splits the full child at 'child_index' of 'parent', which must
+// have room for one more key. A leaf keeps its first half and the right half starts
+// with a copy of the separator; an inner node moves its middle key up.
+void multiset_split_child(multiset_node* parent, int child_index) {
+  multiset_node* child = parent->children[child_index];
+  multiset_node* sibling = multiset_alloc(child->is_leaf);
+  int left_count = MULTISET_MAX_KEYS / 2;
+  btree_key separator = child->keys[left_count];
+
+  if (child->is_leaf) {
+    sibling->num_keys = child->num_keys - left_count;
+    copy(child->keys + left_count, child->keys + child->num_keys, sibling->keys);
+    copy(child->lists + left_count, child->lists + child->num_keys, sibling->lists);
+  } else {
+    sibling->num_keys = child->num_keys - left_count - 1;
+    copy(child->keys + left_count + 1, child->keys + child->num_keys, sibling->keys);
+    copy(child->children + left_count + 1, child->children + child->num_keys + 1, sibling->children);
+  }
+  child->num_keys = left_count;
+
+  for (int i = parent->num_keys; i > child_index; i--) {
+    parent->keys[i] = parent->keys[i - 1];
+    parent->children[i + 1] = parent->children[i];
+  }
+  parent->keys[child_index] = separator;
+  parent->children[child_index + 1] = sibling;
+  parent->num_keys++;
+}
+
+// find_multiset_leaf returns the leaf that holds, or would hold, 'key'.
+multiset_node* find_multiset_leaf(multiset_node* node, btree_key key) {
+  while (!node->is_leaf) {
+    node = node->children[child_slot(node, key)];
+  }
+  return node;
+}
+
+bool multiset_insert(multiset_node*& root, btree_key key, long long row) {
+  if (root == NULL) {
+    root = multiset_alloc(true);
+  }
+
+  // Split full nodes on the way down, so there is always room for whatever a split
+  // below pushes up.
+  if (root->num_keys == MULTISET_MAX_KEYS) {
+    multiset_node* old_root = root;
+    root = multiset_alloc(false);
+    root->children[0] = old_root;
+    multiset_split_child(root, 0);
+  }
+  multiset_node* node = root;
+  while (!node->is_leaf) {
+    int i = child_slot(node, key);
+    multiset_node* child = node->children[i];
+    if (child->num_keys == MULTISET_MAX_KEYS) {
+      // A leaf holding the key is only full if the key has to be added, and only then
+      // does it need splitting.
+      bool has_key = child->is_leaf && binary_search(child->keys, child->keys + child->num_keys, key);
+      if (!has_key) {
+        multiset_split_child(node, i);
+        i = child_slot(node, key);
+      }
+    }
+    node = node->children[i];
+  }
+
+  int slot = lower_bound(node->keys, node->keys + node->num_keys, key) - node->keys;
+  if (slot < node->num_keys && node->keys[slot] == key) {
+    return posting_add(node->lists[slot], row);
+  }
+
+  for (int i = node->num_keys; i > slot; i--) {
+    node->keys[i] = node->keys[i - 1];
+    node->lists[i] = node->lists[i - 1];
+  }
+  node->keys[slot] = key;
+  node->lists[slot].count = 1;
+  node->lists[slot].rows[0] = row;
+  node->num_keys++;
+  return true;
+}
+
+// multiset_prune goes down to the leaf that 'key' belongs in and frees it if it is empty.
+// On the way back up, a freed child is unlinked along with the separator next to it, and
+// an inner node left with a single child is freed and replaced by that child. 'node' is
+// the parent's pointer to the subtree, or the root.
+void multiset_prune(multiset_node*& node, btree_key key) {
+  if (node->is_leaf) {
+    if (node->num_keys == 0) {
+      delete node;
+      node = NULL;
+    }
+    return;
+  }
+
+  int slot = child_slot(node, key);
+  multiset_prune(node->children[slot], key);
+  if (node->children[slot] != NULL) {
+    return;
+  }
+  for (int i = max(slot - 1, 0); i + 1 < node->num_keys; i++) {
+    node->keys[i] = node->keys[i + 1];
+  }
+  for (int i = slot; i < node->num_keys; i++) {
+    node->children[i] = node->children[i + 1];
+  }
+  node->num_keys--;
+  if (node->num_keys == 0) {
+    multiset_node* only_child = node->children[0];
+    delete node;
+    node = only_child;
+  }
+}
+
+bool multiset_remove(multiset_node*& root, btree_key key, long long row) {
+  if (root == NULL) {
+    return false;
+  }
+  multiset_node* leaf = find_multiset_leaf(root, key);
+  int slot = lower_bound(leaf->keys, leaf->keys + leaf->num_keys, key) - leaf->keys;
+  if (slot == leaf->num_keys || leaf->keys[slot] != key) {
+    return false;
+  }
+  if (!posting_remove(leaf->lists[slot], row)) {
+    return false;
+  }
+
+  // The key's last row is gone, so the key goes too, and the leaf if that empties it.
+  if (leaf->lists[slot].count == 0) {
+    for (int i = slot + 1; i < leaf->num_keys; i++) {
+      leaf->keys[i - 1] = leaf->keys[i];
+      leaf->lists[i - 1] = leaf->lists[i];
+    }
+    leaf->num_keys--;
+    if (leaf->num_keys == 0) {
+      multiset_prune(root, key);
+    }
+  }
+  return true;
+}
+
+// find_list returns the posting list for 'key', or NULL if the key isn't there.
+posting_list* find_list(multiset_node* root, btree_key key) {
+  if (root == NULL) {
+    return NULL;
+  }
+  multiset_node* leaf = find_multiset_leaf(root, key);
+  int slot = lower_bound(leaf->keys, leaf->keys + leaf->num_keys, key) - leaf->keys;
+  if (slot == leaf->num_keys || leaf->keys[slot] != key) {
+    return NULL;
+  }
+  return &leaf->lists[slot];
+}
+
+long long multiset_rows(multiset_node* root, btree_key key, vector<long long>& rows) {
+  posting_list* list = find_list(root, key);
+  if (list == NULL) {
+    return 0;
+  }
+  posting_decode(*list, rows);
+  return list->count;
+}
+
+long long multiset_count(multiset_node* root, btree_key key) {
+  posting_list* list = find_list(root, key);
+  return list == NULL ? 0 : list->count;
+}
+
+long long multiset_count_keys(multiset_node* root) {
+  if (root == NULL) {
+    return 0;
+  }
+  if (root->is_leaf) {
+    return root->num_keys;
+  }
+  long long count = 0;
+  for (int i = 0; i <= root->num_keys; i++) {
+    count += multiset_count_keys(root->children[i]);
+  }
+  return count;
+}
+
+long long multiset_count_nodes(multiset_node* root) {
+  if (root == NULL) {
+    return 0;
+  }
+  long long count = 1;
+  if (!root->is_leaf) {
+    for (int i = 0; i <= root->num_keys; i++) {
+      count += multiset_count_nodes(root->children[i]);
+    }
+  }
+  return count;
+}
+
+long long multiset_count_rows(multiset_node* root) {
+  if (root == NULL) {
+    return 0;
+  }
+  long long count = 0;
+  if (root->is_leaf) {
+    for (int i = 0; i < root->num_keys; i++) {
+      count += root->lists[i].count;
+    }
+    return count;
+  }
+  for (int i = 0; i <= root->num_keys; i++) {
+    count += multiset_count_rows(root->children[i]);
+  }
+  return count;
+}
+
+void multiset_destroy(multiset_node*& root) {
+  if (root == NULL) {
+    return;
+  }
+  if (root->is_leaf) {
+    for (int i = 0; i < root->num_keys; i++) {
+      posting_free(root->lists[i]);
+    }
+  } else {
+    for (int i = 0; i <= root->num_keys; i++) {
+      multiset_destroy(root->children[i]);
+    }
+  }
+  delete root;
+  root = NULL;
+}
@@ -0,0 +1,101 @@
+//
+// btree_multiset.h
+//
+// A b-tree for secondary indexes, where one key can have many rows.
+//
+// insert keeps one copy of each key, so a table with a thousand rows
+// for one key would need a thousand slots under some made-up ordering
+// to index them. This tree instead keeps each key once and hangs a
+// posting list of row IDs off it:
+//
+// -- A key with up to POSTING_INLINE rows keeps them right in its leaf
+//    slot, so the common case of one or two rows costs no extra
+//    allocation or pointer chase.
+// -- Past that the rows spill to a block of their own, kept sorted and
+//    stored as the first row followed by the gap to each next row, in
+//    7-bit variable-length bytes. Dense row IDs cost about a byte each,
+//    and rows added in increasing order are appended without decoding
+//    the rest.
+//
+// It is a B+-tree: keys and their lists live only in the leaves, and
+// inner nodes hold copies of keys to steer by. So finding all the rows
+// for a key is one descent plus one list.
+//
+// Removal takes a key out of its leaf once its last row goes. Like the
+// run tree, a leaf left empty is freed and unlinked, and an inner node
+// left with one child is replaced by it, so removing every key gives
+// all the memory back; nodes are never merged, though, so leaves may
+// end up at different depths.
+
+#ifndef btree_multiset_h
+#define btree_multiset_h
+
+#include <vector>
+#include "btree.h"
+
+// The most keys a node holds.
+#define MULTISET_MAX_KEYS 16
+
+// The most rows a posting list holds in its leaf slot.
+#define POSTING_INLINE 3
+
+// posting_block is a posting list that outgrew its leaf slot.
+struct posting_block {
+  long long first;
+  long long last;
+
+  // deltas holds the gap from each row to the one before it, starting
+  // with the second row, as little-endian base-128 numbers.
+  vector<unsigned char> deltas;
+};
+
+// posting_list is the set of rows for one key, in ascending order.
+struct posting_list {
+  long long count;
+  union {
+    long long rows[POSTING_INLINE];
+    posting_block* block;
+  };
+};
+
+struct multiset_node {
+  bool is_leaf;
+  int num_keys;
+  btree_key keys[MULTISET_MAX_KEYS];
+
+  // A leaf has a posting list for each key. In an inner node child i
+  // holds the keys below key i (and at or above key i - 1).
+  union {
+    posting_list lists[MULTISET_MAX_KEYS];
+    multiset_node* children[MULTISET_MAX_KEYS + 1];
+  };
+};
+
+// multiset_insert adds 'row' to the rows for 'key', creating the tree
+// if 'root' is NULL. Returns false if the key already had that row.
+bool multiset_insert(multiset_node*& root, btree_key key, long long row);
+
+// multiset_remove takes 'row' out of the rows for 'key'. Returns false
+// if it wasn't there.
+bool multiset_remove(multiset_node*& root, btree_key key, long long row);
+
+// multiset_rows appends the rows for 'key' to 'rows' in ascending
+// order and returns how many there were.
+long long multiset_rows(multiset_node* root, btree_key key, vector<long long>& rows);
+
+// multiset_count returns the number of rows for 'key' without
+// decoding them.
+long long multiset_count(multiset_node* root, btree_key key);
+
+// multiset_count_keys returns the number of distinct keys,
+// multiset_count_rows the number of rows under all of them, and
+// multiset_count_nodes the number of nodes holding them.
+long long multiset_count_keys(multiset_node* root);
+long long multiset_count_rows(multiset_node* root);
+long long multiset_count_nodes(multiset_node* root);
+
+// multiset_destroy frees the tree and its posting lists and sets
+// 'root' to NULL.
+void multiset_destroy(multiset_node*& root);
+
+#endif
@@ -0,0 +1,198 @@
+//
+// btree_packed.cpp
+//
+
+#include <algorithm>
+#include <cstring>
+#include "btree_packed.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+// From btree.cpp.
+void collect_keys(btree* node, vector<btree_key>& keys);
+
+// Frame data is read 16 bytes at a time.
+#define PACKED_CHUNK_BYTES 16
+
+// read_offset returns lane 'i' of a frame's data. Offsets are unsigned
+// distances from the frame's base.
+unsigned long long read_offset(const unsigned char* data, int i, int width) {
+  switch (width) {
+  case 1:
+    return data[i];
+  case 2: {
+    unsigned short value;
+    memcpy(&value, data + 2 * i, 2);
+    return value;
+  }
+  case 4: {
+    unsigned int value;
+    memcpy(&value, data + 4 * i, 4);
+    return value;
+  }
+  default: {
+    unsigned long long value;
+    memcpy(&value, data + 8 * i, 8);
+    return value;
+  }
+  }
+}
+
+void write_offset(unsigned char* data, int i, int width, unsigned long long value) {
+  switch (width) {
+  case 1:
+    data[i] = (unsigned char) value;
+    break;
+  case 2: {
+    unsigned short narrow = (unsigned short) value;
+    memcpy(data + 2 * i, &narrow, 2);
+    break;
+  }
+  case 4: {
+    unsigned int narrow = (unsigned int) value;
+    memcpy(data + 4 * i, &narrow, 4);
+    break;
+  }
+  default:
+    memcpy(data + 8 * i, &value, 8);
+    break;
+  }
+}
+
+// chunk_contains compares every lane of one 16-byte chunk against
+// 'target' at once.
+bool chunk_contains(const unsigned char* chunk, int width, unsigned long long target) {
+#ifdef __SSE2__
+  __m128i lanes = _mm_loadu_si128((const __m128i*) chunk);
+  __m128i equal;
+  switch (width) {
+  case 1:
+    equal = _mm_cmpeq_epi8(lanes, _mm_set1_epi8((char) target));
+    break;
+  case 2:
+    equal = _mm_cmpeq_epi16(lanes, _mm_set1_epi16((short) target));
+    break;
+  case 4:
+    equal = _mm_cmpeq_epi32(lanes, _mm_set1_epi32((int) target));
+    break;
+  default:
+    // SSE2 has no 64-bit compare. A 64-bit lane matches when both of its 32-bit halves
+    // do, so compare the halves and AND each with its neighbour.
+    equal = _mm_cmpeq_epi32(lanes, _mm_set_epi32((int) (target >> 32), (int) target,
+                                                 (int) (target >> 32), (int) target));
+    equal = _mm_and_si128(equal, _mm_shuffle_epi32(equal, _MM_SHUFFLE(2, 3, 0, 1)));
+    break;
+  }
+  return _mm_movemask_epi8(equal) != 0;
+#else
+  for (int i = 0; i < PACKED_CHUNK_BYTES / width; i++) {
+    if (read_offset(chunk, i, width) == target) {
+      return true;
+    }
+  }
+  return false;
+#endif
+}
+
+void pack_tree(btree* root, btree_packed* packed) {
+  packed->first_keys.clear();
+  packed->frames.clear();
+  packed->data.clear();
+  packed->keys = 0;
+
+  vector<btree_key> keys;
+  if (root != NULL) {
+    collect_keys(root, keys);
+  }
+  packed->keys = keys.size();
+
+  size_t start = 0;
+  while (start < keys.size()) {
+    packed_frame frame;
+    frame.base = keys[start];
+    frame.width = 1;
+    frame.count = 1;
+
+    // Grow the frame a key at a time, widening the offsets as needed. Once the frame has
+    // a chunk of keys, stop instead of widening: a key that is far from the others (the
+    // start of the next cluster, say) is better off starting a narrow frame of its own.
+    // The subtraction is done unsigned so it can't overflow.
+    while (frame.count < PACKED_FRAME_KEYS && start + frame.count < keys.size()) {
+      unsigned long long span =
+          (unsigned long long) keys[start + frame.count] - (unsigned long long) frame.base;
+      int width = span <= 0xff ? 1 : span <= 0xffff ? 2 : span <= 0xffffffffULL ? 4 : 8;
+      if (width > frame.width) {
+        if (frame.count >= PACKED_CHUNK_BYTES / frame.width) {
+          break;
+        }
+        frame.width = width;
+      }
+      frame.count++;
+    }
+
+    // Pad to whole chunks by repeating the last offset. A padding lane can only match a
+    // search for the last key, which is in the frame anyway.
+    int bytes = frame.count * frame.width;
+    bytes = (bytes + PACKED_CHUNK_BYTES - 1) / PACKED_CHUNK_BYTES * PACKED_CHUNK_BYTES;
+    frame.offset = packed->data.size();
+    packed->data.resize(frame.offset + bytes);
+
+    unsigned char* data = &packed->data[frame.offset];
+    int lanes = bytes / frame.width;
+    for (int i = 0; i < lanes; i++) {
+      btree_key key = keys[start + min(i, frame.count - 1)];
+      write_offset(data, i, frame.width, (unsigned long long) key - (unsigned long long) frame.base);
+    }
+
+    packed->first_keys.push_back(frame.base);
+    packed->frames.push_back(frame);
+    start += frame.count;
+  }
+
+  // The vectors grew by doubling; give the slack back.
+  vector<btree_key>(packed->first_keys).swap(packed->first_keys);
+  vector<packed_frame>(packed->frames).swap(packed->frames);
+  vector<unsigned char>(packed->data).swap(packed->data);
+}
+
+bool packed_contains(const btree_packed& packed, btree_key key) {
+  // The frame that could hold the key is the last one starting at or before it.
+  vector<btree_key>::const_iterator next =
+      upper_bound(packed.first_keys.begin(), packed.first_keys.end(), key);
+  if (next == packed.first_keys.begin()) {
+    return false;
+  }
+  const packed_frame& frame = packed.frames[next - packed.first_keys.begin() - 1];
+
+  unsigned long long target = (unsigned long long) key - (unsigned long long) frame.base;
+  if ((frame.width == 1 && target > 0xff) || (frame.width == 2 && target > 0xffff) ||
+      (frame.width == 4 && target > 0xffffffffULL)) {
+    return false;
+  }
+
+  // Offsets are sorted, so binary search the chunks by their first lane, then compare
+  // the whole chunk that could hold the key in one go.
+  const unsigned char* data = &packed.data[frame.offset];
+  int lanes_per_chunk = PACKED_CHUNK_BYTES / frame.width;
+  int chunks = (frame.count + lanes_per_chunk - 1) / lanes_per_chunk;
+  int low = 0;
+  int high = chunks - 1;
+  while (low < high) {
+    int middle = (low + high + 1) / 2;
+    if (read_offset(data, middle * lanes_per_chunk, frame.width) <= target) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return chunk_contains(data + low * PACKED_CHUNK_BYTES, frame.width, target);
+}
+
+size_t packed_bytes(const btree_packed& packed) {
+  return sizeof(packed) + packed.first_keys.capacity() * sizeof(btree_key) +
+         packed.frames.capacity() * sizeof(packed_frame) + packed.data.capacity();
+}
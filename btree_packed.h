@@ -0,0 +1,70 @@
+//
+// btree_packed.h
+//
+// A compressed, read-only snapshot of a tree's keys for large sets of
+// clustered IDs.
+//
+// A btree node spends a full key on every key, plus child pointers,
+// so a large tree costs tens of bytes per key. Clustered keys need far
+// fewer bits: within a run of nearby keys, each one is a small offset
+// from the first. pack_tree stores the keys in frames of up to
+// PACKED_FRAME_KEYS keys, each holding a base key and the offsets of
+// the others from it in 8, 16, 32 or (with 64-bit keys) 64 bits,
+// whichever is the narrowest that fits that frame. Frames end early at
+// gaps between clusters rather than widen. A search finds the frame by
+// its first key and then compares the packed offsets 16 bytes at a
+// time with SSE2 (or a scalar loop where SSE2 isn't available), so a
+// cache line holds up to 64 keys instead of a handful.
+//
+// The snapshot doesn't follow later changes to the tree; pack it again
+// after updating.
+
+#ifndef btree_packed_h
+#define btree_packed_h
+
+#include <vector>
+#include "btree.h"
+
+// The most keys a frame holds. A full frame of 8-bit offsets is two
+// cache lines.
+#define PACKED_FRAME_KEYS 128
+
+// packed_frame describes one frame.
+struct packed_frame {
+  // base is the frame's first (smallest) key. Every key in the frame is
+  // stored as its distance from base.
+  btree_key base;
+
+  // width is the size of each stored offset in bytes: 1, 2, 4 or 8.
+  int width;
+
+  // count is the number of keys in the frame.
+  int count;
+
+  // offset is where the frame's offsets start in btree_packed::data.
+  // Each frame's data is padded to a multiple of 16 bytes so it can be
+  // read in whole SSE2 registers.
+  size_t offset;
+};
+
+struct btree_packed {
+  // first_keys[i] is frames[i].base, kept in an array of its own so the
+  // binary search over frames touches as few cache lines as possible.
+  vector<btree_key> first_keys;
+  vector<packed_frame> frames;
+  vector<unsigned char> data;
+  long long keys;
+};
+
+// pack_tree replaces the contents of 'packed' with the keys of the
+// tree rooted at 'root'.
+void pack_tree(btree* root, btree_packed* packed);
+
+// packed_contains returns true if 'key' is in the snapshot.
+bool packed_contains(const btree_packed& packed, btree_key key);
+
+// packed_bytes returns the memory the snapshot uses, not counting
+// allocator overhead.
+size_t packed_bytes(const btree_packed& packed);
+
+#endif
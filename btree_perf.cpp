@@ -0,0 +1,127 @@
+//
+// btree_perf.cpp
+//
+
+#include <cstring>
+#include "btree_perf.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+const char* perf_counter_name(int id) {
+  switch (id) {
+  case PERF_CYCLES:
+    return "cyc/op";
+  case PERF_INSTRUCTIONS:
+    return "ins/op";
+  case PERF_L1D_MISSES:
+    return "L1m/op";
+  case PERF_LLC_MISSES:
+    return "LLCm/op";
+  case PERF_DTLB_MISSES:
+    return "TLBm/op";
+  case PERF_BRANCH_MISSES:
+    return "brm/op";
+  }
+  return "?";
+}
+
+#ifdef __linux__
+
+// cache_event builds the config word for a PERF_TYPE_HW_CACHE read miss.
+static unsigned long long cache_event(unsigned long long cache) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+static int open_counter(unsigned int type, unsigned long long config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  // pid 0, cpu -1: this thread, on whichever CPU it runs.
+  return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void perf_open(perf_counters* counters) {
+  counters->fds[PERF_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  counters->fds[PERF_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  counters->fds[PERF_L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_L1D));
+  counters->fds[PERF_LLC_MISSES] = open_counter(PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_LL));
+  counters->fds[PERF_DTLB_MISSES] = open_counter(PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_DTLB));
+  counters->fds[PERF_BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+}
+
+void perf_close(perf_counters* counters) {
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    if (counters->fds[i] >= 0) {
+      close(counters->fds[i]);
+      counters->fds[i] = -1;
+    }
+  }
+}
+
+void perf_start(perf_counters* counters) {
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    if (counters->fds[i] >= 0) {
+      ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+void perf_stop(perf_counters* counters, perf_sample* sample) {
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    if (counters->fds[i] >= 0) {
+      ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    sample->available[i] = false;
+    sample->values[i] = 0;
+    if (counters->fds[i] < 0) {
+      continue;
+    }
+
+    // value, time_enabled, time_running
+    unsigned long long data[3];
+    if (read(counters->fds[i], data, sizeof(data)) != (ssize_t) sizeof(data) || data[2] == 0) {
+      continue;
+    }
+    sample->available[i] = true;
+    sample->values[i] = (double) data[0] * ((double) data[1] / (double) data[2]);
+  }
+}
+
+#else
+
+void perf_open(perf_counters* counters) {
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    counters->fds[i] = -1;
+  }
+}
+
+void perf_close(perf_counters*) {
+}
+
+void perf_start(perf_counters*) {
+}
+
+void perf_stop(perf_counters*, perf_sample* sample) {
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    sample->available[i] = false;
+    sample->values[i] = 0;
+  }
+}
+
+#endif
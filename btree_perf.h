@@ -0,0 +1,55 @@
+//
+// btree_perf.h
+//
+// Hardware performance counters for the benchmarks, read through
+// Linux perf_event_open. On other platforms, or when the kernel won't
+// let us open a counter (perf_event_paranoid, containers, VMs without
+// a PMU), that counter simply reports as unavailable.
+
+#ifndef btree_perf_h
+#define btree_perf_h
+
+// The counters we read around each workload phase.
+enum perf_counter_id {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_L1D_MISSES,
+  PERF_LLC_MISSES,
+  PERF_DTLB_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_NUM_COUNTERS
+};
+
+// perf_sample holds the counts for one phase. available[i] is false if
+// counter i could not be opened or never got scheduled, in which case
+// values[i] is meaningless.
+struct perf_sample {
+  bool available[PERF_NUM_COUNTERS];
+  double values[PERF_NUM_COUNTERS];
+};
+
+// perf_counters owns one file descriptor per counter. Counters only
+// count user-space events of the calling thread.
+struct perf_counters {
+  int fds[PERF_NUM_COUNTERS];
+};
+
+// perf_open opens every counter it can. Failures are not errors; the
+// counter is just marked unavailable.
+void perf_open(perf_counters* counters);
+
+// perf_close closes all open counters.
+void perf_close(perf_counters* counters);
+
+// perf_start resets and enables all open counters.
+void perf_start(perf_counters* counters);
+
+// perf_stop disables all open counters and reads them into 'sample'.
+// If the kernel multiplexed a counter, its value is scaled up by
+// time_enabled / time_running.
+void perf_stop(perf_counters* counters, perf_sample* sample);
+
+// perf_counter_name returns a short column label for a counter.
+const char* perf_counter_name(int id);
+
+#endif
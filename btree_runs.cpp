@@ -0,0 +1,309 @@
+//
+// btree_runs.cpp
+//
+
+#include <algorithm>
+#include <limits>
+#include "btree_runs.h"
+
+using namespace std;
+
+#define MIN_KEY numeric_limits<btree_key>::min()
+#define MAX_KEY numeric_limits<btree_key>::max()
+
+// run_position is one run in a leaf. 'leaf' is NULL if there is no such run.
+struct run_position {
+  run_node* leaf;
+  int index;
+};
+
+run_node* run_alloc(bool is_leaf) {
+  run_node* node = new run_node;
+  node->is_leaf = is_leaf;
+  node->num_keys = 0;
+  return node;
+}
+
+// run_child_slot returns the child of an inner node that runs starting at 'key' go under.
+int run_child_slot(run_node* node, btree_key key) {
+  return upper_bound(node->starts, node->starts + node->num_keys, key) - node->starts;
+}
+
+// last_run returns the last run in a subtree.
+run_position last_run(run_node* node) {
+  if (node->is_leaf) {
+    run_position position = {node->num_keys > 0 ? node : NULL, node->num_keys - 1};
+    return position;
+  }
+  for (int i = node->num_keys; i >= 0; i--) {
+    run_position position = last_run(node->children[i]);
+    if (position.leaf != NULL) {
+      return position;
+    }
+  }
+  run_position none = {NULL, -1};
+  return none;
+}
+
+// run_at_or_before returns the last run that starts at or before 'key'. That is the only
+// run that can hold the key, and the one a run starting just after it would join.
+run_position run_at_or_before(run_node* node, btree_key key) {
+  if (node->is_leaf) {
+    int i = upper_bound(node->starts, node->starts + node->num_keys, key) - node->starts - 1;
+    run_position position = {i >= 0 ? node : NULL, i};
+    return position;
+  }
+
+  // The run is under the key's own child unless that child has nothing at or before the
+  // key, in which case it is the last run in the child to the left. The separators only
+  // bound a child's starts, so after removals its first run can start well past them.
+  int slot = run_child_slot(node, key);
+  run_position position = run_at_or_before(node->children[slot], key);
+  for (int i = slot - 1; i >= 0 && position.leaf == NULL; i--) {
+    position = last_run(node->children[i]);
+  }
+  return position;
+}
+
+// run_split_child splits the full child at 'child_index' of 'parent', which must have room
+// for one more key.
+void run_split_child(run_node* parent, int child_index) {
+  run_node* child = parent->children[child_index];
+  run_node* sibling = run_alloc(child->is_leaf);
+  int left_count = RUN_MAX_KEYS / 2;
+  btree_key separator = child->starts[left_count];
+
+  if (child->is_leaf) {
+    sibling->num_keys = child->num_keys - left_count;
+    copy(child->starts + left_count, child->starts + child->num_keys, sibling->starts);
+    copy(child->ends + left_count, child->ends + child->num_keys, sibling->ends);
+  } else {
+    sibling->num_keys = child->num_keys - left_count - 1;
+    copy(child->starts + left_count + 1, child->starts + child->num_keys, sibling->starts);
+    copy(child->children + left_count + 1, child->children + child->num_keys + 1, sibling->children);
+  }
+  child->num_keys = left_count;
+
+  for (int i = parent->num_keys; i > child_index; i--) {
+    parent->starts[i] = parent->starts[i - 1];
+    parent->children[i + 1] = parent->children[i];
+  }
+  parent->starts[child_index] = separator;
+  parent->children[child_index + 1] = sibling;
+  parent->num_keys++;
+}
+
+// add_run puts the run [start, end] into the tree. It must not overlap any run already
+// there. Full nodes are split on the way down, so there is always room for a split below.
+void add_run(run_node*& root, btree_key start, btree_key end) {
+  if (root == NULL) {
+    root = run_alloc(true);
+  }
+  if (root->num_keys == RUN_MAX_KEYS) {
+    run_node* old_root = root;
+    root = run_alloc(false);
+    root->children[0] = old_root;
+    run_split_child(root, 0);
+  }
+
+  run_node* node = root;
+  while (!node->is_leaf) {
+    int i = run_child_slot(node, start);
+    if (node->children[i]->num_keys == RUN_MAX_KEYS) {
+      run_split_child(node, i);
+      i = run_child_slot(node, start);
+    }
+    node = node->children[i];
+  }
+
+  int slot = lower_bound(node->starts, node->starts + node->num_keys, start) - node->starts;
+  for (int i = node->num_keys; i > slot; i--) {
+    node->starts[i] = node->starts[i - 1];
+    node->ends[i] = node->ends[i - 1];
+  }
+  node->starts[slot] = start;
+  node->ends[slot] = end;
+  node->num_keys++;
+}
+
+// run_prune goes down to the leaf that runs starting at 'start' belong in and frees it if
+// it is empty. On the way back up, a freed child is unlinked along with the separator
+// next to it, and an inner node left with a single child is freed and replaced by that
+// child. 'node' is the parent's pointer to the subtree, or the root.
+void run_prune(run_node*& node, btree_key start) {
+  if (node->is_leaf) {
+    if (node->num_keys == 0) {
+      delete node;
+      node = NULL;
+    }
+    return;
+  }
+
+  int slot = run_child_slot(node, start);
+  run_prune(node->children[slot], start);
+  if (node->children[slot] != NULL) {
+    return;
+  }
+  for (int i = max(slot - 1, 0); i + 1 < node->num_keys; i++) {
+    node->starts[i] = node->starts[i + 1];
+  }
+  for (int i = slot; i < node->num_keys; i++) {
+    node->children[i] = node->children[i + 1];
+  }
+  node->num_keys--;
+  if (node->num_keys == 0) {
+    run_node* only_child = node->children[0];
+    delete node;
+    node = only_child;
+  }
+}
+
+// drop_run removes a run from its leaf, pruning the leaf if that empties it.
+void drop_run(run_node*& root, run_position position) {
+  run_node* leaf = position.leaf;
+  btree_key start = leaf->starts[position.index];
+  for (int i = position.index + 1; i < leaf->num_keys; i++) {
+    leaf->starts[i - 1] = leaf->starts[i];
+    leaf->ends[i - 1] = leaf->ends[i];
+  }
+  leaf->num_keys--;
+  if (leaf->num_keys == 0) {
+    run_prune(root, start);
+  }
+}
+
+void run_insert_range(run_node*& root, btree_key first, btree_key last) {
+  if (first > last) {
+    return;
+  }
+
+  // Absorb every run that overlaps [first, last] or touches either end of it, working
+  // down from the last one that starts no later than just past the range.
+  btree_key reach = last == MAX_KEY ? last : last + 1;
+  while (root != NULL) {
+    run_position position = run_at_or_before(root, reach);
+    if (position.leaf == NULL) {
+      break;
+    }
+    btree_key start = position.leaf->starts[position.index];
+    btree_key end = position.leaf->ends[position.index];
+    if (first != MIN_KEY && end < first - 1) {
+      break;
+    }
+    first = min(first, start);
+    last = max(last, end);
+    drop_run(root, position);
+  }
+  add_run(root, first, last);
+}
+
+bool run_insert(run_node*& root, btree_key key) {
+  if (run_contains(root, key)) {
+    return false;
+  }
+  run_insert_range(root, key, key);
+  return true;
+}
+
+void run_remove_range(run_node*& root, btree_key first, btree_key last) {
+  if (first > last) {
+    return;
+  }
+
+  // Cut every run that overlaps [first, last], keeping whatever sticks out either side.
+  while (root != NULL) {
+    run_position position = run_at_or_before(root, last);
+    if (position.leaf == NULL) {
+      return;
+    }
+    btree_key start = position.leaf->starts[position.index];
+    btree_key end = position.leaf->ends[position.index];
+    if (end < first) {
+      return;
+    }
+
+    if (start < first) {
+      // The part below the range stays put with a new end.
+      position.leaf->ends[position.index] = first - 1;
+    } else {
+      drop_run(root, position);
+    }
+    if (end > last) {
+      add_run(root, last + 1, end);
+    }
+  }
+}
+
+bool run_remove(run_node*& root, btree_key key) {
+  if (!run_contains(root, key)) {
+    return false;
+  }
+  run_remove_range(root, key, key);
+  return true;
+}
+
+bool run_contains(run_node* root, btree_key key) {
+  if (root == NULL) {
+    return false;
+  }
+  run_position position = run_at_or_before(root, key);
+  return position.leaf != NULL && position.leaf->ends[position.index] >= key;
+}
+
+long long run_count_runs(run_node* root) {
+  if (root == NULL) {
+    return 0;
+  }
+  if (root->is_leaf) {
+    return root->num_keys;
+  }
+  long long count = 0;
+  for (int i = 0; i <= root->num_keys; i++) {
+    count += run_count_runs(root->children[i]);
+  }
+  return count;
+}
+
+long long run_count_nodes(run_node* root) {
+  if (root == NULL) {
+    return 0;
+  }
+  long long count = 1;
+  if (!root->is_leaf) {
+    for (int i = 0; i <= root->num_keys; i++) {
+      count += run_count_nodes(root->children[i]);
+    }
+  }
+  return count;
+}
+
+long long run_count_keys(run_node* root) {
+  if (root == NULL) {
+    return 0;
+  }
+  long long count = 0;
+  if (root->is_leaf) {
+    for (int i = 0; i < root->num_keys; i++) {
+      unsigned long long span = (unsigned long long) root->ends[i] - (unsigned long long) root->starts[i];
+      count += (long long) span + 1;
+    }
+    return count;
+  }
+  for (int i = 0; i <= root->num_keys; i++) {
+    count += run_count_keys(root->children[i]);
+  }
+  return count;
+}
+
+void run_destroy(run_node*& root) {
+  if (root == NULL) {
+    return;
+  }
+  if (!root->is_leaf) {
+    for (int i = 0; i <= root->num_keys; i++) {
+      run_destroy(root->children[i]);
+    }
+  }
+  delete root;
+  root = NULL;
+}
@@ -0,0 +1,75 @@
+//
+// btree_runs.h
+//
+// A set of keys stored as runs of consecutive keys, for key spaces that
+// are handed out in large contiguous blocks.
+//
+// A block of a million consecutive IDs costs a btree a million keys
+// and hundreds of thousands of nodes. This tree stores each maximal run
+// [start, end] as one entry instead, so its size depends on how many
+// runs there are, not how many keys. Inserting a key next to a run
+// extends it, and one that closes the gap between two runs joins them
+// into one; removing a key from the middle of a run splits it in two.
+//
+// It is a B+-tree whose leaves hold runs sorted by their start, and
+// whose inner nodes hold starts to steer by. Finding a key is one
+// descent to the last run starting at or before it and a check of that
+// run's end.
+//
+// Removal doesn't rebalance, but a leaf emptied by removals is freed,
+// and an inner node left with a single child is replaced by that child.
+// Every inner node keeps at least two children, so the tree never has
+// more nodes than twice its runs. Its leaves may end up at different
+// depths, though never deeper than before.
+
+#ifndef btree_runs_h
+#define btree_runs_h
+
+#include "btree.h"
+
+// The most runs (or, in inner nodes, separators) a node holds.
+#define RUN_MAX_KEYS 16
+
+struct run_node {
+  bool is_leaf;
+  int num_keys;
+
+  // starts holds the first key of each run in a leaf, and the
+  // separators in an inner node: child i holds the runs starting below
+  // key i (and at or above key i - 1).
+  btree_key starts[RUN_MAX_KEYS];
+  union {
+    btree_key ends[RUN_MAX_KEYS];
+    run_node* children[RUN_MAX_KEYS + 1];
+  };
+};
+
+// run_insert adds 'key' to the set, creating the tree if 'root' is
+// NULL. Returns false if it was already there.
+bool run_insert(run_node*& root, btree_key key);
+
+// run_insert_range adds every key k with first <= k <= last. The new
+// run absorbs any runs it overlaps or touches.
+void run_insert_range(run_node*& root, btree_key first, btree_key last);
+
+// run_remove takes 'key' out of the set. Returns false if it wasn't
+// there.
+bool run_remove(run_node*& root, btree_key key);
+
+// run_remove_range takes out every key k with first <= k <= last.
+void run_remove_range(run_node*& root, btree_key first, btree_key last);
+
+// run_contains returns true if 'key' is in the set.
+bool run_contains(run_node* root, btree_key key);
+
+// run_count_runs returns the number of runs, run_count_keys the
+// number of keys in all of them, and run_count_nodes the number of
+// nodes holding them.
+long long run_count_runs(run_node* root);
+long long run_count_keys(run_node* root);
+long long run_count_nodes(run_node* root);
+
+// run_destroy frees the tree and sets 'root' to NULL.
+void run_destroy(run_node*& root);
+
+#endif
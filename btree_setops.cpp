@@ -0,0 +1,191 @@
+//
+// btree_setops.cpp
+//
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <thread>
+#include <vector>
+#include "btree_setops.h"
+
+using namespace std;
+
+// From btree.cpp.
+int tree_height(btree* root);
+
+// Trees shorter than this are merged on the calling thread; below a few
+// tens of thousands of keys, starting threads costs more than it saves.
+#define SETOPS_MIN_PARALLEL_HEIGHT 7
+
+// Ranges handed out per thread. More ranges than threads evens out the
+// work when the sampled splitters don't cut the trees evenly.
+#define SETOPS_RANGES_PER_THREAD 4
+
+enum set_operation {
+  SET_UNION,
+  SET_INTERSECTION,
+  SET_DIFFERENCE
+};
+
+// merge_range is the half-open key range [low, high) one task merges.
+// The first range has no lower end and the last has no upper end.
+struct merge_range {
+  btree_key low;
+  btree_key high;
+  bool has_low;
+  bool has_high;
+};
+
+// collect_range appends the keys of the subtree rooted at 'node' that
+// fall in 'range' to 'keys', in ascending order. Children that lie
+// wholly outside the range are skipped.
+void collect_range(btree* node, const merge_range& range, vector<btree_key>& keys) {
+  for (int i = 0; i <= node->num_keys; i++) {
+    // Child i holds the keys between key i - 1 and key i.
+    if (i > 0 && range.has_high && node->keys[i - 1] >= range.high) {
+      return;
+    }
+    if (!node->is_leaf && (i == node->num_keys || !range.has_low || node->keys[i] > range.low)) {
+      collect_range(node->children[i], range, keys);
+    }
+    if (i < node->num_keys && (!range.has_low || node->keys[i] >= range.low) &&
+        (!range.has_high || node->keys[i] < range.high)) {
+      keys.push_back(node->keys[i]);
+    }
+  }
+}
+
+// sample_keys appends the keys of the top levels of a tree to 'keys',
+// going one level deeper at a time until it has at least 'wanted' keys
+// or runs out of inner levels. Those keys cut the tree into subtrees of
+// roughly equal size.
+void sample_keys(btree* root, size_t wanted, vector<btree_key>& keys) {
+  vector<btree*> level;
+  if (root != NULL) {
+    level.push_back(root);
+  }
+  size_t start = keys.size();
+  while (!level.empty() && !level[0]->is_leaf && keys.size() - start < wanted) {
+    vector<btree*> next_level;
+    for (size_t i = 0; i < level.size(); i++) {
+      btree* node = level[i];
+      keys.insert(keys.end(), node->keys, node->keys + node->num_keys);
+      next_level.insert(next_level.end(), node->children, node->children + node->num_keys + 1);
+    }
+    level.swap(next_level);
+  }
+}
+
+// merge_one_range returns a tree of the result's keys in 'range', or NULL if there are
+// none.
+btree* merge_one_range(set_operation operation, btree* a, btree* b, const merge_range& range) {
+  vector<btree_key> a_keys;
+  vector<btree_key> b_keys;
+  if (a != NULL) {
+    collect_range(a, range, a_keys);
+  }
+  // Neither an intersection nor a difference has anything in a range where a is
+  // empty, so b need not be walked there.
+  if (b != NULL && !(operation != SET_UNION && a_keys.empty())) {
+    collect_range(b, range, b_keys);
+  }
+
+  vector<btree_key> out;
+  switch (operation) {
+  case SET_UNION:
+    set_union(a_keys.begin(), a_keys.end(), b_keys.begin(), b_keys.end(), back_inserter(out));
+    break;
+  case SET_INTERSECTION:
+    set_intersection(a_keys.begin(), a_keys.end(), b_keys.begin(), b_keys.end(), back_inserter(out));
+    break;
+  case SET_DIFFERENCE:
+    set_difference(a_keys.begin(), a_keys.end(), b_keys.begin(), b_keys.end(), back_inserter(out));
+    break;
+  }
+  if (out.empty()) {
+    return NULL;
+  }
+  return build_tree(&out[0], out.size());
+}
+
+void merge_worker(set_operation operation, btree* a, btree* b, const vector<merge_range>* ranges,
+                  vector<btree*>* results, atomic<size_t>* next_range) {
+  while (true) {
+    size_t index = next_range->fetch_add(1, memory_order_relaxed);
+    if (index >= ranges->size()) {
+      return;
+    }
+    (*results)[index] = merge_one_range(operation, a, b, (*ranges)[index]);
+  }
+}
+
+btree* set_operation_tree(set_operation operation, btree* a, btree* b, int threads) {
+  if (threads <= 0) {
+    threads = thread::hardware_concurrency();
+  }
+  if (max(tree_height(a), tree_height(b)) < SETOPS_MIN_PARALLEL_HEIGHT) {
+    threads = 1;
+  }
+
+  // Cut the key space at evenly spaced keys from the top of both trees.
+  vector<merge_range> ranges;
+  merge_range everything = { 0, 0, false, false };
+  if (threads <= 1) {
+    ranges.push_back(everything);
+  } else {
+    size_t wanted = (size_t) threads * SETOPS_RANGES_PER_THREAD;
+    vector<btree_key> samples;
+    sample_keys(a, wanted, samples);
+    sample_keys(b, wanted, samples);
+    sort(samples.begin(), samples.end());
+    samples.erase(unique(samples.begin(), samples.end()), samples.end());
+
+    size_t range_count = min(wanted, samples.size() + 1);
+    merge_range range = everything;
+    for (size_t r = 1; r < range_count; r++) {
+      range.high = samples[r * samples.size() / range_count];
+      range.has_high = true;
+      ranges.push_back(range);
+      range.low = range.high;
+      range.has_low = true;
+      range.has_high = false;
+    }
+    ranges.push_back(range);
+  }
+
+  if (ranges.size() == 1) {
+    return merge_one_range(operation, a, b, ranges[0]);
+  }
+
+  // Each worker builds the trees for the ranges it takes.
+  vector<btree*> results(ranges.size());
+  atomic<size_t> next_range(0);
+  vector<thread> pool;
+  for (int i = 0; i < threads; i++) {
+    pool.push_back(thread(merge_worker, operation, a, b, &ranges, &results, &next_range));
+  }
+  for (int i = 0; i < threads; i++) {
+    pool[i].join();
+  }
+
+  // The ranges are in key order, so each range's tree can be joined onto the right edge
+  // of the ones before it, at O(log n) a time.
+  btree* root = NULL;
+  for (size_t i = 0; i < results.size(); i++) {
+    join(root, results[i]);
+  }
+  return root;
+}
+
+btree* tree_union(btree* a, btree* b, int threads) {
+  return set_operation_tree(SET_UNION, a, b, threads);
+}
+
+btree* tree_intersection(btree* a, btree* b, int threads) {
+  return set_operation_tree(SET_INTERSECTION, a, b, threads);
+}
+
+btree* tree_difference(btree* a, btree* b, int threads) {
+  return set_operation_tree(SET_DIFFERENCE, a, b, threads);
+}
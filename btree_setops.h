@@ -0,0 +1,37 @@
+//
+// btree_setops.h
+//
+// Set algebra on whole trees.
+//
+// Each operation walks both input trees in key order and builds the
+// result bottom-up with build_tree, so it costs O(n + m) rather than
+// the O(n log m) of probing one tree with find for every key of the
+// other. The key space is cut into ranges at keys taken from the top
+// levels of the inputs. Each range is merged and built into a tree on
+// its own thread, and the range trees are joined in key order, at
+// O(log n) per join.
+//
+// The inputs are not changed. The result is a new tree that the caller
+// owns and should destroy; it is NULL when it has no keys. It is
+// densely packed apart from the nodes along the seams of the joins.
+
+#ifndef btree_setops_h
+#define btree_setops_h
+
+#include "btree.h"
+
+// tree_union returns a tree of the keys that are in 'a' or 'b'.
+// 'threads' is the number of threads to merge with; zero or less means
+// one per hardware thread. Small trees are always merged on the
+// calling thread.
+btree* tree_union(btree* a, btree* b, int threads);
+
+// tree_intersection returns a tree of the keys that are in both 'a'
+// and 'b'.
+btree* tree_intersection(btree* a, btree* b, int threads);
+
+// tree_difference returns a tree of the keys that are in 'a' but not
+// in 'b'.
+btree* tree_difference(btree* a, btree* b, int threads);
+
+#endif
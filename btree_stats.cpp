@@ -0,0 +1,169 @@
+//
+// btree_stats.cpp
+//
+
+#include <iomanip>
+#include <mutex>
+#include "btree_stats.h"
+
+using namespace std;
+
+thread_local btree_counter_block* btree_thread_counters = NULL;
+
+// registry_lock guards the list of live blocks and the retired totals.
+// It is only taken when a thread registers or exits and when someone
+// reads the counters, never on the counting path.
+static mutex registry_lock;
+static btree_counter_block* live_blocks = NULL;
+static unsigned long long retired_totals[BTREE_NUM_COUNTERS];
+
+// counter_owner releases a thread's block when the thread exits,
+// folding its counts into the retired totals so they aren't lost.
+struct counter_owner {
+  btree_counter_block* block;
+
+  counter_owner() : block(NULL) { }
+
+  ~counter_owner() {
+    if (block == NULL) {
+      return;
+    }
+
+    lock_guard<mutex> guard(registry_lock);
+    for (int i = 0; i < BTREE_NUM_COUNTERS; i++) {
+      retired_totals[i] += block->values[i].load(memory_order_relaxed);
+    }
+    btree_counter_block** link = &live_blocks;
+    while (*link != block) {
+      link = &(*link)->next;
+    }
+    *link = block->next;
+
+    btree_thread_counters = NULL;
+    delete block;
+  }
+};
+
+btree_counter_block* register_thread_counters() {
+  static thread_local counter_owner owner;
+
+  btree_counter_block* block = new btree_counter_block;
+  for (int i = 0; i < BTREE_NUM_COUNTERS; i++) {
+    block->values[i].store(0, memory_order_relaxed);
+  }
+
+  {
+    lock_guard<mutex> guard(registry_lock);
+    block->next = live_blocks;
+    live_blocks = block;
+  }
+
+  owner.block = block;
+  btree_thread_counters = block;
+  return block;
+}
+
+void read_counters(btree_counters* counters) {
+  lock_guard<mutex> guard(registry_lock);
+  for (int i = 0; i < BTREE_NUM_COUNTERS; i++) {
+    counters->values[i] = retired_totals[i];
+  }
+  for (btree_counter_block* block = live_blocks; block != NULL; block = block->next) {
+    for (int i = 0; i < BTREE_NUM_COUNTERS; i++) {
+      counters->values[i] += block->values[i].load(memory_order_relaxed);
+    }
+  }
+}
+
+const char* counter_name(int id) {
+  switch (id) {
+  case BTREE_INSERTS:
+    return "inserts";
+  case BTREE_REMOVES:
+    return "removes";
+  case BTREE_FINDS:
+    return "finds";
+  case BTREE_SPLITS:
+    return "splits";
+  case BTREE_MERGES:
+    return "merges";
+  case BTREE_ROTATIONS:
+    return "rotations";
+  case BTREE_ROOT_GROWS:
+    return "root_grows";
+  case BTREE_ROOT_SHRINKS:
+    return "root_shrinks";
+  case BTREE_NODES_ALLOCATED:
+    return "nodes_allocated";
+  case BTREE_NODES_FREED:
+    return "nodes_freed";
+  }
+  return "unknown";
+}
+
+void collect_stats(btree* node, int depth, btree_stats* stats) {
+  if ((int) stats->nodes_per_level.size() <= depth) {
+    stats->nodes_per_level.push_back(0);
+    stats->keys_per_level.push_back(0);
+  }
+
+  stats->nodes++;
+  stats->keys += node->num_keys;
+  stats->nodes_per_level[depth]++;
+  stats->keys_per_level[depth] += node->num_keys;
+  if (node->num_keys >= 0 && node->num_keys < BTREE_ORDER) {
+    stats->fill_histogram[node->num_keys]++;
+  }
+
+  if (!node->is_leaf) {
+    for (int i = 0; i <= node->num_keys; i++) {
+      collect_stats(node->children[i], depth + 1, stats);
+    }
+  }
+}
+
+void compute_stats(btree* root, btree_stats* stats) {
+  stats->nodes = 0;
+  stats->keys = 0;
+  stats->nodes_per_level.clear();
+  stats->keys_per_level.clear();
+  for (int i = 0; i < BTREE_ORDER; i++) {
+    stats->fill_histogram[i] = 0;
+  }
+
+  if (root != NULL) {
+    collect_stats(root, 0, stats);
+  }
+
+  stats->height = stats->nodes_per_level.size();
+  stats->fill_factor = 0;
+  stats->bytes_per_key = 0;
+  if (stats->nodes > 0) {
+    stats->fill_factor = (double) stats->keys / (stats->nodes * (BTREE_ORDER - 1));
+  }
+  if (stats->keys > 0) {
+    stats->bytes_per_key = (double) (stats->nodes * sizeof(btree)) / stats->keys;
+  }
+}
+
+void print_stats(ostream& out, const btree_stats& stats) {
+  ios::fmtflags flags = out.flags();
+  streamsize precision = out.precision();
+
+  out << "height: " << stats.height << endl;
+  out << "nodes: " << stats.nodes << endl;
+  out << "keys: " << stats.keys << endl;
+  for (int i = 0; i < stats.height; i++) {
+    out << "level " << i << ": " << stats.nodes_per_level[i] << " nodes, "
+        << stats.keys_per_level[i] << " keys" << endl;
+  }
+  out << "fill histogram (keys: nodes):";
+  for (int i = 0; i < BTREE_ORDER; i++) {
+    out << " " << i << ":" << stats.fill_histogram[i];
+  }
+  out << endl;
+  out << "fill factor: " << fixed << setprecision(3) << stats.fill_factor << endl;
+  out << "bytes per key: " << fixed << setprecision(2) << stats.bytes_per_key << endl;
+  out.flags(flags);
+  out.precision(precision);
+}
@@ -0,0 +1,108 @@
+//
+// btree_stats.h
+//
+// Operation counters and structural statistics.
+//
+// The counters are always on. Each thread bumps its own block of
+// relaxed atomics, so counting costs a load and a store with no
+// contention between threads; read_counters sums the blocks of every
+// live thread plus the totals left behind by threads that have exited.
+//
+// The structural statistics are computed on demand by walking the
+// whole tree, so they cost O(number of nodes).
+
+#ifndef btree_stats_h
+#define btree_stats_h
+
+#include <atomic>
+#include <iostream>
+#include <vector>
+#include "btree.h"
+
+enum btree_counter_id {
+  BTREE_INSERTS,          // calls to insert
+  BTREE_REMOVES,          // calls to remove
+  BTREE_FINDS,            // calls to find
+  BTREE_SPLITS,           // split_node calls
+  BTREE_MERGES,           // sibling merges during removal
+  BTREE_ROTATIONS,        // key rotations between siblings during removal
+  BTREE_ROOT_GROWS,       // a split added a new root
+  BTREE_ROOT_SHRINKS,     // a merge emptied the root and removed it
+  BTREE_NODES_ALLOCATED,
+  BTREE_NODES_FREED,
+  BTREE_NUM_COUNTERS
+};
+
+// btree_counters is a snapshot of every counter, summed over threads.
+// Counters only ever go up; take two snapshots and subtract to get a
+// rate.
+struct btree_counters {
+  unsigned long long values[BTREE_NUM_COUNTERS];
+};
+
+// btree_counter_block is one thread's set of counters. Only the owning
+// thread writes to it; read_counters reads it from other threads.
+struct btree_counter_block {
+  std::atomic<unsigned long long> values[BTREE_NUM_COUNTERS];
+  btree_counter_block* next;
+};
+
+// This thread's counter block, or NULL until the thread first counts
+// something.
+extern thread_local btree_counter_block* btree_thread_counters;
+
+// register_thread_counters allocates and registers the calling
+// thread's block. It is released when the thread exits.
+btree_counter_block* register_thread_counters();
+
+// count_event adds 'amount' (by default one) to a counter for the
+// calling thread.
+inline void count_event(btree_counter_id id, unsigned long long amount = 1) {
+  btree_counter_block* block = btree_thread_counters;
+  if (block == NULL) {
+    block = register_thread_counters();
+  }
+  std::atomic<unsigned long long>& value = block->values[id];
+  value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+// read_counters fills 'counters' with the totals over all threads.
+void read_counters(btree_counters* counters);
+
+// counter_name returns a metric-friendly name for a counter, such as
+// "splits" or "nodes_allocated".
+const char* counter_name(int id);
+
+// btree_stats describes the shape of one tree.
+struct btree_stats {
+  // height is the number of levels; zero for a NULL tree, one for a
+  // tree that is just a root leaf.
+  int height;
+
+  long long nodes;
+  long long keys;
+
+  // nodes_per_level[i] and keys_per_level[i] count the nodes and keys
+  // at depth i, where the root is at depth 0.
+  vector<long long> nodes_per_level;
+  vector<long long> keys_per_level;
+
+  // fill_histogram[i] is the number of nodes holding exactly i keys,
+  // for i in [0, BTREE_ORDER - 1].
+  long long fill_histogram[BTREE_ORDER];
+
+  // fill_factor is keys / (nodes * (BTREE_ORDER - 1)).
+  double fill_factor;
+
+  // bytes_per_key is the node memory (nodes * sizeof(btree)) divided by
+  // the number of keys. Allocator overhead is not included.
+  double bytes_per_key;
+};
+
+// compute_stats walks the tree rooted at 'root' and fills 'stats'.
+void compute_stats(btree* root, btree_stats* stats);
+
+// print_stats writes a human readable report of 'stats' to 'out'.
+void print_stats(ostream& out, const btree_stats& stats);
+
+#endif
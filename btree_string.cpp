@@ -0,0 +1,690 @@
+//
+// btree_string.cpp
+//
+
+#include <cstring>
+#include "btree_string.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+static_assert(sizeof(string_node) == STRING_NODE_BYTES, "string_node should be exactly one page");
+
+#define STRING_DATA_BYTES ((int) sizeof(((string_node*) 0)->data))
+
+// string_slot describes one key. The key's bytes (after the node's
+// prefix) are at data + offset; in an inner node they are followed by
+// the child pointer for the keys below this separator.
+struct string_slot {
+  unsigned short offset;
+  unsigned short length;
+  unsigned int head;
+};
+
+// has_fingerprints is true for a leaf of a tree with fingerprints. Its fingerprints take
+// the first STRING_FINGERPRINT_SLOTS bytes of 'data', and its slots come after them.
+bool has_fingerprints(string_node* node) {
+  return node->fingerprinted && node->is_leaf;
+}
+
+int slots_start(string_node* node) {
+  return has_fingerprints(node) ? STRING_FINGERPRINT_SLOTS : 0;
+}
+
+string_slot* node_slots(string_node* node) {
+  return (string_slot*) (node->data + slots_start(node));
+}
+
+// key_head packs the first four bytes of a key into an integer, most
+// significant byte first and zero-padded, so comparing heads orders
+// keys the same way memcmp does (ties need a full comparison).
+unsigned int key_head(const unsigned char* key, int length) {
+  unsigned int head = 0;
+  for (int i = 0; i < 4; i++) {
+    head = (head << 8) | (i < length ? key[i] : 0);
+  }
+  return head;
+}
+
+int compare_bytes(const unsigned char* a, int a_length, const unsigned char* b, int b_length) {
+  int common = a_length < b_length ? a_length : b_length;
+  int order = memcmp(a, b, common);
+  if (order != 0) {
+    return order;
+  }
+  return a_length - b_length;
+}
+
+// A search key, with the node's prefix already stripped.
+struct string_probe {
+  const unsigned char* bytes;
+  int length;
+  unsigned int head;
+};
+
+string_probe make_probe(string_node* node, const string& key) {
+  string_probe probe;
+  probe.bytes = (const unsigned char*) key.data() + node->prefix_length;
+  probe.length = key.size() - node->prefix_length;
+  probe.head = key_head(probe.bytes, probe.length);
+  return probe;
+}
+
+// compare_slot compares slot 'i' against the probe. The heads settle most comparisons
+// without touching the key bytes; when they tie, the first four bytes are known to be
+// equal, so the byte comparison starts after them.
+int compare_slot(string_node* node, int i, const string_probe& probe) {
+  string_slot& slot = node_slots(node)[i];
+  if (slot.head != probe.head) {
+    return slot.head < probe.head ? -1 : 1;
+  }
+  int skip = slot.length < 4 || probe.length < 4 ? 0 : 4;
+  return compare_bytes(node->data + slot.offset + skip, slot.length - skip, probe.bytes + skip,
+                       probe.length - skip);
+}
+
+// lower_bound returns the first slot not less than the probe; upper_bound returns the
+// first slot greater than it.
+int lower_bound(string_node* node, const string_probe& probe) {
+  int low = 0;
+  int high = node->count;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (compare_slot(node, middle, probe) < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+int upper_bound(string_node* node, const string_probe& probe) {
+  int low = 0;
+  int high = node->count;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (compare_slot(node, middle, probe) <= 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+string_node* slot_child(string_node* node, int i) {
+  string_slot& slot = node_slots(node)[i];
+  string_node* child;
+  memcpy(&child, node->data + slot.offset + slot.length, sizeof(child));
+  return child;
+}
+
+void set_slot_child(string_node* node, int i, string_node* child) {
+  string_slot& slot = node_slots(node)[i];
+  memcpy(node->data + slot.offset + slot.length, &child, sizeof(child));
+}
+
+// child_at returns child i of an inner node, where child 'count' is 'upper'.
+string_node* child_at(string_node* node, int i) {
+  return i < node->count ? slot_child(node, i) : node->upper;
+}
+
+string slot_key(string_node* node, int i) {
+  string_slot& slot = node_slots(node)[i];
+  const char* prefix = (const char*) node->data + (node->has_lower ? node->lower_offset : node->upper_offset);
+  string key(prefix, node->prefix_length);
+  key.append((const char*) node->data + slot.offset, slot.length);
+  return key;
+}
+
+int free_space(string_node* node) {
+  return node->heap_start - slots_start(node) - node->count * (int) sizeof(string_slot);
+}
+
+// key_fingerprint hashes a key (after the prefix) down to one byte (FNV-1a, folded).
+unsigned char key_fingerprint(const unsigned char* key, int length) {
+  unsigned int hash = 2166136261U;
+  for (int i = 0; i < length; i++) {
+    hash = (hash ^ key[i]) * 16777619U;
+  }
+  return (unsigned char) (hash ^ (hash >> 8) ^ (hash >> 16) ^ (hash >> 24));
+}
+
+// entry_bytes is the space a key of 'length' bytes (after the prefix) takes in a node.
+int entry_bytes(string_node* node, int length) {
+  return sizeof(string_slot) + length + (node->is_leaf ? 0 : sizeof(string_node*));
+}
+
+int heap_alloc(string_node* node, int bytes) {
+  node->heap_start -= bytes;
+  return node->heap_start;
+}
+
+// insert_slot puts a key (already stripped of the prefix) in at slot 'pos'. The caller
+// has made sure it fits.
+void insert_slot(string_node* node, int pos, const unsigned char* bytes, int length, string_node* child) {
+  int offset = heap_alloc(node, length + (node->is_leaf ? 0 : sizeof(child)));
+  memcpy(node->data + offset, bytes, length);
+
+  string_slot* slots = node_slots(node);
+  memmove(slots + pos + 1, slots + pos, (node->count - pos) * sizeof(string_slot));
+  slots[pos].offset = offset;
+  slots[pos].length = length;
+  slots[pos].head = key_head(bytes, length);
+  if (has_fingerprints(node)) {
+    memmove(node->data + pos + 1, node->data + pos, node->count - pos);
+    node->data[pos] = key_fingerprint(bytes, length);
+  }
+  node->count++;
+  if (!node->is_leaf) {
+    set_slot_child(node, pos, child);
+  }
+}
+
+// fence_prefix returns how many bytes every key between two fences shares: whatever the
+// fences have in common. A node on either edge of the tree has no such guarantee.
+int fence_prefix(const string* lower, const string* upper) {
+  if (lower == NULL || upper == NULL) {
+    return 0;
+  }
+  size_t common = 0;
+  while (common < lower->size() && common < upper->size() && (*lower)[common] == (*upper)[common]) {
+    common++;
+  }
+  return common;
+}
+
+// node_build lays a node out from scratch: its fences, the prefix they share, and then
+// 'keys' in order. For an inner node 'children' has one more entry than 'keys'; the last
+// one becomes 'upper'. This is how nodes are compacted and split.
+void node_build(string_node* node, bool is_leaf, const string* lower, const string* upper,
+                const vector<string>& keys, const vector<string_node*>& children,
+                size_t first, size_t last) {
+  node->is_leaf = is_leaf;
+  node->count = 0;
+  node->heap_start = STRING_DATA_BYTES;
+  node->upper = NULL;
+
+  node->has_lower = lower != NULL;
+  node->has_upper = upper != NULL;
+  node->lower_length = 0;
+  node->upper_length = 0;
+  if (lower != NULL) {
+    node->lower_length = lower->size();
+    node->lower_offset = heap_alloc(node, lower->size());
+    memcpy(node->data + node->lower_offset, lower->data(), lower->size());
+  }
+  if (upper != NULL) {
+    node->upper_length = upper->size();
+    node->upper_offset = heap_alloc(node, upper->size());
+    memcpy(node->data + node->upper_offset, upper->data(), upper->size());
+  }
+
+  node->prefix_length = fence_prefix(lower, upper);
+
+  for (size_t i = first; i < last; i++) {
+    const unsigned char* bytes = (const unsigned char*) keys[i].data() + node->prefix_length;
+    insert_slot(node, node->count, bytes, keys[i].size() - node->prefix_length,
+                is_leaf ? NULL : children[i]);
+  }
+  if (!is_leaf) {
+    node->upper = children[last];
+  }
+}
+
+// shortest_separator returns the shortest string s with left < s <= right: the bytes
+// the two keys share plus the first byte where 'right' differs.
+string shortest_separator(const string& left, const string& right) {
+  size_t common = 0;
+  while (common < left.size() && left[common] == right[common]) {
+    common++;
+  }
+  return right.substr(0, common + 1);
+}
+
+// place_entries rewrites a node that has run out of room with 'keys' (and, for an inner
+// node, 'children'). If they fit after squeezing out the holes left by removed keys, the
+// node is just compacted. Otherwise it is split near the middle of its bytes: the node
+// keeps the left half and the right half goes to a new node, returned through up_node
+// along with the separator between them in up_key.
+void place_entries(string_node* node, const vector<string>& keys, const vector<string_node*>& children,
+                   string& up_key, string_node*& up_node) {
+  string lower((const char*) node->data + node->lower_offset, node->lower_length);
+  string upper((const char*) node->data + node->upper_offset, node->upper_length);
+  const string* lower_fence = node->has_lower ? &lower : NULL;
+  const string* upper_fence = node->has_upper ? &upper : NULL;
+  bool is_leaf = node->is_leaf;
+
+  // Sizes are counted without the prefix, which is the same or longer after a split.
+  int total = lower.size() + upper.size();
+  for (size_t i = 0; i < keys.size(); i++) {
+    total += entry_bytes(node, keys[i].size() - node->prefix_length);
+  }
+  bool fits = total <= STRING_DATA_BYTES - slots_start(node);
+  if (has_fingerprints(node) && keys.size() > STRING_FINGERPRINT_SLOTS) {
+    fits = false;
+  }
+  if (fits) {
+    node_build(node, is_leaf, lower_fence, upper_fence, keys, children, 0, keys.size());
+    up_node = NULL;
+    return;
+  }
+
+  // Find the key where the first half of the bytes ends, keeping at least one key on
+  // each side (two for an inner node, which gives its middle key to the parent).
+  int half = 0;
+  size_t middle = 0;
+  while (middle < keys.size() && half < total / 2) {
+    half += entry_bytes(node, keys[middle].size() - node->prefix_length);
+    middle++;
+  }
+  size_t low_limit = 1;
+  size_t high_limit = is_leaf ? keys.size() - 1 : keys.size() - 2;
+  middle = middle < low_limit ? low_limit : middle > high_limit ? high_limit : middle;
+
+  up_node = new string_node;
+  up_node->fingerprinted = node->fingerprinted;
+  if (is_leaf) {
+    // The right leaf starts at keys[middle]; anything between the last key on the left
+    // and that one will do as a separator, so use the shortest.
+    up_key = shortest_separator(keys[middle - 1], keys[middle]);
+    node_build(up_node, true, &up_key, upper_fence, keys, children, middle, keys.size());
+    node_build(node, true, lower_fence, &up_key, keys, children, 0, middle);
+  } else {
+    // keys[middle] moves up; the children either side of it go left and right.
+    up_key = keys[middle];
+    vector<string_node*> right_children(children.begin() + middle + 1, children.end());
+    vector<string> right_keys(keys.begin() + middle + 1, keys.end());
+    node_build(up_node, false, &up_key, upper_fence, right_keys, right_children, 0, right_keys.size());
+    node_build(node, false, lower_fence, &up_key, keys, children, 0, middle);
+  }
+}
+
+// insert_into adds 'key' to the subtree rooted at 'node'. If 'node' has to split, the
+// new right sibling and the separator for it come back through up_node and up_key.
+// Returns false if the key was already there.
+bool insert_into(string_node* node, const string& key, string& up_key, string_node*& up_node) {
+  up_node = NULL;
+  string_probe probe = make_probe(node, key);
+
+  if (node->is_leaf) {
+    int pos = lower_bound(node, probe);
+    if (pos < node->count && compare_slot(node, pos, probe) == 0) {
+      return false;
+    }
+    bool has_room = free_space(node) >= entry_bytes(node, probe.length);
+    if (has_fingerprints(node) && node->count == STRING_FINGERPRINT_SLOTS) {
+      has_room = false;
+    }
+    if (has_room) {
+      insert_slot(node, pos, probe.bytes, probe.length, NULL);
+      return true;
+    }
+
+    vector<string> keys;
+    vector<string_node*> children;
+    for (int i = 0; i < node->count; i++) {
+      keys.push_back(slot_key(node, i));
+    }
+    keys.insert(keys.begin() + pos, key);
+    place_entries(node, keys, children, up_key, up_node);
+    return true;
+  }
+
+  int i = upper_bound(node, probe);
+  string_node* child = child_at(node, i);
+  string child_key;
+  string_node* child_sibling;
+  if (!insert_into(child, key, child_key, child_sibling)) {
+    return false;
+  }
+  if (child_sibling == NULL) {
+    return true;
+  }
+
+  // The child split. Its keys below child_key stay under a new separator at i, and the
+  // pointer that led to the child now leads to its new right sibling.
+  string_probe separator = make_probe(node, child_key);
+  if (free_space(node) >= entry_bytes(node, separator.length)) {
+    if (i < node->count) {
+      set_slot_child(node, i, child_sibling);
+    } else {
+      node->upper = child_sibling;
+    }
+    insert_slot(node, i, separator.bytes, separator.length, child);
+    return true;
+  }
+
+  vector<string> keys;
+  vector<string_node*> children;
+  for (int j = 0; j < node->count; j++) {
+    keys.push_back(slot_key(node, j));
+    children.push_back(slot_child(node, j));
+  }
+  children.push_back(node->upper);
+  keys.insert(keys.begin() + i, child_key);
+  children[i] = child_sibling;
+  children.insert(children.begin() + i, child);
+  place_entries(node, keys, children, up_key, up_node);
+  return true;
+}
+
+string_node* string_create(bool fingerprints) {
+  vector<string> keys;
+  vector<string_node*> children;
+  string_node* root = new string_node;
+  root->fingerprinted = fingerprints;
+  node_build(root, true, NULL, NULL, keys, children, 0, 0);
+  return root;
+}
+
+bool string_insert(string_node*& root, const string& key) {
+  if (key.size() > STRING_MAX_KEY) {
+    return false;
+  }
+
+  if (root == NULL) {
+    root = string_create(false);
+  }
+
+  string up_key;
+  string_node* up_node;
+  if (!insert_into(root, key, up_key, up_node)) {
+    return false;
+  }
+
+  // If the root split, put a new root above the two halves.
+  if (up_node != NULL) {
+    vector<string> keys(1, up_key);
+    vector<string_node*> children;
+    children.push_back(root);
+    children.push_back(up_node);
+    bool fingerprinted = root->fingerprinted;
+    root = new string_node;
+    root->fingerprinted = fingerprinted;
+    node_build(root, false, NULL, NULL, keys, children, 0, 1);
+  }
+  return true;
+}
+
+// find_leaf returns the leaf that holds, or would hold, 'key'.
+string_node* find_leaf(string_node* node, const string& key) {
+  while (!node->is_leaf) {
+    node = child_at(node, upper_bound(node, make_probe(node, key)));
+  }
+  return node;
+}
+
+// find_in_leaf returns the slot holding the probe's key, or -1 if there isn't one. With
+// fingerprints, the fingerprints are compared 16 at a time and only the slots that match
+// have their keys compared; otherwise it is a binary search.
+int find_in_leaf(string_node* leaf, const string_probe& probe) {
+  if (!has_fingerprints(leaf)) {
+    int pos = lower_bound(leaf, probe);
+    return pos < leaf->count && compare_slot(leaf, pos, probe) == 0 ? pos : -1;
+  }
+
+  unsigned char fingerprint = key_fingerprint(probe.bytes, probe.length);
+  for (int base = 0; base < leaf->count; base += 16) {
+    unsigned int matches = 0;
+#ifdef __SSE2__
+    __m128i lanes = _mm_loadu_si128((const __m128i*) (leaf->data + base));
+    matches = _mm_movemask_epi8(_mm_cmpeq_epi8(lanes, _mm_set1_epi8((char) fingerprint)));
+#else
+    for (int i = 0; i < 16; i++) {
+      matches |= (leaf->data[base + i] == fingerprint ? 1U : 0U) << i;
+    }
+#endif
+    // Lanes past the last slot hold leftovers.
+    if (leaf->count - base < 16) {
+      matches &= (1U << (leaf->count - base)) - 1;
+    }
+    for (int i = base; matches != 0; i++, matches >>= 1) {
+      if ((matches & 1) && compare_slot(leaf, i, probe) == 0) {
+        return i;
+      }
+    }
+  }
+  return -1;
+}
+
+bool string_contains(string_node* root, const string& key) {
+  if (root == NULL || key.size() > STRING_MAX_KEY) {
+    return false;
+  }
+  string_node* leaf = find_leaf(root, key);
+  return find_in_leaf(leaf, make_probe(leaf, key)) >= 0;
+}
+
+// remove_slot takes slot 'pos' out of a node. Its bytes (and, in an inner node, its child
+// pointer) stay in the heap until the node is next compacted.
+void remove_slot(string_node* node, int pos) {
+  string_slot* slots = node_slots(node);
+  memmove(slots + pos, slots + pos + 1, (node->count - pos - 1) * sizeof(string_slot));
+  if (has_fingerprints(node)) {
+    memmove(node->data + pos, node->data + pos + 1, node->count - pos - 1);
+  }
+  node->count--;
+}
+
+// subtree_empty is true for a leaf with no keys, or an inner node whose only child is empty.
+bool subtree_empty(string_node* node) {
+  while (!node->is_leaf && node->count == 0) {
+    node = node->upper;
+  }
+  return node->count == 0;
+}
+
+// node_fences copies a node's fences, with the one on the 'lower_side' (or the other
+// side) replaced by 'fence', which is NULL for the edge of the tree. 'lower' and 'upper'
+// end up pointing at the fences.
+void node_fences(string_node* node, bool lower_side, const string* fence, string& lower_copy,
+                 string& upper_copy, const string*& lower, const string*& upper) {
+  lower_copy.assign((const char*) node->data + node->lower_offset, node->lower_length);
+  upper_copy.assign((const char*) node->data + node->upper_offset, node->upper_length);
+  lower = lower_side ? fence : node->has_lower ? &lower_copy : NULL;
+  upper = !lower_side ? fence : node->has_upper ? &upper_copy : NULL;
+}
+
+// refence_fits returns true if 'node' still fits in its page with its fence on one side
+// moved out to 'fence', as do the nodes down that edge of its subtree, which share the
+// fence. A wider range can shorten the prefix, which lengthens every key.
+bool refence_fits(string_node* node, bool lower_side, const string* fence) {
+  string lower_copy;
+  string upper_copy;
+  const string* lower;
+  const string* upper;
+  node_fences(node, lower_side, fence, lower_copy, upper_copy, lower, upper);
+
+  int prefix = fence_prefix(lower, upper);
+  int total = (lower != NULL ? lower->size() : 0) + (upper != NULL ? upper->size() : 0);
+  for (int i = 0; i < node->count; i++) {
+    total += entry_bytes(node, node->prefix_length + node_slots(node)[i].length - prefix);
+  }
+  if (total > STRING_DATA_BYTES - slots_start(node)) {
+    return false;
+  }
+  return node->is_leaf || refence_fits(child_at(node, lower_side ? 0 : node->count), lower_side, fence);
+}
+
+// refence rebuilds 'node', and the nodes down that edge of its subtree, with the fence on
+// one side moved out to 'fence'. The caller has checked that they fit.
+void refence(string_node* node, bool lower_side, const string* fence) {
+  string lower_copy;
+  string upper_copy;
+  const string* lower;
+  const string* upper;
+  node_fences(node, lower_side, fence, lower_copy, upper_copy, lower, upper);
+
+  vector<string> keys;
+  vector<string_node*> children;
+  for (int i = 0; i < node->count; i++) {
+    keys.push_back(slot_key(node, i));
+    if (!node->is_leaf) {
+      children.push_back(slot_child(node, i));
+    }
+  }
+  if (!node->is_leaf) {
+    children.push_back(node->upper);
+    refence(child_at(node, lower_side ? 0 : node->count), lower_side, fence);
+  }
+  node_build(node, node->is_leaf, lower, upper, keys, children, 0, keys.size());
+}
+
+// unlink_child frees child i of an inner node with at least one separator, which is
+// empty, and drops a separator next to it. The child on the other side of that
+// separator takes over its range, moving its fence out to the child's. Returns false,
+// and leaves the child alone, if neither neighbour has room for that.
+bool unlink_child(string_node* node, int i) {
+  string_node* child = child_at(node, i);
+  string fence;
+  if (i < node->count) {
+    // The next child can start where this one did.
+    fence.assign((const char*) node->data + node->lower_offset, node->lower_length);
+    if (i > 0) {
+      fence = slot_key(node, i - 1);
+    }
+    const string* lower = i > 0 || node->has_lower ? &fence : NULL;
+    string_node* next = child_at(node, i + 1);
+    if (refence_fits(next, true, lower)) {
+      refence(next, true, lower);
+      remove_slot(node, i);
+      string_destroy(child);
+      return true;
+    }
+  }
+  if (i > 0) {
+    // The previous child can run to where this one did.
+    fence.assign((const char*) node->data + node->upper_offset, node->upper_length);
+    if (i < node->count) {
+      fence = slot_key(node, i);
+    }
+    const string* upper = i < node->count || node->has_upper ? &fence : NULL;
+    string_node* previous = slot_child(node, i - 1);
+    if (refence_fits(previous, false, upper)) {
+      refence(previous, false, upper);
+      remove_slot(node, i - 1);
+      if (i - 1 < node->count) {
+        set_slot_child(node, i - 1, previous);
+      } else {
+        node->upper = previous;
+      }
+      string_destroy(child);
+      return true;
+    }
+  }
+  return false;
+}
+
+// remove_from takes 'key' out of the subtree rooted at 'node'. Returns false if it
+// wasn't there.
+bool remove_from(string_node* node, const string& key) {
+  string_probe probe = make_probe(node, key);
+  if (node->is_leaf) {
+    int pos = find_in_leaf(node, probe);
+    if (pos < 0) {
+      return false;
+    }
+    remove_slot(node, pos);
+    return true;
+  }
+
+  string_node* child = child_at(node, upper_bound(node, probe));
+  if (!remove_from(child, key)) {
+    return false;
+  }
+
+  // The child is empty now, so free it, and any other empty children that couldn't be
+  // freed before, if their neighbours can take their ranges. An empty child next to
+  // another empty one always can. A node left with just one empty child is empty
+  // itself, for its parent to free in turn.
+  if (subtree_empty(child)) {
+    for (int i = 0; i <= node->count && node->count > 0;) {
+      if (!subtree_empty(child_at(node, i)) || !unlink_child(node, i)) {
+        i++;
+      }
+    }
+  }
+  return true;
+}
+
+bool string_remove(string_node*& root, const string& key) {
+  if (root == NULL || key.size() > STRING_MAX_KEY) {
+    return false;
+  }
+  if (!remove_from(root, key)) {
+    return false;
+  }
+
+  // A root left with one child hands the tree to it. The child has no fences either,
+  // since there are no separators left to bound it.
+  while (!root->is_leaf && root->count == 0) {
+    string_node* child = root->upper;
+    delete root;
+    root = child;
+  }
+  return true;
+}
+
+void string_keys(string_node* root, vector<string>& keys) {
+  if (root == NULL) {
+    return;
+  }
+  for (int i = 0; i < root->count; i++) {
+    if (root->is_leaf) {
+      keys.push_back(slot_key(root, i));
+    } else {
+      string_keys(slot_child(root, i), keys);
+    }
+  }
+  if (!root->is_leaf) {
+    string_keys(root->upper, keys);
+  }
+}
+
+long long string_count_keys(string_node* root) {
+  if (root == NULL) {
+    return 0;
+  }
+  if (root->is_leaf) {
+    return root->count;
+  }
+  long long count = string_count_keys(root->upper);
+  for (int i = 0; i < root->count; i++) {
+    count += string_count_keys(slot_child(root, i));
+  }
+  return count;
+}
+
+long long string_count_nodes(string_node* root) {
+  if (root == NULL) {
+    return 0;
+  }
+  if (root->is_leaf) {
+    return 1;
+  }
+  long long count = 1 + string_count_nodes(root->upper);
+  for (int i = 0; i < root->count; i++) {
+    count += string_count_nodes(slot_child(root, i));
+  }
+  return count;
+}
+
+void string_destroy(string_node*& root) {
+  if (root == NULL) {
+    return;
+  }
+  if (!root->is_leaf) {
+    for (int i = 0; i < root->count; i++) {
+      string_node* child = slot_child(root, i);
+      string_destroy(child);
+    }
+    string_destroy(root->upper);
+  }
+  delete root;
+  root = NULL;
+}
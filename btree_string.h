@@ -0,0 +1,128 @@
+//
+// btree_string.h
+//
+// A b-tree of variable-length string keys, such as URLs or composite
+// identifiers.
+//
+// The int tree's layout doesn't carry over: strings vary in length and
+// usually share long prefixes, so this is a B+-tree with its own node
+// format:
+//
+// -- Nodes are slotted pages of STRING_NODE_BYTES. An array of
+//    fixed-size slots grows from the front of the page and the key
+//    bytes grow from the back, so as many keys fit as their lengths
+//    allow.
+// -- Every node records the fence keys that bound it (the separators
+//    in its parent). All keys between two fences share the fences'
+//    common prefix, so it is stored once per node and stripped from
+//    every key in it.
+// -- Each slot holds the first four bytes of its key (after the
+//    prefix) as a "head" integer that orders the same way memcmp does,
+//    so most comparisons during a search never touch the key bytes.
+// -- Keys live only in the leaves. Inner nodes hold separators, cut to
+//    the shortest prefix that still separates the two leaves, which
+//    keeps them short and the fanout high.
+//
+// A tree made with string_create(true) also keeps a one-byte hash
+// "fingerprint" of every key in a leaf, FPTree style, in an array at
+// the front of the page. A point lookup compares all of them with the
+// lookup key's at 16 per SSE2 instruction and only compares keys whose
+// fingerprints match, instead of comparing keys at every step of a
+// binary search. The array takes STRING_FINGERPRINT_SLOTS bytes of
+// each page and caps a leaf at that many keys, so it pays off for
+// trees that mostly serve point lookups.
+//
+// Removal takes keys out of leaves. A leaf left empty is freed, along
+// with a separator next to it, and the sibling on the other side of
+// that separator takes over its range; an inner node left with no keys
+// below it goes the same way. The sibling's fence moves out, which can
+// shorten its prefix and lengthen its keys, so if neither sibling has
+// room for that the empty leaf stays until a sibling empties too.
+// Leaves that are only sparse aren't merged.
+
+#ifndef btree_string_h
+#define btree_string_h
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// The size of one node, header included.
+#define STRING_NODE_BYTES 4096
+
+// The longest key the tree accepts. Keys are limited so that any node
+// can always be split into two that fit.
+#define STRING_MAX_KEY 256
+
+// The most keys a leaf with fingerprints holds. A multiple of 16.
+#define STRING_FINGERPRINT_SLOTS 256
+
+// string_node is one slotted page. Its fields are for the
+// implementation; use the functions below.
+struct string_node {
+  bool is_leaf;
+
+  // has_lower and has_upper are false for a node on the left or right
+  // edge of the tree, which has no fence on that side.
+  bool has_lower;
+  bool has_upper;
+
+  // fingerprinted is set in every node of a tree with fingerprints.
+  bool fingerprinted;
+
+  // count is the number of slots.
+  unsigned short count;
+
+  // The bytes from heap_start to the end of 'data' hold the fences and
+  // the slots' key bytes. Removed keys leave holes there until the
+  // node is compacted.
+  unsigned short heap_start;
+
+  // prefix_length bytes at the start of the lower fence (or the upper
+  // fence, if there is no lower one) are shared by every key.
+  unsigned short prefix_length;
+
+  unsigned short lower_offset;
+  unsigned short lower_length;
+  unsigned short upper_offset;
+  unsigned short upper_length;
+
+  // In an inner node, child i holds the keys below separator i (and at
+  // or above separator i - 1), and 'upper' holds the keys at or above
+  // the last separator.
+  string_node* upper;
+
+  unsigned char data[STRING_NODE_BYTES - 32];
+};
+
+// string_create returns an empty tree, with fingerprints in its leaves
+// if 'fingerprints' is true.
+string_node* string_create(bool fingerprints);
+
+// string_insert adds 'key' to the tree rooted at 'root', creating the
+// tree (without fingerprints) if 'root' is NULL. Returns false, and leaves the tree alone, if
+// the key is already there or is longer than STRING_MAX_KEY.
+bool string_insert(string_node*& root, const string& key);
+
+// string_contains returns true if 'key' is in the tree.
+bool string_contains(string_node* root, const string& key);
+
+// string_remove takes 'key' out of the tree. Returns false if it wasn't
+// there.
+bool string_remove(string_node*& root, const string& key);
+
+// string_keys appends every key in the tree to 'keys', in ascending
+// (memcmp) order.
+void string_keys(string_node* root, vector<string>& keys);
+
+// string_count_keys returns the number of keys in the tree.
+long long string_count_keys(string_node* root);
+
+// string_count_nodes returns the number of nodes (pages) in the tree.
+long long string_count_nodes(string_node* root);
+
+// string_destroy frees every node in the tree and sets 'root' to NULL.
+void string_destroy(string_node*& root);
+
+#endif
@@ -7,8 +7,31 @@
 
 #include "btree.h"
 #include "btree_unittest_help.h"
+#include "btree_stats.h"
+#include "btree_trace.h"
+#include "btree_validate.h"
+#include "btree_setops.h"
+#include "btree_cursor.h"
+#include "btree_packed.h"
+#include "btree_string.h"
+#include "btree_keycode.h"
+#include "btree_multiset.h"
+#include "btree_bitmap.h"
+#include "btree_runs.h"
+#include "btree_filter.h"
+#include "btree_lookaside.h"
+#include "btree_frozen.h"
 #include <iostream>
+#include <sstream>
 #include <vector>
+#include <set>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <tuple>
+#include <thread>
 
 using namespace std;
 
@@ -119,6 +142,36 @@ TEST_CASE("B-Tree: Find not present key", "[find not present]") {
   REQUIRE(check_tree(small));
 }
 
+TEST_CASE("B-Tree: Lookup reports node, slot and presence", "[lookup]") {
+  btree* small = build_small();
+
+  // In a leaf.
+  btree_position position = lookup(small, 17);
+  REQUIRE(position.found);
+  REQUIRE(position.node == find(small, 17));
+  REQUIRE(position.node->keys[position.slot] == 17);
+
+  // In the root.
+  position = lookup(small, 10);
+  REQUIRE(position.found);
+  REQUIRE(position.node == small);
+  REQUIRE(small->keys[position.slot] == 10);
+
+  // Missing: the slot is where it would be inserted.
+  position = lookup(small, 21);
+  REQUIRE_FALSE(position.found);
+  REQUIRE(position.node == find(small, 21));
+  REQUIRE(position.node->is_leaf);
+  for (int i = 0; i < position.node->num_keys; i++) {
+    REQUIRE((position.node->keys[i] < 21) == (i < position.slot));
+  }
+
+  btree* empty = NULL;
+  position = lookup(empty, 1);
+  REQUIRE(position.node == NULL);
+  REQUIRE_FALSE(position.found);
+}
+
 TEST_CASE("B-Tree: Insert key into empty root", "[ins root empty]") {
   btree* empty = build_empty();
   insert(empty, 42);
@@ -319,4 +372,1629 @@ TEST_CASE("B-Tree: Remove key from internal node with at-min-capacity siblings",
   REQUIRE(leaves_ok);
   REQUIRE(check_tree(thrice));
   REQUIRE_FALSE(private_search_all(thrice, 24));  
-}
\ No newline at end of file
+}
+
+TEST_CASE("B-Tree: Random inserts and removes keep the invariants", "[random ins rm]") {
+  btree* root = NULL;
+  set<int> model;
+  unsigned int seed = 12345;
+  for (int i = 0; i < 2000; i++) {
+    seed = seed * 1103515245 + 12345;
+    int key = (seed >> 16) % 500;
+    if ((seed >> 8) % 3 == 0) {
+      remove(root, key);
+      model.erase(key);
+    } else {
+      insert(root, key);
+      model.insert(key);
+    }
+    REQUIRE(check_tree(root));
+  }
+  REQUIRE(count_keys(root) == (long long) model.size());
+  for (int key = 0; key < 500; key++) {
+    REQUIRE(private_search_all(root, key) == (model.count(key) == 1));
+  }
+  destroy(root);
+}
+
+TEST_CASE("B-Tree: Destroy frees the whole tree", "[destroy]") {
+  btree* thrice = build_thin_three_tier();
+  destroy(thrice);
+  REQUIRE(thrice == NULL);
+
+  btree* root = NULL;
+  destroy(root); // safe on an empty tree
+  REQUIRE(root == NULL);
+}
+
+TEST_CASE("B-Tree: Operation counters", "[counters]") {
+  btree_counters before;
+  btree_counters after;
+  read_counters(&before);
+
+  btree* root = NULL;
+  for (int i = 1; i <= 20; i++) {
+    insert(root, i);
+  }
+  remove(root, 10);
+  find(root, 7);
+
+  read_counters(&after);
+  REQUIRE(after.values[BTREE_INSERTS] - before.values[BTREE_INSERTS] == 20);
+  REQUIRE(after.values[BTREE_REMOVES] - before.values[BTREE_REMOVES] == 1);
+  REQUIRE(after.values[BTREE_FINDS] - before.values[BTREE_FINDS] == 1);
+  REQUIRE(after.values[BTREE_SPLITS] > before.values[BTREE_SPLITS]);
+  REQUIRE(after.values[BTREE_ROOT_GROWS] - before.values[BTREE_ROOT_GROWS] == 2);
+
+  unsigned long long live = 
+    (after.values[BTREE_NODES_ALLOCATED] - before.values[BTREE_NODES_ALLOCATED]) -
+    (after.values[BTREE_NODES_FREED] - before.values[BTREE_NODES_FREED]);
+  REQUIRE(live == (unsigned long long) count_nodes(root));
+
+  destroy(root);
+  REQUIRE(root == NULL);
+  read_counters(&after);
+  REQUIRE(after.values[BTREE_NODES_ALLOCATED] - before.values[BTREE_NODES_ALLOCATED] ==
+          after.values[BTREE_NODES_FREED] - before.values[BTREE_NODES_FREED]);
+}
+
+TEST_CASE("B-Tree: Structural stats", "[stats]") {
+  btree* thrice = build_thin_three_tier();
+  btree_stats stats;
+  compute_stats(thrice, &stats);
+
+  REQUIRE(stats.height == 3);
+  REQUIRE(stats.nodes == 9);
+  REQUIRE(stats.keys == 17);
+  REQUIRE(stats.nodes_per_level[0] == 1);
+  REQUIRE(stats.nodes_per_level[1] == 2);
+  REQUIRE(stats.nodes_per_level[2] == 6);
+  REQUIRE(stats.keys_per_level[2] == 12);
+  REQUIRE(stats.fill_histogram[1] == 1);
+  REQUIRE(stats.fill_histogram[2] == 8);
+  REQUIRE(stats.bytes_per_key == Approx(9.0 * sizeof(btree) / 17));
+
+  btree* empty = NULL;
+  compute_stats(empty, &stats);
+  REQUIRE(stats.height == 0);
+  REQUIRE(stats.keys == 0);
+}
+
+TEST_CASE("B-Tree: Remove does no I/O", "[rm quiet]") {
+  btree* thrice = build_thin_three_tier();
+  stringstream captured;
+  streambuf* old_buf = cout.rdbuf(captured.rdbuf());
+  remove(thrice, 16);
+  remove(thrice, 99);
+  cout.rdbuf(old_buf);
+
+  REQUIRE(captured.str().empty());
+  REQUIRE(check_tree(thrice));
+}
+
+TEST_CASE("B-Tree: Parallel validator agrees with check_tree", "[validate]") {
+  vector<btree*> trees;
+  trees.push_back(build_empty());
+  trees.push_back(build_small());
+  trees.push_back(build_two_tier());
+  trees.push_back(build_full_two_tier());
+  trees.push_back(build_thin_three_tier());
+  trees.push_back(build_broken());
+
+  for (size_t i = 0; i < trees.size(); i++) {
+    bool expected = check_tree(trees[i]);
+    REQUIRE(validate_tree(trees[i], 1, NULL) == expected);
+    REQUIRE(validate_tree(trees[i], 4, NULL) == expected);
+  }
+
+  btree_validation report;
+  REQUIRE_FALSE(validate_tree(trees[5], 4, &report));
+  REQUIRE(report.failure != NULL);
+  REQUIRE(report.failed_node == trees[5]->children[2]);
+}
+
+TEST_CASE("B-Tree: Parallel validator on a large tree", "[validate large]") {
+  btree* root = NULL;
+  for (int i = 0; i < 20000; i++) {
+    insert(root, (i * 7919) % 20000);
+  }
+
+  btree_validation report;
+  REQUIRE(validate_tree(root, 4, &report));
+  REQUIRE(report.keys == 20000);
+  REQUIRE(report.nodes == count_nodes(root));
+  int height = 0;
+  check_height(root, height);
+  REQUIRE(report.height == height + 1);
+
+  // Break the order deep in the tree: the rightmost leaf gets a key
+  // that belongs at the far left.
+  btree* leaf = root;
+  while (!leaf->is_leaf) {
+    leaf = leaf->children[leaf->num_keys];
+  }
+  int saved = leaf->keys[0];
+  leaf->keys[0] = -1;
+  REQUIRE_FALSE(validate_tree(root, 4, &report));
+  REQUIRE(report.failed_node == leaf);
+  leaf->keys[0] = saved;
+  REQUIRE(validate_tree(root, 4, NULL));
+
+  destroy(root);
+}
+
+TEST_CASE("B-Tree: Batch insert into existing trees", "[ins batch]") {
+  btree* empty = build_empty();
+  btree_key keys[] = { 3, 5, 9, 12, 15, 21, 22, 40 };
+  insert_batch(empty, keys, 8);
+  REQUIRE(check_tree(empty));
+  REQUIRE(count_keys(empty) == 8);
+  for (int i = 0; i < 8; i++) {
+    REQUIRE(private_contains(empty, keys[i]));
+  }
+
+  // Some of these are already in the tree, and 14 is repeated.
+  btree* thrice = build_thin_three_tier();
+  btree_key more[] = { 2, 4, 9, 10, 14, 14, 15, 18, 19, 20, 27, 28, 29 };
+  insert_batch(thrice, more, 13);
+  REQUIRE(check_tree(thrice));
+  REQUIRE(count_keys(thrice) == 17 + 9);
+  for (int i = 0; i < 13; i++) {
+    REQUIRE(private_contains(thrice, more[i]));
+  }
+  REQUIRE(private_contains(thrice, 26));
+
+  // An unsorted batch still works.
+  btree* small = build_small();
+  btree_key unsorted[] = { 30, 1, 16 };
+  insert_batch(small, unsorted, 3);
+  REQUIRE(check_tree(small));
+  REQUIRE(count_keys(small) == 11);
+}
+
+TEST_CASE("B-Tree: Large batch inserts", "[ins batch large]") {
+  btree* root = NULL;
+  vector<btree_key> batch;
+
+  // Interleave batches so later ones land between earlier keys.
+  for (int round = 0; round < 4; round++) {
+    batch.clear();
+    for (int i = 0; i < 2500; i++) {
+      batch.push_back(i * 4 + round);
+    }
+    insert_batch(root, &batch[0], batch.size());
+    REQUIRE(check_tree(root));
+    REQUIRE(count_keys(root) == 2500 * (round + 1));
+  }
+
+  for (int i = 0; i < 10000; i++) {
+    REQUIRE(private_contains(root, i));
+  }
+  destroy(root);
+}
+
+TEST_CASE("B-Tree: Batch remove from fixture trees", "[rm batch]") {
+  // Leaf keys, inner keys and a missing key, all in one batch.
+  btree* thrice = build_thin_three_tier();
+  btree_key gone[] = { 1, 4, 13, 15, 16, 24 };
+  remove_batch(thrice, gone, 6);
+  REQUIRE(check_tree(thrice));
+  REQUIRE(count_keys(thrice) == 17 - 5);
+  for (int i = 0; i < 6; i++) {
+    REQUIRE_FALSE(private_search_all(thrice, gone[i]));
+  }
+  REQUIRE(private_contains(thrice, 26));
+
+  // Emptying a whole subtree.
+  btree* two = build_two_tier();
+  btree_key left_half[] = { 5, 8, 10, 13, 15, 17, 19 };
+  remove_batch(two, left_half, 7);
+  REQUIRE(check_tree(two));
+  REQUIRE(count_keys(two) == 7);
+
+  // Emptying the whole tree leaves an empty root.
+  btree* small = build_small();
+  btree_key everything[] = { 2, 8, 10, 13, 17, 20, 24, 28 };
+  remove_batch(small, everything, 8);
+  REQUIRE(check_tree(small));
+  REQUIRE(small->is_leaf);
+  REQUIRE(count_keys(small) == 0);
+}
+
+TEST_CASE("B-Tree: Large batch removes", "[rm batch large]") {
+  btree* root = NULL;
+  set<int> expected;
+  for (int i = 0; i < 20000; i++) {
+    insert(root, i);
+    expected.insert(i);
+  }
+
+  // Dense and sparse batches, including runs that clear whole subtrees.
+  unsigned int seed = 7;
+  for (int round = 0; round < 20; round++) {
+    vector<btree_key> batch;
+    int start = (round * 997) % 20000;
+    int stride = 1 + round % 5;
+    for (int k = start; k < 20000 && batch.size() < 1500; k += stride) {
+      batch.push_back(k);
+    }
+    seed = seed * 1103515245 + 12345;
+    batch.push_back(20000 + seed % 100); // never present
+    sort(batch.begin(), batch.end());
+
+    remove_batch(root, &batch[0], batch.size());
+    for (size_t i = 0; i < batch.size(); i++) {
+      expected.erase(batch[i]);
+    }
+    REQUIRE(check_tree(root));
+    REQUIRE(count_keys(root) == (long long) expected.size());
+  }
+
+  for (int i = 0; i < 20000; i++) {
+    REQUIRE(private_contains(root, i) == (expected.count(i) == 1));
+  }
+  destroy(root);
+}
+
+TEST_CASE("B-Tree: Erase a key range", "[erase range]") {
+  // A range that takes out inner keys and whole leaves.
+  btree* thrice = build_thin_three_tier();
+  long long before = count_keys(thrice);
+  erase_range(thrice, 4, 16);
+  REQUIRE(check_tree(thrice));
+  for (int k = 4; k < 16; k++) {
+    REQUIRE_FALSE(private_search_all(thrice, k));
+  }
+  REQUIRE(private_contains(thrice, 16));
+  REQUIRE(count_keys(thrice) < before);
+
+  // An empty range and a range with no keys in it change nothing.
+  btree* small = build_small();
+  erase_range(small, 10, 10);
+  erase_range(small, 100, 200);
+  REQUIRE(count_keys(small) == 8);
+
+  // Everything.
+  erase_range(small, -1000, 1000);
+  REQUIRE(check_tree(small));
+  REQUIRE(small->is_leaf);
+  REQUIRE(count_keys(small) == 0);
+
+  btree* root = NULL;
+  set<int> expected;
+  for (int i = 0; i < 20000; i++) {
+    insert(root, i * 2);
+    expected.insert(i * 2);
+  }
+
+  // Ranges of every size, from within one leaf to most of the tree.
+  unsigned int seed = 11;
+  for (int round = 0; round < 40; round++) {
+    seed = seed * 1103515245 + 12345;
+    int lo = (seed >> 8) % 40000;
+    int width = 1 << (round % 16);
+    int hi = lo + width;
+
+    erase_range(root, lo, hi);
+    expected.erase(expected.lower_bound(lo), expected.lower_bound(hi));
+    REQUIRE(check_tree(root));
+    REQUIRE(count_keys(root) == (long long) expected.size());
+  }
+
+  for (int i = 0; i < 40000; i++) {
+    REQUIRE(private_contains(root, i) == (expected.count(i) == 1));
+  }
+  destroy(root);
+}
+
+TEST_CASE("B-Tree: Split and join trees", "[split join]") {
+  // Splitting at a key in an inner node sends it to the right.
+  btree* thrice = build_thin_three_tier();
+  long long total = count_keys(thrice);
+  btree* right = NULL;
+  split(thrice, 16, right);
+  REQUIRE(check_tree(thrice));
+  REQUIRE(check_tree(right));
+  REQUIRE(count_keys(thrice) + count_keys(right) == total);
+  REQUIRE(private_contains(right, 16));
+  REQUIRE_FALSE(private_search_all(thrice, 16));
+
+  join(thrice, right);
+  REQUIRE(right == NULL);
+  REQUIRE(check_tree(thrice));
+  REQUIRE(count_keys(thrice) == total);
+
+  // Trees of very different heights, split at every kind of point.
+  for (int cut = -1; cut <= 3001; cut += 97) {
+    btree* root = NULL;
+    for (int i = 0; i < 3000; i++) {
+      insert(root, i);
+    }
+    btree* upper = NULL;
+    split(root, cut, upper);
+    REQUIRE(check_tree(root));
+    REQUIRE(check_tree(upper));
+    REQUIRE(count_keys(root) == max(0, min(cut, 3000)));
+    REQUIRE(count_keys(upper) == 3000 - max(0, min(cut, 3000)));
+
+    // Join back with a small tree on one side and a big tree on the other.
+    btree* tail = NULL;
+    insert(tail, 5000);
+    insert(tail, 5001);
+    join(upper, tail);
+    join(root, upper);
+    REQUIRE(check_tree(root));
+    REQUIRE(count_keys(root) == 3002);
+    for (int i = 0; i < 3000; i++) {
+      REQUIRE(private_contains(root, i));
+    }
+    destroy(root);
+  }
+
+  // Overlapping ranges still join, by merging.
+  btree* evens = NULL;
+  btree* odds = NULL;
+  for (int i = 0; i < 200; i++) {
+    insert(evens, i * 2);
+    insert(odds, i * 2 + 1);
+  }
+  join(evens, odds);
+  REQUIRE(check_tree(evens));
+  REQUIRE(count_keys(evens) == 400);
+  destroy(evens);
+}
+
+TEST_CASE("B-Tree: Bulk build", "[build]") {
+  vector<btree_key> keys;
+  for (int i = 0; i < 10000; i++) {
+    keys.push_back(i * 3);
+  }
+  btree* root = build_tree(&keys[0], keys.size());
+  REQUIRE(check_tree(root));
+  REQUIRE(count_keys(root) == 10000);
+
+  // Built bottom-up, nearly every node is full.
+  btree_stats stats;
+  compute_stats(root, &stats);
+  REQUIRE(stats.fill_factor > 0.95);
+  destroy(root);
+
+  REQUIRE(build_tree(NULL, 0) == NULL);
+  btree_key unsorted[] = { 5, 1, 5, 3 };
+  btree* small = build_tree(unsorted, 4);
+  REQUIRE(check_tree(small));
+  REQUIRE(count_keys(small) == 3);
+  destroy(small);
+}
+
+TEST_CASE("B-Tree: Union, intersection and difference", "[setops]") {
+  // Multiples of 2 and multiples of 3, on one thread and on several.
+  btree* twos = NULL;
+  btree* threes = NULL;
+  for (int i = 0; i < 60000; i++) {
+    insert(twos, i * 2);
+    insert(threes, i * 3);
+  }
+
+  int thread_counts[] = { 1, 4 };
+  for (int t = 0; t < 2; t++) {
+    int threads = thread_counts[t];
+    btree* both = tree_union(twos, threes, threads);
+    btree* common = tree_intersection(twos, threes, threads);
+    btree* only_twos = tree_difference(twos, threes, threads);
+    REQUIRE(check_tree(both));
+    REQUIRE(check_tree(common));
+    REQUIRE(check_tree(only_twos));
+
+    for (int k = 0; k < 180000; k++) {
+      bool two = k % 2 == 0 && k < 120000;
+      bool three = k % 3 == 0;
+      REQUIRE(private_contains(both, k) == (two || three));
+      REQUIRE(private_contains(common, k) == (two && three));
+      REQUIRE(private_contains(only_twos, k) == (two && !three));
+    }
+    destroy(both);
+    destroy(common);
+    destroy(only_twos);
+  }
+
+  // A difference with nothing left in the middle ranges.
+  btree* middle = NULL;
+  for (int i = 10000; i < 50000; i++) {
+    insert(middle, i * 2);
+  }
+  btree* ends = tree_difference(twos, middle, 4);
+  REQUIRE(check_tree(ends));
+  REQUIRE(count_keys(ends) == 20000);
+  REQUIRE(private_contains(ends, 19998));
+  REQUIRE_FALSE(private_contains(ends, 20000));
+  REQUIRE(private_contains(ends, 100000));
+  destroy(ends);
+  destroy(middle);
+
+  // Empty inputs.
+  btree* none = NULL;
+  REQUIRE(tree_intersection(twos, none, 4) == NULL);
+  REQUIRE(tree_difference(none, twos, 4) == NULL);
+  btree* copy = tree_union(none, threes, 4);
+  REQUIRE(count_keys(copy) == 60000);
+
+  destroy(copy);
+  destroy(twos);
+  destroy(threes);
+}
+
+// Builds a tree of the even keys below 'count', for running on another thread.
+static void build_evens(btree** root, int count) {
+  for (int key = 0; key < count; key += 2) {
+    insert(*root, key);
+  }
+}
+
+// Removes every fourth key, looks one up through 'cursor' and then destroys the tree,
+// for running on another thread.
+static void thin_and_destroy(btree** root, int count, btree_cursor* cursor) {
+  for (int key = 0; key < count; key += 4) {
+    remove(*root, key);
+  }
+  find_hinted(*root, 2, cursor);
+  destroy(*root);
+}
+
+TEST_CASE("B-Tree: Hinted operations", "[cursor]") {
+  btree* root = NULL;
+  set<int> expected;
+  btree_cursor cursor;
+  cursor_reset(&cursor);
+
+  // Mostly small steps with the occasional jump, so the cursor is sometimes a leaf away
+  // and sometimes has to climb to the root.
+  unsigned int seed = 3;
+  int key = 5000;
+  for (int i = 0; i < 30000; i++) {
+    seed = seed * 1103515245 + 12345;
+    int step = (seed >> 16) % 100 == 0 ? (int) ((seed >> 4) % 10000) - 5000 : (int) ((seed >> 8) % 7) - 3;
+    key = max(0, min(10000, key + step));
+
+    switch ((seed >> 20) % 4) {
+    case 0:
+    case 1:
+      insert_hinted(root, key, &cursor);
+      expected.insert(key);
+      break;
+    case 2:
+      remove_hinted(root, key, &cursor);
+      expected.erase(key);
+      break;
+    case 3:
+      REQUIRE(find_hinted(root, key, &cursor) == find(root, key));
+      break;
+    }
+  }
+  REQUIRE(check_tree(root));
+  REQUIRE(count_keys(root) == (long long) expected.size());
+  for (int k = 0; k <= 10000; k++) {
+    REQUIRE(private_contains(root, k) == (expected.count(k) == 1));
+  }
+
+  // A cursor from another tree is ignored.
+  btree* other = NULL;
+  insert(other, 1);
+  REQUIRE(find_hinted(other, 1, &cursor) == other);
+
+  // Writes to another tree, frees included, leave this tree's epoch and cursors alone.
+  btree_cursor kept;
+  cursor_reset(&kept);
+  find_hinted(root, 5000, &kept);
+  unsigned int epoch = tree_epoch(root);
+  for (int k = 0; k < 1000; k++) {
+    insert(other, k);
+  }
+  for (int k = 0; k < 1000; k++) {
+    remove(other, k);
+  }
+  REQUIRE(tree_epoch(root) == epoch);
+  REQUIRE(kept.epoch == tree_epoch(root));
+  REQUIRE(find_hinted(root, 5001, &kept) == find(root, 5001));
+
+  // A tree destroyed and rebuilt, perhaps at the same address, starts at a new epoch.
+  epoch = tree_epoch(root);
+  destroy(root);
+  insert(root, 5001);
+  REQUIRE(tree_epoch(root) != epoch);
+  REQUIRE(find_hinted(root, 5001, &kept) == find(root, 5001));
+  destroy(root);
+
+  // The same goes for a tree built on one thread, changed and destroyed on a second and
+  // rebuilt on a third: none of the epochs the cursor has seen come back.
+  thread first(build_evens, &root, 10000);
+  first.join();
+  find_hinted(root, 5000, &kept);
+  unsigned int built = kept.epoch;
+  thread second(thin_and_destroy, &root, 10000, &kept);
+  second.join();
+  unsigned int thinned = kept.epoch;
+  REQUIRE(thinned != built);
+  thread third(build_evens, &root, 10000);
+  third.join();
+  REQUIRE(tree_epoch(root) != built);
+  REQUIRE(tree_epoch(root) != thinned);
+  for (int k = 0; k < 10000; k += 250) {
+    REQUIRE(find_hinted(root, k, &kept) == find(root, k));
+  }
+
+  destroy(root);
+  destroy(other);
+}
+
+TEST_CASE("B-Tree: Append increasing keys", "[append]") {
+  btree* root = NULL;
+  btree_cursor cursor;
+  cursor_reset(&cursor);
+  for (int i = 0; i < 20000; i++) {
+    append(root, i * 2, &cursor);
+  }
+  REQUIRE(check_tree(root));
+  REQUIRE(count_keys(root) == 20000);
+
+  // Topping up left siblings leaves the tree nearly full, where splitting in half would
+  // leave it about half full.
+  btree_stats stats;
+  compute_stats(root, &stats);
+  REQUIRE(stats.fill_factor > 0.9);
+
+  // Keys that aren't the largest still go in the right place, and appending carries on.
+  set<int> expected;
+  for (int i = 0; i < 20000; i++) {
+    expected.insert(i * 2);
+  }
+  for (int i = 0; i < 5000; i++) {
+    int key = i % 10 == 0 ? i * 7 + 1 : 40000 + i;
+    append(root, key, &cursor);
+    expected.insert(key);
+  }
+  insert(root, 50001);
+  expected.insert(50001);
+  append(root, 60000, &cursor);
+  expected.insert(60000);
+
+  REQUIRE(check_tree(root));
+  REQUIRE(count_keys(root) == (long long) expected.size());
+  for (set<int>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    REQUIRE(private_contains(root, *it));
+  }
+  destroy(root);
+}
+
+TEST_CASE("B-Tree: Packed snapshot", "[packed]") {
+  // Clusters of nearby IDs far apart from each other, so frames of every width turn up,
+  // along with the extremes of the key range.
+  btree* root = NULL;
+  set<int> expected;
+  unsigned int seed = 5;
+  int base = -2000000000;
+  for (int cluster = 0; cluster < 200; cluster++) {
+    seed = seed * 1103515245 + 12345;
+    base += 1000000 + (int) (seed % 10000000);
+    int spacing = 1 << (cluster % 12);
+    for (int i = 0; i < 100; i++) {
+      insert(root, base + i * spacing);
+      expected.insert(base + i * spacing);
+    }
+  }
+  insert(root, INT_MIN);
+  insert(root, INT_MAX);
+  expected.insert(INT_MIN);
+  expected.insert(INT_MAX);
+
+  btree_packed packed;
+  pack_tree(root, &packed);
+  REQUIRE(packed.keys == (long long) expected.size());
+  for (set<int>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    REQUIRE(packed_contains(packed, *it));
+    if (*it != INT_MAX && expected.count(*it + 1) == 0) {
+      REQUIRE_FALSE(packed_contains(packed, *it + 1));
+    }
+    if (*it != INT_MIN && expected.count(*it - 1) == 0) {
+      REQUIRE_FALSE(packed_contains(packed, *it - 1));
+    }
+  }
+
+  // Far smaller than the tree.
+  btree_stats stats;
+  compute_stats(root, &stats);
+  REQUIRE(packed_bytes(packed) * 4 < stats.nodes * sizeof(btree));
+
+  destroy(root);
+  pack_tree(root, &packed);
+  REQUIRE(packed.keys == 0);
+  REQUIRE_FALSE(packed_contains(packed, 0));
+}
+
+TEST_CASE("B-Tree: String keys", "[string keys]") {
+  // URL-like keys share long prefixes, which is what the nodes compress. Enough of them
+  // for a few levels of splits, inserted in a scrambled order.
+  string_node* root = NULL;
+  set<string> expected;
+  unsigned int seed = 11;
+  for (int i = 0; i < 20000; i++) {
+    seed = seed * 1103515245 + 12345;
+    ostringstream key;
+    key << "https://example.com/users/" << (seed >> 8) % 3000 << "/posts/" << (seed >> 4) % 97;
+    REQUIRE(string_insert(root, key.str()) == expected.insert(key.str()).second);
+  }
+  // Keys that are prefixes of each other, and bytes that aren't printable.
+  const char* odd[] = {"", "h", "https", "https://example.com/", "https://example.com/users/\xff"};
+  for (int i = 0; i < 5; i++) {
+    REQUIRE(string_insert(root, odd[i]) == expected.insert(odd[i]).second);
+  }
+  string with_nul("https://example.com/\0users", 26);
+  REQUIRE(string_insert(root, with_nul));
+  expected.insert(with_nul);
+
+  REQUIRE_FALSE(string_insert(root, "https://example.com/"));
+  REQUIRE_FALSE(string_insert(root, string(STRING_MAX_KEY + 1, 'x')));
+  REQUIRE(string_insert(root, string(STRING_MAX_KEY, 'x')));
+  expected.insert(string(STRING_MAX_KEY, 'x'));
+
+  vector<string> keys;
+  string_keys(root, keys);
+  REQUIRE(keys == vector<string>(expected.begin(), expected.end()));
+  REQUIRE(string_count_keys(root) == (long long) expected.size());
+  REQUIRE_FALSE(string_contains(root, "https://example.com/users"));
+  REQUIRE_FALSE(string_contains(root, "zzz"));
+
+  // Remove every other key, then put some back so nodes with holes in them fill up.
+  int i = 0;
+  for (set<string>::iterator it = expected.begin(); it != expected.end(); i++) {
+    if (i % 2 == 0) {
+      REQUIRE(string_remove(root, *it));
+      REQUIRE_FALSE(string_remove(root, *it));
+      expected.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  for (int j = 0; j < 5000; j++) {
+    ostringstream key;
+    key << "https://example.com/users/" << j % 3000 << "/posts/" << j;
+    REQUIRE(string_insert(root, key.str()) == expected.insert(key.str()).second);
+  }
+  keys.clear();
+  string_keys(root, keys);
+  REQUIRE(keys == vector<string>(expected.begin(), expected.end()));
+  for (set<string>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    REQUIRE(string_contains(root, *it));
+  }
+
+  // Removing a run of neighbouring keys empties whole leaves, which are freed. Keys either
+  // side of the gap, and new ones put in it, still turn up.
+  long long nodes = string_count_nodes(root);
+  set<string>::iterator gap_end = expected.lower_bound("https://example.com/users/2");
+  for (set<string>::iterator it = expected.lower_bound("https://example.com/users/1"); it != gap_end;) {
+    REQUIRE(string_remove(root, *it));
+    expected.erase(it++);
+  }
+  REQUIRE(string_count_nodes(root) < nodes * 3 / 4);
+  for (int j = 0; j < 300; j++) {
+    ostringstream key;
+    key << "https://example.com/users/1" << j * 7 << "/likes";
+    REQUIRE(string_insert(root, key.str()));
+    expected.insert(key.str());
+  }
+  keys.clear();
+  string_keys(root, keys);
+  REQUIRE(keys == vector<string>(expected.begin(), expected.end()));
+  for (set<string>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    REQUIRE(string_contains(root, *it));
+  }
+
+  // Removing every key, in a scrambled order, gives back every node but the root.
+  vector<string> order(expected.begin(), expected.end());
+  for (size_t j = order.size() - 1; j > 0; j--) {
+    seed = seed * 1103515245 + 12345;
+    swap(order[j], order[(seed >> 4) % (j + 1)]);
+  }
+  for (size_t j = 0; j < order.size(); j++) {
+    REQUIRE(string_remove(root, order[j]));
+    if (j % 1000 == 0) {
+      REQUIRE_FALSE(string_contains(root, order[j]));
+      for (size_t k = j + 1; k < order.size(); k += 97) {
+        REQUIRE(string_contains(root, order[k]));
+      }
+    }
+  }
+  REQUIRE(string_count_keys(root) == 0);
+  REQUIRE(string_count_nodes(root) == 1);
+  REQUIRE(string_insert(root, "https://example.com/"));
+  REQUIRE(string_contains(root, "https://example.com/"));
+
+  string_destroy(root);
+  REQUIRE(root == NULL);
+  REQUIRE_FALSE(string_contains(root, "h"));
+}
+
+TEST_CASE("B-Tree: String keys with fingerprints", "[string fingerprints]") {
+  // Short keys, so leaves fill up on fingerprint slots before bytes, and long keys with a
+  // shared prefix, so they fill up on bytes.
+  string_node* root = string_create(true);
+  set<string> expected;
+  unsigned int seed = 37;
+  for (int i = 0; i < 30000; i++) {
+    seed = seed * 1103515245 + 12345;
+    ostringstream key;
+    if (i % 2 == 0) {
+      key << (seed >> 8) % 50000;
+    } else {
+      key << "tenant/" << (seed >> 8) % 40 << "/object/" << string((seed >> 4) % 60, 'x') << i;
+    }
+    REQUIRE(string_insert(root, key.str()) == expected.insert(key.str()).second);
+  }
+  REQUIRE(root->fingerprinted);
+
+  vector<string> keys;
+  string_keys(root, keys);
+  REQUIRE(keys == vector<string>(expected.begin(), expected.end()));
+  for (int i = 0; i < 50000; i++) {
+    ostringstream key;
+    key << i;
+    REQUIRE(string_contains(root, key.str()) == (expected.count(key.str()) == 1));
+  }
+  REQUIRE_FALSE(string_contains(root, "tenant/1/object/"));
+
+  int i = 0;
+  for (set<string>::iterator it = expected.begin(); it != expected.end(); i++) {
+    if (i % 3 == 0) {
+      REQUIRE(string_remove(root, *it));
+      REQUIRE_FALSE(string_contains(root, *it));
+      expected.erase(it++);
+    } else {
+      REQUIRE(string_contains(root, *it));
+      ++it;
+    }
+  }
+  REQUIRE(string_count_keys(root) == (long long) expected.size());
+
+  // Emptying the tree leaves one leaf, still with fingerprints.
+  for (set<string>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    REQUIRE(string_remove(root, *it));
+  }
+  REQUIRE(string_count_nodes(root) == 1);
+  REQUIRE(root->fingerprinted);
+  REQUIRE(string_insert(root, "tenant/1/object/"));
+  REQUIRE(string_contains(root, "tenant/1/object/"));
+  string_destroy(root);
+}
+
+TEST_CASE("B-Tree: Normalized key encoding", "[key encoding]") {
+  // (tenant, timestamp, id) keys, with negative numbers, both zeros, infinities and ids
+  // that are prefixes of each other or hold zero bytes.
+  typedef tuple<int, double, string> composite;
+  int tenants[] = {INT_MIN, -7, -1, 0, 1, 42, INT_MAX};
+  double times[] = {-numeric_limits<double>::infinity(), -1e300, -2.5, -1e-310, 0.0, 1e-310, 1.5,
+                    1e300, numeric_limits<double>::infinity()};
+  string ids[] = {"", string(1, '\0'), string("\0\0", 2), "a", string("a\0", 2), "ab", "b\xff"};
+
+  vector<composite> logical;
+  for (int t = 0; t < 7; t++) {
+    for (int s = 0; s < 9; s++) {
+      for (int i = 0; i < 7; i++) {
+        logical.push_back(composite(tenants[t], times[s], ids[i]));
+      }
+    }
+  }
+
+  string_node* root = NULL;
+  for (size_t i = 0; i < logical.size(); i++) {
+    string key;
+    key_append_int32(key, get<0>(logical[i]));
+    key_append_double(key, get<1>(logical[i]));
+    key_append_string(key, get<2>(logical[i]));
+    REQUIRE(string_insert(root, key));
+  }
+
+  // The tree's byte order is the tuples' order, and every field decodes back.
+  sort(logical.begin(), logical.end());
+  vector<string> keys;
+  string_keys(root, keys);
+  REQUIRE(keys.size() == logical.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    key_reader reader = {&keys[i], 0};
+    int tenant;
+    double time;
+    string id;
+    REQUIRE(key_read_int32(&reader, tenant));
+    REQUIRE(key_read_double(&reader, time));
+    REQUIRE(key_read_string(&reader, id));
+    REQUIRE(reader.position == keys[i].size());
+    REQUIRE(composite(tenant, time, id) == logical[i]);
+  }
+  string_destroy(root);
+
+  // -0.0 is the same key as 0.0, and NaN sorts above infinity.
+  string zero, negative_zero, infinity, nan;
+  key_append_double(zero, 0.0);
+  key_append_double(negative_zero, -0.0);
+  key_append_double(infinity, numeric_limits<double>::infinity());
+  key_append_double(nan, -numeric_limits<double>::quiet_NaN());
+  REQUIRE(zero == negative_zero);
+  REQUIRE(infinity < nan);
+  key_reader reader = {&nan, 0};
+  double value;
+  REQUIRE(key_read_double(&reader, value));
+  REQUIRE(std::isnan(value));
+
+  // 64-bit fields keep their order too.
+  long long signed_values[] = {LLONG_MIN, -1, 0, 1, LLONG_MAX};
+  unsigned long long unsigned_values[] = {0, 1, 1ULL << 63, ULLONG_MAX};
+  for (int i = 0; i + 1 < 5; i++) {
+    string low, high;
+    key_append_int64(low, signed_values[i]);
+    key_append_int64(high, signed_values[i + 1]);
+    REQUIRE(low < high);
+    long long decoded;
+    key_reader signed_reader = {&low, 0};
+    REQUIRE(key_read_int64(&signed_reader, decoded));
+    REQUIRE(decoded == signed_values[i]);
+  }
+  for (int i = 0; i + 1 < 4; i++) {
+    string low, high;
+    key_append_uint64(low, unsigned_values[i]);
+    key_append_uint64(high, unsigned_values[i + 1]);
+    REQUIRE(low < high);
+  }
+
+  // Truncated or malformed fields are refused.
+  string truncated;
+  key_append_string(truncated, "abc");
+  truncated.resize(truncated.size() - 1);
+  key_reader bad = {&truncated, 0};
+  string id;
+  REQUIRE_FALSE(key_read_string(&bad, id));
+  string bad_escape("a\0\x01", 3);
+  key_reader escape_reader = {&bad_escape, 0};
+  REQUIRE_FALSE(key_read_string(&escape_reader, id));
+  string short_int(3, 'x');
+  key_reader int_reader = {&short_int, 0};
+  int tenant;
+  REQUIRE_FALSE(key_read_int32(&int_reader, tenant));
+  REQUIRE(int_reader.position == 0);
+}
+
+TEST_CASE("B-Tree: Multiset with posting lists", "[multiset]") {
+  // Most keys get a row or two, which stay inline; every tenth key gets dozens, and one
+  // hot key gets thousands, added out of order so rows land in the middle of its block.
+  multiset_node* root = NULL;
+  map<btree_key, set<long long> > expected;
+  unsigned int seed = 17;
+  for (int i = 0; i < 40000; i++) {
+    seed = seed * 1103515245 + 12345;
+    btree_key key = (seed >> 8) % 5000;
+    if (key % 10 == 0) {
+      key = 0;
+    } else if (key % 10 == 1) {
+      key = (key % 100) * 10 + 1;
+    }
+    long long row = (seed >> 4) % 100000;
+    REQUIRE(multiset_insert(root, key, row) == expected[key].insert(row).second);
+  }
+  // Rows in increasing order, which are appended to the block as they come.
+  for (long long row = 1000000; row < 1005000; row += 3) {
+    REQUIRE(multiset_insert(root, 7, row));
+    expected[7].insert(row);
+  }
+
+  long long rows = 0;
+  for (map<btree_key, set<long long> >::iterator it = expected.begin(); it != expected.end(); ++it) {
+    rows += it->second.size();
+  }
+  REQUIRE(multiset_count_keys(root) == (long long) expected.size());
+  REQUIRE(multiset_count_rows(root) == rows);
+  for (map<btree_key, set<long long> >::iterator it = expected.begin(); it != expected.end(); ++it) {
+    vector<long long> found;
+    REQUIRE(multiset_rows(root, it->first, found) == (long long) it->second.size());
+    REQUIRE(found == vector<long long>(it->second.begin(), it->second.end()));
+    REQUIRE(multiset_count(root, it->first) == (long long) it->second.size());
+  }
+  vector<long long> none;
+  REQUIRE(multiset_rows(root, -1, none) == 0);
+  REQUIRE(none.empty());
+
+  // Remove all but two rows of the hot key, so its list moves back inline, and every row
+  // of a few others, so they disappear.
+  vector<long long> hot(expected[0].begin(), expected[0].end());
+  for (size_t i = 2; i < hot.size(); i++) {
+    REQUIRE(multiset_remove(root, 0, hot[i]));
+    expected[0].erase(hot[i]);
+  }
+  REQUIRE_FALSE(multiset_remove(root, 0, hot.back()));
+  for (btree_key key = 2; key < 10; key++) {
+    set<long long> key_rows = expected[key];
+    for (set<long long>::iterator it = key_rows.begin(); it != key_rows.end(); ++it) {
+      REQUIRE(multiset_remove(root, key, *it));
+    }
+    expected.erase(key);
+    REQUIRE(multiset_count(root, key) == 0);
+  }
+  REQUIRE_FALSE(multiset_remove(root, 3, 0));
+
+  REQUIRE(multiset_count_keys(root) == (long long) expected.size());
+  for (map<btree_key, set<long long> >::iterator it = expected.begin(); it != expected.end(); ++it) {
+    vector<long long> found;
+    multiset_rows(root, it->first, found);
+    REQUIRE(found == vector<long long>(it->second.begin(), it->second.end()));
+  }
+
+  // Removing a run of neighbouring keys frees the leaves they were in, and removing every
+  // row of every key gives back the whole tree.
+  long long nodes = multiset_count_nodes(root);
+  for (btree_key key = 1000; key < 4000; key++) {
+    set<long long> key_rows = expected[key];
+    for (set<long long>::iterator it = key_rows.begin(); it != key_rows.end(); ++it) {
+      REQUIRE(multiset_remove(root, key, *it));
+    }
+    expected.erase(key);
+  }
+  REQUIRE(multiset_count_nodes(root) < nodes / 2);
+  REQUIRE(multiset_count_keys(root) == (long long) expected.size());
+  for (map<btree_key, set<long long> >::iterator it = expected.begin(); it != expected.end(); ++it) {
+    REQUIRE(multiset_count(root, it->first) == (long long) it->second.size());
+  }
+  for (map<btree_key, set<long long> >::iterator it = expected.begin(); it != expected.end(); ++it) {
+    for (set<long long>::iterator row = it->second.begin(); row != it->second.end(); ++row) {
+      REQUIRE(multiset_remove(root, it->first, *row));
+    }
+  }
+  REQUIRE(root == NULL);
+  REQUIRE(multiset_count_nodes(root) == 0);
+  REQUIRE(multiset_insert(root, 5, 1));
+  REQUIRE(multiset_count_nodes(root) == 1);
+
+  multiset_destroy(root);
+  REQUIRE(root == NULL);
+  REQUIRE(multiset_count(root, 0) == 0);
+}
+
+TEST_CASE("B-Tree: Bitmap windows", "[bitmap]") {
+  // Long runs of consecutive keys (some crossing zero and window edges) between
+  // scattered sparse keys.
+  btree* root = NULL;
+  set<btree_key> expected;
+  for (btree_key key = -70000; key < 20000; key++) {
+    insert(root, key);
+    expected.insert(key);
+  }
+  for (btree_key key = 200000; key < 260000; key += 2) {
+    insert(root, key);
+    expected.insert(key);
+  }
+  unsigned int seed = 23;
+  for (int i = 0; i < 3000; i++) {
+    seed = seed * 1103515245 + 12345;
+    btree_key key = (btree_key) (seed % 200000000) - 100000000;
+    insert(root, key);
+    expected.insert(key);
+  }
+
+  btree_bitmap built;
+  bitmap_from_tree(root, &built);
+  btree_bitmap grown;
+  bitmap_init(&grown);
+  for (set<btree_key>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    REQUIRE(bitmap_insert(&grown, *it));
+  }
+  REQUIRE_FALSE(bitmap_insert(&grown, 0));
+  REQUIRE(built.keys == (long long) expected.size());
+  REQUIRE(grown.keys == built.keys);
+
+  // The dense windows are bitmaps and the rest stay arrays.
+  vector<btree_key> built_starts;
+  vector<bool> built_dense;
+  bitmap_windows(built, built_starts, built_dense);
+  vector<btree_key> grown_starts;
+  vector<bool> grown_dense;
+  bitmap_windows(grown, grown_starts, grown_dense);
+  REQUIRE(grown_starts == built_starts);
+  REQUIRE(grown_dense == built_dense);
+  REQUIRE(count(built_dense.begin(), built_dense.end(), true) == 4);
+
+  long long rank = 0;
+  for (set<btree_key>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    REQUIRE(bitmap_contains(built, *it));
+    REQUIRE(bitmap_rank(built, *it) == rank);
+    REQUIRE(bitmap_rank(grown, *it) == rank);
+    if (expected.count(*it + 1) == 0) {
+      REQUIRE_FALSE(bitmap_contains(grown, *it + 1));
+      REQUIRE(bitmap_rank(grown, *it + 1) == rank + 1);
+    }
+    rank++;
+  }
+
+  // Far smaller than the tree for the dense parts.
+  btree_stats stats;
+  compute_stats(root, &stats);
+  REQUIRE(bitmap_bytes(built) * 4 < stats.nodes * sizeof(btree));
+
+  // Thinning out a dense window turns it back into an array; emptying one drops it.
+  for (btree_key key = 0; key < 20000; key++) {
+    if (key % 16 != 0) {
+      REQUIRE(bitmap_remove(&grown, key));
+      expected.erase(key);
+    }
+  }
+  REQUIRE_FALSE(bitmap_remove(&grown, 1));
+  for (btree_key key = 200000; key < 260000; key++) {
+    if (expected.erase(key) == 1) {
+      REQUIRE(bitmap_remove(&grown, key));
+    }
+  }
+  REQUIRE(grown.keys == (long long) expected.size());
+  grown_starts.clear();
+  grown_dense.clear();
+  bitmap_windows(grown, grown_starts, grown_dense);
+  REQUIRE(count(grown_dense.begin(), grown_dense.end(), true) == 2);
+  rank = 0;
+  for (set<btree_key>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    REQUIRE(bitmap_contains(grown, *it));
+    REQUIRE(bitmap_rank(grown, *it) == rank);
+    rank++;
+  }
+  REQUIRE_FALSE(bitmap_contains(grown, 200000));
+
+  // Dropping the scattered keys drops their windows from the window tree, and the
+  // counts on the way down still add up.
+  vector<btree_key> scattered;
+  for (set<btree_key>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    if (*it < -70000 || *it >= 260000) {
+      scattered.push_back(*it);
+    }
+  }
+  for (size_t i = 0; i < scattered.size(); i++) {
+    REQUIRE(bitmap_remove(&grown, scattered[i]));
+    expected.erase(scattered[i]);
+    if (i % 100 == 0) {
+      REQUIRE(bitmap_rank(grown, 0) == (long long) distance(expected.begin(), expected.lower_bound(0)));
+    }
+  }
+  grown_starts.clear();
+  grown_dense.clear();
+  bitmap_windows(grown, grown_starts, grown_dense);
+  set<btree_key> windows_left;
+  for (set<btree_key>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    windows_left.insert(*it - (*it & (BITMAP_WINDOW_KEYS - 1)));
+  }
+  REQUIRE(grown_starts == vector<btree_key>(windows_left.begin(), windows_left.end()));
+  rank = 0;
+  for (set<btree_key>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    REQUIRE(bitmap_rank(grown, *it) == rank);
+    rank++;
+  }
+
+  // Emptying the set frees the whole window tree.
+  for (set<btree_key>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    REQUIRE(bitmap_remove(&grown, *it));
+  }
+  REQUIRE(grown.keys == 0);
+  REQUIRE(grown.root == NULL);
+  REQUIRE(bitmap_rank(grown, 5) == 0);
+
+  bitmap_destroy(&built);
+  bitmap_destroy(&grown);
+  destroy(root);
+}
+
+TEST_CASE("B-Tree: Run-length set", "[runs]") {
+  // Blocks of consecutive keys, some added a key at a time in scrambled order so runs
+  // grow from both ends and join up, plus random single keys and removals.
+  run_node* root = NULL;
+  set<btree_key> expected;
+  for (int block = 0; block < 50; block++) {
+    btree_key first = block * 1000;
+    int length = 100 + block * 7;
+    for (int i = 0; i < length; i++) {
+      // 1009 is a prime larger than any block, so this visits each key once.
+      btree_key key = first + (i * 1009) % length;
+      REQUIRE(run_insert(root, key) == expected.insert(key).second);
+    }
+  }
+  REQUIRE(run_count_runs(root) == 50);
+
+  run_insert_range(root, 100000, 1099999);
+  run_insert_range(root, 1099990, 1100009);
+  for (btree_key key = 100000; key < 1100010; key++) {
+    expected.insert(key);
+  }
+  REQUIRE(run_count_runs(root) == 51);
+  REQUIRE(run_count_keys(root) == (long long) expected.size());
+
+  unsigned int seed = 29;
+  for (int i = 0; i < 20000; i++) {
+    seed = seed * 1103515245 + 12345;
+    btree_key key = (seed >> 8) % 60000;
+    if (seed & 1) {
+      REQUIRE(run_insert(root, key) == expected.insert(key).second);
+    } else {
+      REQUIRE(run_remove(root, key) == (expected.erase(key) == 1));
+    }
+  }
+  run_remove_range(root, 500000, 599999);
+  run_remove_range(root, 20500, 30500);
+  expected.erase(expected.lower_bound(500000), expected.upper_bound(599999));
+  expected.erase(expected.lower_bound(20500), expected.upper_bound(30500));
+
+  // Count the maximal runs expected should have been stored as.
+  long long runs = 0;
+  btree_key previous = 0;
+  for (set<btree_key>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    if (it == expected.begin() || *it != previous + 1) {
+      runs++;
+    }
+    previous = *it;
+  }
+  REQUIRE(run_count_runs(root) == runs);
+  REQUIRE(run_count_keys(root) == (long long) expected.size());
+  for (btree_key key = -10; key < 1100020; key++) {
+    REQUIRE(run_contains(root, key) == (expected.count(key) == 1));
+  }
+
+  // The extremes of the key range.
+  run_node* edges = NULL;
+  btree_key lowest = numeric_limits<btree_key>::min();
+  btree_key highest = numeric_limits<btree_key>::max();
+  run_insert_range(edges, lowest, lowest + 2);
+  run_insert_range(edges, highest - 2, highest);
+  REQUIRE(run_insert(edges, lowest + 3));
+  REQUIRE(run_count_runs(edges) == 2);
+  REQUIRE(run_contains(edges, lowest));
+  REQUIRE(run_contains(edges, highest));
+  REQUIRE(run_remove(edges, highest));
+  REQUIRE_FALSE(run_contains(edges, highest));
+  run_remove_range(edges, lowest, highest);
+  REQUIRE(run_count_runs(edges) == 0);
+  REQUIRE(edges == NULL);
+
+  // Thousands of single-key runs whittled down to a few leave no empty nodes behind.
+  run_node* sparse = NULL;
+  for (btree_key key = 0; key < 20000; key += 2) {
+    REQUIRE(run_insert(sparse, key));
+  }
+  REQUIRE(run_count_nodes(sparse) > 1000);
+  for (btree_key key = 0; key < 20000; key += 2) {
+    if (key % 2000 != 0) {
+      REQUIRE(run_remove(sparse, key));
+    }
+  }
+  REQUIRE(run_count_runs(sparse) == 10);
+  REQUIRE(run_count_nodes(sparse) < 20);
+  for (btree_key key = -1; key < 20000; key++) {
+    REQUIRE(run_contains(sparse, key) == (key >= 0 && key % 2000 == 0));
+  }
+  run_insert_range(sparse, 0, 19999);
+  REQUIRE(run_count_runs(sparse) == 1);
+  REQUIRE(run_count_nodes(sparse) == 1);
+  run_remove_range(sparse, 0, 19999);
+  REQUIRE(sparse == NULL);
+
+  run_destroy(root);
+  run_destroy(edges);
+  REQUIRE(root == NULL);
+}
+
+TEST_CASE("B-Tree: Bloom filter front", "[filter]") {
+  btree* root = NULL;
+  set<btree_key> expected;
+  unsigned int seed = 31;
+  for (int i = 0; i < 20000; i++) {
+    seed = seed * 1103515245 + 12345;
+    btree_key key = (seed >> 4) % 1000000;
+    insert(root, key);
+    expected.insert(key);
+  }
+
+  // No false negatives, and few false positives.
+  btree_filter filter;
+  filter_build(root, &filter);
+  int false_positives = 0;
+  for (btree_key key = 0; key < 1000000; key++) {
+    bool present = expected.count(key) == 1;
+    if (present) {
+      REQUIRE(filter_may_contain(filter, key));
+    } else if (filter_may_contain(filter, key)) {
+      false_positives++;
+    }
+    REQUIRE(filtered_contains(root, filter, key) == present);
+  }
+  REQUIRE(false_positives < (1000000 - (int) expected.size()) / 50);
+
+  // Grow the tree well past what the filter was sized for and remove most of the
+  // original keys; the filter is rebuilt along the way and never gives a wrong answer.
+  for (int i = 0; i < 60000; i++) {
+    seed = seed * 1103515245 + 12345;
+    btree_key key = (seed >> 4) % 1000000 + 1000000;
+    filtered_insert(root, &filter, key);
+    expected.insert(key);
+    REQUIRE(filtered_contains(root, filter, key));
+  }
+  REQUIRE(filter.capacity > 60000);
+  vector<btree_key> original(expected.begin(), expected.lower_bound(1000000));
+  for (size_t i = 0; i < original.size(); i += 2) {
+    filtered_remove(root, &filter, original[i]);
+    expected.erase(original[i]);
+  }
+  REQUIRE(filter.removed <= filter.added / 4 + 64);
+
+  // Adding a key that's there or removing one that isn't leaves the counts alone.
+  long long added = filter.added;
+  long long removed = filter.removed;
+  for (size_t i = 1; i < original.size(); i += 2) {
+    filtered_insert(root, &filter, original[i]);
+    filtered_remove(root, &filter, original[i - 1]);
+  }
+  REQUIRE(filter.added == added);
+  REQUIRE(filter.removed == removed);
+  false_positives = 0;
+  for (btree_key key = 0; key < 2000000; key++) {
+    bool present = expected.count(key) == 1;
+    REQUIRE(filtered_contains(root, filter, key) == present);
+    if (!present && filter_may_contain(filter, key)) {
+      false_positives++;
+    }
+  }
+  REQUIRE(false_positives < (2000000 - (int) expected.size()) / 50);
+
+  destroy(root);
+  filter_build(root, &filter);
+  REQUIRE_FALSE(filtered_contains(root, filter, 5));
+}
+
+TEST_CASE("B-Tree: Hot-key lookaside table", "[lookaside]") {
+  btree* root = NULL;
+  set<btree_key> expected;
+  for (btree_key key = 0; key < 20000; key += 2) {
+    insert(root, key);
+    expected.insert(key);
+  }
+  btree_lookaside cache;
+  lookaside_init(&cache, 256);
+
+  // Finds that mostly go to 64 hot keys spread over the tree, mixed with inserts and
+  // removes anywhere that shift keys around, split nodes and merge them (and sometimes
+  // remove a hot key). Every answer must match a plain lookup.
+  unsigned int seed = 7;
+  for (int i = 0; i < 200000; i++) {
+    seed = seed * 1103515245 + 12345;
+    btree_key r = (seed >> 4) % 20000;
+    if (i % 7 == 3) {
+      insert(root, r | 1);
+      expected.insert(r | 1);
+    } else if (i % 11 == 5) {
+      remove(root, r);
+      expected.erase(r);
+    } else {
+      btree_key key = r % 10 == 0 ? r : r % 64 * 308;
+      btree_position position = cached_lookup(root, &cache, key);
+      btree_position plain = lookup(root, key);
+      REQUIRE(position.found == (expected.count(key) == 1));
+      REQUIRE(position.node == plain.node);
+      REQUIRE(position.slot == plain.slot);
+    }
+  }
+
+  // Inserts don't free nodes, so with no removes the hot keys are nearly always answered
+  // from the table, even as the inserts shift them along.
+  for (btree_key key = 0; key < 64 * 308; key += 308) {
+    insert(root, key);
+    expected.insert(key);
+  }
+  long long hits = cache.hits;
+  long long misses = cache.misses;
+  for (int i = 0; i < 20000; i++) {
+    seed = seed * 1103515245 + 12345;
+    btree_key r = (seed >> 4) % 20000;
+    if (i % 7 == 3) {
+      insert(root, r | 1);
+      expected.insert(r | 1);
+    } else {
+      btree_key key = r % 64 * 308;
+      btree_position position = cached_lookup(root, &cache, key);
+      btree_position plain = lookup(root, key);
+      REQUIRE(position.found == (expected.count(key) == 1));
+      REQUIRE(position.node == plain.node);
+      REQUIRE(position.slot == plain.slot);
+    }
+  }
+  REQUIRE(cache.hits - hits > 4 * (cache.misses - misses));
+
+  // Removes through the table free nodes as well, but the table keeps every entry their
+  // merges and root collapses didn't touch, so the hot keys stay cached while most of the
+  // keys around them (and now and then a hot key) go.
+  long long nodes = count_nodes(root);
+  hits = cache.hits;
+  misses = cache.misses;
+  for (int i = 0; i < 40000; i++) {
+    seed = seed * 1103515245 + 12345;
+    btree_key r = (seed >> 4) % 20000;
+    if (i % 2 == 0) {
+      btree_key key = r % 308 != 0 || i % 100 == 0 ? r : r + 1;
+      cached_remove(root, &cache, key);
+      expected.erase(key);
+    } else {
+      btree_key key = r % 64 * 308;
+      btree_position position = cached_lookup(root, &cache, key);
+      btree_position plain = lookup(root, key);
+      REQUIRE(position.found == (expected.count(key) == 1));
+      REQUIRE(position.node == plain.node);
+      REQUIRE(position.slot == plain.slot);
+    }
+  }
+  REQUIRE(count_nodes(root) < nodes / 2);
+  REQUIRE(cache.hits - hits > 4 * (cache.misses - misses));
+
+  // Keys split off into another tree, or freed along with it, are never found.
+  btree* right = NULL;
+  split(root, 32 * 308, right);
+  for (btree_key key = 0; key < 64 * 308; key += 308) {
+    REQUIRE(cached_lookup(root, &cache, key).found == (key < 32 * 308 && expected.count(key) == 1));
+  }
+  join(root, right);
+  for (btree_key key = 0; key < 64 * 308; key += 308) {
+    REQUIRE(cached_lookup(root, &cache, key).found == (expected.count(key) == 1));
+  }
+  destroy(root);
+  for (btree_key key = 0; key < 64 * 308; key += 308) {
+    REQUIRE_FALSE(cached_lookup(root, &cache, key).found);
+  }
+
+  // A new tree, perhaps at the old root's address, starts at an epoch no entry has.
+  for (btree_key key = 0; key < 64 * 308; key += 308) {
+    insert(root, key);
+  }
+  for (btree_key key = 0; key < 64 * 308; key += 308) {
+    btree_position position = cached_lookup(root, &cache, key);
+    btree_position plain = lookup(root, key);
+    REQUIRE(position.found);
+    REQUIRE(position.node == plain.node);
+    REQUIRE(position.slot == plain.slot);
+  }
+  destroy(root);
+
+  // Likewise across threads: the table holds entries from a tree built on one thread and
+  // then thinned on a second, which destroys it, and a third builds the next tree.
+  thread first(build_evens, &root, 20000);
+  first.join();
+  for (btree_key key = 0; key < 64 * 308; key += 308) {
+    cached_lookup(root, &cache, key);
+  }
+  btree_cursor unused;
+  cursor_reset(&unused);
+  thread second(thin_and_destroy, &root, 20000, &unused);
+  second.join();
+  thread third(build_evens, &root, 20000);
+  third.join();
+  for (btree_key key = 0; key < 64 * 308; key += 308) {
+    btree_position position = cached_lookup(root, &cache, key);
+    btree_position plain = lookup(root, key);
+    REQUIRE(position.found == (key % 2 == 0));
+    REQUIRE(position.node == plain.node);
+    REQUIRE(position.slot == plain.slot);
+  }
+  destroy(root);
+  lookaside_free(&cache);
+}
+
+TEST_CASE("B-Tree: Frozen snapshot", "[frozen]") {
+  // Sizes around whole blocks and whole levels, so partly filled blocks and missing
+  // children turn up at every depth, and keys at both ends of the range.
+  int sizes[] = {0, 1, 15, 16, 17, 200, 289, 290, 4913, 5000, 30000};
+  for (int s = 0; s < 11; s++) {
+    btree* root = NULL;
+    vector<btree_key> expected;
+    unsigned int seed = 17 + s;
+    set<btree_key> keys;
+    while ((int) keys.size() < sizes[s]) {
+      seed = seed * 1103515245 + 12345;
+      keys.insert((btree_key) (seed >> 1) - 1000000000);
+    }
+    if (sizes[s] > 1) {
+      keys.insert(numeric_limits<btree_key>::min());
+      keys.insert(numeric_limits<btree_key>::max());
+    }
+    for (set<btree_key>::iterator it = keys.begin(); it != keys.end(); ++it) {
+      insert(root, *it);
+      expected.push_back(*it);
+    }
+
+    btree_frozen frozen;
+    freeze(root, &frozen);
+    REQUIRE(frozen.num_keys == (long long) expected.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+      REQUIRE(frozen_lower_bound(frozen, expected[i]) == (long long) i);
+      REQUIRE(frozen_contains(frozen, expected[i]));
+      if (expected[i] != numeric_limits<btree_key>::max()) {
+        btree_key next = expected[i] + 1;
+        long long position = lower_bound(expected.begin(), expected.end(), next) - expected.begin();
+        REQUIRE(frozen_lower_bound(frozen, next) == position);
+        REQUIRE(frozen_contains(frozen, next) == (position < (long long) expected.size() && expected[position] == next));
+      }
+    }
+    REQUIRE(frozen_contains(frozen, 12345) == (keys.count(12345) == 1));
+
+    // Range scans match the keys in the same range.
+    for (int i = 0; i < 20; i++) {
+      seed = seed * 1103515245 + 12345;
+      btree_key lo = (btree_key) (seed >> 1) - 1000000000;
+      btree_key hi = lo + (btree_key) (seed % 100000000);
+      vector<btree_key> scanned;
+      frozen_scan(frozen, lo, hi, scanned);
+      vector<btree_key> wanted(lower_bound(expected.begin(), expected.end(), lo),
+                               upper_bound(expected.begin(), expected.end(), hi));
+      REQUIRE(scanned == wanted);
+    }
+
+    // Far smaller than the tree.
+    if (sizes[s] >= 200) {
+      btree_stats stats;
+      compute_stats(root, &stats);
+      REQUIRE(frozen_bytes(frozen) * 3 < stats.nodes * sizeof(btree));
+    }
+    frozen_free(&frozen);
+    destroy(root);
+  }
+}
+
+TEST_CASE("B-Tree: Relayout in van Emde Boas order", "[relayout]") {
+  btree* root = NULL;
+  set<btree_key> expected;
+  unsigned int seed = 23;
+  for (int i = 0; i < 30000; i++) {
+    seed = seed * 1103515245 + 12345;
+    btree_key key = (seed >> 4) % 50000;
+    if (i % 3 == 2) {
+      remove(root, key);
+      expected.erase(key);
+    } else {
+      insert(root, key);
+      expected.insert(key);
+    }
+  }
+
+  btree_counters before;
+  read_counters(&before);
+  long long nodes = count_nodes(root);
+  relayout(root);
+  REQUIRE(check_tree(root));
+  REQUIRE(count_nodes(root) == nodes);
+  REQUIRE(count_keys(root) == (long long) expected.size());
+  for (set<btree_key>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    REQUIRE(lookup(root, *it).found);
+  }
+
+  // Every node came out of a page-aligned block, numbered from one within it. All the
+  // blocks but the last are full, the root starts the first, and its first child is right
+  // behind it.
+  vector<btree*> pending(1, root);
+  int block_nodes = 0;
+  long long blocks = 0;
+  while (!pending.empty()) {
+    btree* node = pending.back();
+    pending.pop_back();
+    REQUIRE(node->block_slot >= 1);
+    REQUIRE((size_t) (node - (node->block_slot - 1)) % 4096 == 0);
+    block_nodes = max(block_nodes, (int) node->block_slot);
+    blocks += node->block_slot == 1;
+    for (int i = 0; !node->is_leaf && i <= node->num_keys; i++) {
+      pending.push_back(node->children[i]);
+    }
+  }
+  REQUIRE(block_nodes > 1);
+  REQUIRE(blocks == (nodes + block_nodes - 1) / block_nodes);
+  REQUIRE(root->block_slot == 1);
+  REQUIRE(root->children[0] == root + 1);
+
+  // The tree keeps working, and laying it out again frees each block of the first layout
+  // once its last node goes.
+  for (int i = 0; i < 20000; i++) {
+    seed = seed * 1103515245 + 12345;
+    btree_key key = (seed >> 4) % 50000;
+    if (i % 2 == 0) {
+      remove(root, key);
+      expected.erase(key);
+    } else {
+      insert(root, key);
+      expected.insert(key);
+    }
+    if (i == 10000) {
+      relayout(root);
+    }
+  }
+  REQUIRE(check_tree(root));
+  REQUIRE(count_keys(root) == (long long) expected.size());
+  for (set<btree_key>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    REQUIRE(lookup(root, *it).found);
+  }
+
+  destroy(root);
+  btree_counters after;
+  read_counters(&after);
+  REQUIRE(after.values[BTREE_NODES_ALLOCATED] - before.values[BTREE_NODES_ALLOCATED] ==
+          after.values[BTREE_NODES_FREED] - before.values[BTREE_NODES_FREED] - nodes);
+  relayout(root);
+  REQUIRE(root == NULL);
+}
+
+#if BTREE_TRACE_LEVEL >= BTREE_TRACE_EVENTS
+TEST_CASE("B-Tree: Trace records structural events", "[trace]") {
+  trace_clear();
+  btree* full = build_full_leaf_root();
+  insert(full, 15); // splits the root
+
+  stringstream dump;
+  trace_dump(dump);
+  REQUIRE(dump.str().find("split") != string::npos);
+  REQUIRE(dump.str().find("root_grow") != string::npos);
+  REQUIRE(dump.str().find("key=20") != string::npos);
+}
+#endif
+
+#ifdef BTREE_KEY64
+TEST_CASE("B-Tree: 64-bit keys", "[key64]") {
+  // Keys spread across the whole 64-bit range, so none of them fit in an int and many
+  // differ only in their high bits.
+  btree* root = NULL;
+  set<btree_key> expected;
+  unsigned long long seed = 3;
+  for (int i = 0; i < 20000; i++) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    btree_key key = (btree_key) (seed & ~0xffULL);
+    insert(root, key);
+    expected.insert(key);
+  }
+  REQUIRE(check_tree(root));
+  REQUIRE(count_keys(root) == (long long) expected.size());
+  for (set<btree_key>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    REQUIRE(lookup(root, *it).found);
+    REQUIRE_FALSE(lookup(root, *it + 1).found);
+  }
+
+  // Cut out everything between -2^62 and 2^62, then split at zero and join back.
+  btree_key lo = -(1LL << 62);
+  btree_key hi = 1LL << 62;
+  erase_range(root, lo, hi);
+  expected.erase(expected.lower_bound(lo), expected.lower_bound(hi));
+  REQUIRE(check_tree(root));
+  REQUIRE(count_keys(root) == (long long) expected.size());
+  btree* right;
+  split(root, 0, right);
+  REQUIRE(count_keys(root) + count_keys(right) == (long long) expected.size());
+  join(root, right);
+  REQUIRE(check_tree(root));
+  REQUIRE(count_keys(root) == (long long) expected.size());
+  for (set<btree_key>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    REQUIRE(lookup(root, *it).found);
+  }
+
+  // Clusters 2^40 apart make the snapshot use 64-bit frames as well as narrow ones.
+  destroy(root);
+  expected.clear();
+  for (int cluster = 0; cluster < 20; cluster++) {
+    for (int i = 0; i < 50; i++) {
+      btree_key key = ((btree_key) cluster << 40) + (i % 3 == 0 ? (btree_key) i << 34 : i);
+      insert(root, key);
+      expected.insert(key);
+    }
+  }
+  btree_packed packed;
+  pack_tree(root, &packed);
+  bool wide = false;
+  for (size_t i = 0; i < packed.frames.size(); i++) {
+    wide = wide || packed.frames[i].width == 8;
+  }
+  REQUIRE(wide);
+  for (set<btree_key>::iterator it = expected.begin(); it != expected.end(); ++it) {
+    REQUIRE(packed_contains(packed, *it));
+    btree_key high_neighbour = *it + (1LL << 32);
+    REQUIRE(packed_contains(packed, high_neighbour) == (expected.count(high_neighbour) == 1));
+  }
+  destroy(root);
+}
+#endif
@@ -0,0 +1,76 @@
+//
+// btree_trace.cpp
+//
+
+#include <atomic>
+#include "btree_trace.h"
+
+using namespace std;
+
+const char* trace_event_name(trace_event_type type) {
+  switch (type) {
+  case TRACE_INSERT:
+    return "insert";
+  case TRACE_REMOVE:
+    return "remove";
+  case TRACE_FIND:
+    return "find";
+  case TRACE_SPLIT:
+    return "split";
+  case TRACE_MERGE:
+    return "merge";
+  case TRACE_ROTATE_LEFT:
+    return "rotate_left";
+  case TRACE_ROTATE_RIGHT:
+    return "rotate_right";
+  case TRACE_ROOT_GROW:
+    return "root_grow";
+  case TRACE_ROOT_SHRINK:
+    return "root_shrink";
+  }
+  return "unknown";
+}
+
+#if BTREE_TRACE_LEVEL > BTREE_TRACE_OFF
+
+static trace_event trace_buffer[BTREE_TRACE_CAPACITY];
+
+// trace_next is the sequence number the next event will get. Event n
+// lives in slot n % BTREE_TRACE_CAPACITY.
+static atomic<unsigned long long> trace_next(0);
+
+void trace_record(trace_event_type type, const void* node, btree_key key) {
+  unsigned long long sequence = trace_next.fetch_add(1, memory_order_relaxed);
+  trace_event& event = trace_buffer[sequence % BTREE_TRACE_CAPACITY];
+  event.sequence = sequence;
+  event.type = type;
+  event.node = node;
+  event.key = key;
+}
+
+void trace_dump(ostream& out) {
+  unsigned long long end = trace_next.load(memory_order_relaxed);
+  unsigned long long start = end > BTREE_TRACE_CAPACITY ? end - BTREE_TRACE_CAPACITY : 0;
+
+  out << "btree trace: " << end - start << " of " << end << " events" << endl;
+  for (unsigned long long i = start; i < end; i++) {
+    const trace_event& event = trace_buffer[i % BTREE_TRACE_CAPACITY];
+    out << "#" << event.sequence << " " << trace_event_name(event.type)
+        << " node=" << event.node << " key=" << event.key << endl;
+  }
+}
+
+void trace_clear() {
+  trace_next.store(0, memory_order_relaxed);
+}
+
+#else
+
+void trace_dump(ostream& out) {
+  out << "btree trace: compiled out (BTREE_TRACE_LEVEL=0)" << endl;
+}
+
+void trace_clear() {
+}
+
+#endif
@@ -0,0 +1,93 @@
+//
+// btree_trace.h
+//
+// Compile-time tracing. BTREE_TRACE_LEVEL picks how much gets
+// recorded, and it defaults to off, so in a normal build every
+// BTREE_TRACE call compiles to nothing. Build with, for example,
+//
+//   make CPPFLAGS=-DBTREE_TRACE_LEVEL=1
+//
+// to record structural events. Events go into a fixed-size ring buffer
+// in memory; nothing is written anywhere until someone calls
+// trace_dump.
+
+#ifndef btree_trace_h
+#define btree_trace_h
+
+#include <iostream>
+#include "btree.h"
+
+using namespace std;
+
+// Trace levels. Each level records everything the levels below it do.
+#define BTREE_TRACE_OFF 0
+// Splits, merges, rotations and root grows/shrinks.
+#define BTREE_TRACE_EVENTS 1
+// Additionally every insert, remove and find call.
+#define BTREE_TRACE_OPS 2
+
+#ifndef BTREE_TRACE_LEVEL
+#define BTREE_TRACE_LEVEL BTREE_TRACE_OFF
+#endif
+
+// The number of events the ring buffer holds before it starts
+// overwriting the oldest ones.
+#ifndef BTREE_TRACE_CAPACITY
+#define BTREE_TRACE_CAPACITY 4096
+#endif
+
+enum trace_event_type {
+  TRACE_INSERT,
+  TRACE_REMOVE,
+  TRACE_FIND,
+  TRACE_SPLIT,
+  TRACE_MERGE,
+  TRACE_ROTATE_LEFT,
+  TRACE_ROTATE_RIGHT,
+  TRACE_ROOT_GROW,
+  TRACE_ROOT_SHRINK
+};
+
+// trace_event is one entry in the ring buffer. 'key' is the key the
+// operation was called with, or for structural events the key that
+// moved between levels: the median for a split, the separator for a
+// merge or rotation.
+struct trace_event {
+  unsigned long long sequence;
+  trace_event_type type;
+  const void* node;
+  btree_key key;
+};
+
+#if BTREE_TRACE_LEVEL > BTREE_TRACE_OFF
+
+// trace_record appends an event to the ring buffer. Threads claim
+// slots with one atomic increment; if two threads lap the buffer at
+// the same time an entry can be torn, which is acceptable for a
+// debugging aid.
+void trace_record(trace_event_type type, const void* node, btree_key key);
+
+#define BTREE_TRACE(level, type, node, key)           \
+  do {                                                \
+    if ((level) <= BTREE_TRACE_LEVEL) {               \
+      trace_record((type), (node), (key));            \
+    }                                                 \
+  } while (0)
+
+#else
+
+#define BTREE_TRACE(level, type, node, key) do { } while (0)
+
+#endif
+
+// trace_dump writes the buffered events, oldest first, to 'out'. In a
+// build with tracing off it just says so.
+void trace_dump(ostream& out);
+
+// trace_clear throws away all buffered events.
+void trace_clear();
+
+// trace_event_name returns a short name for an event type.
+const char* trace_event_name(trace_event_type type);
+
+#endif
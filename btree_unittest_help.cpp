@@ -9,6 +9,7 @@
 #include <sstream>
 #include <string>
 #include <climits>
+#include <limits>
 #include <cmath>
 #include "btree_unittest_help.h"
 #include "btree.h"
@@ -21,6 +22,8 @@ btree* init_node() {
   btree* ret = new btree;
   ret->num_keys = 0;
   ret->is_leaf = true;
+  ret->block_slot = 0;
+  ret->epoch = 0;
   for (int i=0; i <= BTREE_ORDER; i++) {
     ret->children[i] = NULL;
   }
@@ -277,7 +280,7 @@ void check_invariants(invariants* &invars, btree* &node, bool is_root) {
   } else {
     // A node's keys are kept in ascending order, starting at index 0.
     invars->ascending = true;
-    int prev = INT_MIN;
+    btree_key prev = numeric_limits<btree_key>::min();
     for (int i=0; i < node->num_keys; i++) {
       if (node->keys[i] <= prev) {
 	invars->ascending = false;
@@ -314,7 +317,8 @@ void check_invariants(invariants* &invars, btree* &node, bool is_root) {
     //  child_key_order = false;
     invars->child_key_order = true;
     if (is_root && !node->is_leaf) {
-      invars->child_key_order = check_node_key_range(node, INT_MIN, INT_MAX, true);
+      invars->child_key_order = check_node_key_range(node, numeric_limits<btree_key>::min(),
+							   numeric_limits<btree_key>::max(), true);
     }
 
     if (any_false(invars)) {
@@ -362,7 +366,7 @@ bool check_height(btree* &node, int &result_height) {
   return same;
 }
 
-void check_size(btree* &node, int &result_nodes, int &result_keys, bool is_root) {
+void check_size(btree* &node, long long &result_nodes, long long &result_keys, bool is_root) {
   if (is_root) {
     result_nodes = 0;
     result_keys = 0;
@@ -379,7 +383,7 @@ void check_size(btree* &node, int &result_nodes, int &result_keys, bool is_root)
   }
 }
 
-bool check_node_key_range(btree* &node, int low, int high, bool recurse) {
+bool check_node_key_range(btree* &node, btree_key low, btree_key high, bool recurse) {
 
   for (int i=0; i < node->num_keys; i++) {
     if (node->keys[i] <= low || // key is out of low range
@@ -417,7 +421,7 @@ bool any_false(invariants* &invars) {
   return !wrong;
 }
 
-bool private_contains(btree* &node, int key) {
+bool private_contains(btree* &node, btree_key key) {
   if (node == NULL) {
     return false;
   }
@@ -436,7 +440,7 @@ bool private_contains(btree* &node, int key) {
 }
 
 
-bool private_search_all(btree*& node, int key) {
+bool private_search_all(btree*& node, btree_key key) {
   if (private_contains(node, key)) {
     return true; // found it here!
   }
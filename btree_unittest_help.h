@@ -60,17 +60,17 @@ void check_leaf_height(btree* &node, vector<int> &depth, int current_depth);
 
 bool check_height(btree* &node, int &result_height);
 
-void check_size(btree* &node, int &result_nodes, int &result_keys, bool is_root);
+void check_size(btree* &node, long long &result_nodes, long long &result_keys, bool is_root);
 
-bool check_node_key_range(btree* &node, int low, int high, bool recurse);
+bool check_node_key_range(btree* &node, btree_key low, btree_key high, bool recurse);
 
 bool any_false(invariants* &invars);
 
 btree* load_tree_from_file(string &filename);
 
-bool private_contains(btree* &node, int key);
+bool private_contains(btree* &node, btree_key key);
 
 // private_search_all looks at every node in the tree for the given
 // key and returns true when it finds it, or false if it doesn't.
-bool private_search_all(btree*& node, int key);
+bool private_search_all(btree*& node, btree_key key);
 
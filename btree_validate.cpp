@@ -0,0 +1,255 @@
+//
+// btree_validate.cpp
+//
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "btree_validate.h"
+
+using namespace std;
+
+// No valid tree is anywhere near this deep, so hitting it means the
+// child links loop back on themselves.
+#define VALIDATE_MAX_DEPTH 128
+
+// key_bounds holds the open interval (low, high) that keys in a
+// subtree must fall in. The root's subtree is unbounded on both sides.
+struct key_bounds {
+  btree_key low;
+  btree_key high;
+  bool has_low;
+  bool has_high;
+};
+
+// validate_task is a subtree handed to a worker thread.
+struct validate_task {
+  btree* node;
+  key_bounds bounds;
+  int depth;
+};
+
+struct validate_state {
+  // leaf_depth is the depth of the leftmost leaf; every other leaf
+  // must be at the same depth.
+  int leaf_depth;
+
+  // failed is set as soon as any thread finds a violation, so the
+  // others can stop early.
+  atomic<bool> failed;
+
+  mutex failure_lock;
+  const char* failure;
+  btree* failed_node;
+};
+
+struct subtree_totals {
+  long long nodes;
+  long long keys;
+};
+
+void record_failure(validate_state* state, btree* node, const char* failure) {
+  lock_guard<mutex> guard(state->failure_lock);
+  if (!state->failed.load(memory_order_relaxed)) {
+    state->failure = failure;
+    state->failed_node = node;
+    state->failed.store(true, memory_order_relaxed);
+  }
+}
+
+key_bounds child_bounds(btree* node, int child_index, const key_bounds& bounds) {
+  key_bounds child = bounds;
+  if (child_index > 0) {
+    child.low = node->keys[child_index - 1];
+    child.has_low = true;
+  }
+  if (child_index < node->num_keys) {
+    child.high = node->keys[child_index];
+    child.has_high = true;
+  }
+  return child;
+}
+
+// check_node checks every invariant that can be decided from the node
+// itself and the bounds it inherited from its ancestors.
+bool check_node(btree* node, const key_bounds& bounds, int depth, bool is_root, validate_state* state) {
+  if (node->num_keys < 0 || node->num_keys > BTREE_ORDER - 1) {
+    record_failure(state, node, "node has too many keys");
+    return false;
+  }
+  if (!is_root && node->num_keys < (BTREE_ORDER - 1) / 2) {
+    record_failure(state, node, "non-root node has too few keys");
+    return false;
+  }
+  if (is_root && !node->is_leaf && node->num_keys < 1) {
+    record_failure(state, node, "non-leaf root has fewer than two children");
+    return false;
+  }
+  if (node->is_leaf != (depth == state->leaf_depth)) {
+    record_failure(state, node, "leaves are not all at the same depth");
+    return false;
+  }
+
+  for (int i = 0; i < node->num_keys; i++) {
+    if (i > 0 && node->keys[i] <= node->keys[i - 1]) {
+      record_failure(state, node, "keys are not in ascending order");
+      return false;
+    }
+    if ((bounds.has_low && node->keys[i] <= bounds.low) ||
+        (bounds.has_high && node->keys[i] >= bounds.high)) {
+      record_failure(state, node, "key is outside the range of its parent's separators");
+      return false;
+    }
+  }
+
+  if (!node->is_leaf) {
+    for (int i = 0; i <= node->num_keys; i++) {
+      if (node->children[i] == NULL) {
+        record_failure(state, node, "inner node has a NULL child");
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool validate_subtree(btree* node, const key_bounds& bounds, int depth, bool is_root,
+                      validate_state* state, subtree_totals* totals) {
+  if (state->failed.load(memory_order_relaxed)) {
+    return false;
+  }
+  if (!check_node(node, bounds, depth, is_root, state)) {
+    return false;
+  }
+
+  totals->nodes++;
+  totals->keys += node->num_keys;
+
+  if (!node->is_leaf) {
+    for (int i = 0; i <= node->num_keys; i++) {
+      key_bounds child = child_bounds(node, i, bounds);
+      if (!validate_subtree(node->children[i], child, depth + 1, false, state, totals)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void validate_worker(vector<validate_task>* tasks, atomic<size_t>* next_task,
+                     validate_state* state, subtree_totals* totals) {
+  while (!state->failed.load(memory_order_relaxed)) {
+    size_t index = next_task->fetch_add(1, memory_order_relaxed);
+    if (index >= tasks->size()) {
+      return;
+    }
+    validate_task& task = (*tasks)[index];
+    validate_subtree(task.node, task.bounds, task.depth, false, state, totals);
+  }
+}
+
+void fill_report(btree_validation* report, validate_state* state, const subtree_totals& totals) {
+  if (report == NULL) {
+    return;
+  }
+  report->valid = !state->failed.load(memory_order_relaxed);
+  report->failure = report->valid ? NULL : state->failure;
+  report->failed_node = report->valid ? NULL : state->failed_node;
+  report->height = state->leaf_depth + 1;
+  report->nodes = totals.nodes;
+  report->keys = totals.keys;
+}
+
+bool validate_tree(btree* root, int threads, btree_validation* report) {
+  validate_state state;
+  state.failed.store(false, memory_order_relaxed);
+  state.failure = NULL;
+  state.failed_node = NULL;
+  state.leaf_depth = -1;
+
+  subtree_totals totals;
+  totals.nodes = 0;
+  totals.keys = 0;
+
+  if (root == NULL) {
+    fill_report(report, &state, totals);
+    return true;
+  }
+
+  // Find the depth every leaf should be at by walking the leftmost path.
+  btree* node = root;
+  state.leaf_depth = 0;
+  while (!node->is_leaf) {
+    if (node->children[0] == NULL || state.leaf_depth >= VALIDATE_MAX_DEPTH) {
+      record_failure(&state, node, "leftmost path does not end in a leaf");
+      fill_report(report, &state, totals);
+      return false;
+    }
+    node = node->children[0];
+    state.leaf_depth++;
+  }
+
+  if (threads <= 0) {
+    threads = thread::hardware_concurrency();
+  }
+  if (threads <= 1) {
+    key_bounds unbounded = { 0, 0, false, false };
+    validate_subtree(root, unbounded, 0, true, &state, &totals);
+    fill_report(report, &state, totals);
+    return !state.failed.load(memory_order_relaxed);
+  }
+
+  // Check the top of the tree level by level on this thread until a
+  // level has enough subtrees to keep every worker busy, then hand that
+  // level out as tasks. Each node is still checked exactly once.
+  vector<validate_task> level;
+  validate_task top = { root, { 0, 0, false, false }, 0 };
+  level.push_back(top);
+  size_t wanted_tasks = 8 * (size_t) threads;
+
+  while (level.size() < wanted_tasks && level[0].depth < state.leaf_depth) {
+    vector<validate_task> next_level;
+    for (size_t i = 0; i < level.size(); i++) {
+      validate_task& task = level[i];
+      if (!check_node(task.node, task.bounds, task.depth, task.node == root, &state)) {
+        fill_report(report, &state, totals);
+        return false;
+      }
+      totals.nodes++;
+      totals.keys += task.node->num_keys;
+
+      for (int c = 0; c <= task.node->num_keys; c++) {
+        validate_task child = { task.node->children[c], child_bounds(task.node, c, task.bounds), task.depth + 1 };
+        next_level.push_back(child);
+      }
+    }
+    level.swap(next_level);
+  }
+
+  // If the whole tree is smaller than the frontier we wanted, the
+  // remaining level is the root itself or the leaves; either way one
+  // task per node is fine.
+  int workers = threads < (int) level.size() ? threads : (int) level.size();
+  vector<subtree_totals> worker_totals(workers);
+  vector<thread> pool;
+  atomic<size_t> next_task(0);
+
+  if (level.size() == 1 && level[0].node == root) {
+    validate_subtree(root, level[0].bounds, 0, true, &state, &totals);
+  } else {
+    for (int i = 0; i < workers; i++) {
+      worker_totals[i].nodes = 0;
+      worker_totals[i].keys = 0;
+      pool.push_back(thread(validate_worker, &level, &next_task, &state, &worker_totals[i]));
+    }
+    for (int i = 0; i < workers; i++) {
+      pool[i].join();
+      totals.nodes += worker_totals[i].nodes;
+      totals.keys += worker_totals[i].keys;
+    }
+  }
+
+  fill_report(report, &state, totals);
+  return !state.failed.load(memory_order_relaxed);
+}
@@ -0,0 +1,53 @@
+//
+// btree_validate.h
+//
+// A single-pass, multi-threaded invariant checker for large trees.
+//
+// check_tree (btree_unittest_help.h) makes several recursive passes and
+// runs on one thread, which is fine for unit tests but takes minutes on
+// a tree with 100M keys. validate_tree checks the same invariants while
+// visiting each node exactly once, and hands disjoint subtrees to a
+// pool of worker threads.
+
+#ifndef btree_validate_h
+#define btree_validate_h
+
+#include "btree.h"
+
+// btree_validation reports what validate_tree found.
+struct btree_validation {
+  // valid is true if every invariant holds.
+  bool valid;
+
+  // failure describes the first violation a worker ran into, or is
+  // NULL when the tree is valid. With several threads, which violation
+  // is "first" is not deterministic.
+  const char* failure;
+
+  // failed_node is the node where 'failure' was found.
+  btree* failed_node;
+
+  // height, nodes and keys describe the tree. They are only meaningful
+  // when valid is true.
+  int height;
+  long long nodes;
+  long long keys;
+};
+
+// validate_tree checks that the tree rooted at 'root' satisfies every
+// b-tree invariant:
+//
+// -- keys in each node are strictly ascending,
+// -- every key lies between the separators that lead to its node,
+// -- no node has more than BTREE_ORDER - 1 keys,
+// -- non-root nodes have at least round_up(BTREE_ORDER/2) - 1 keys,
+// -- a non-leaf root has at least one key,
+// -- inner nodes have non-NULL children and all leaves are at the
+//    same depth.
+//
+// 'threads' is the number of worker threads to use; zero or less means
+// one per hardware thread. A NULL root is a valid, empty tree. Returns
+// report->valid; 'report' may be NULL if only the answer is wanted.
+bool validate_tree(btree* root, int threads, btree_validation* report);
+
+#endif